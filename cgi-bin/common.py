@@ -107,7 +107,7 @@ def get_fnames(path, duration, start_time=0, end_time=0):
         res = combine_fnames(ts1, ts2, path)
 	return (res, int(ts1), int(ts2))
 
-def generate_cmdargs(criteria, interval, threshold, nflows, duration, start_time, end_time, filter, outfmt, view, files):
+def generate_cmdargs(criteria, interval, threshold, nflows, duration, start_time, end_time, filter, outfmt, view, files, sample=None, deadline=None):
 	args = ''
 	if outfmt == 'json':
 		args += ' -p'
@@ -132,6 +132,15 @@ def generate_cmdargs(criteria, interval, threshold, nflows, duration, start_time
 		args += ' -f "%s"' % filter.replace("%20", " ")
 	if view and view == 'proto':
 		args += ' -P'
+	if sample:
+		# 'auto' or a rate, for a quick approximate answer
+		if sample == 'auto':
+			args += ' -R auto'
+		else:
+			args += ' -R %s' % int(sample)
+	if deadline:
+		# time limit of the aggregation in ms, for a coarser answer
+		args += ' --deadline-ms %s' % int(deadline)
 	if files:
 		args += ' %s' % files
 	return args
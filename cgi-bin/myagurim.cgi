@@ -34,7 +34,7 @@ else:
 (files, start_time, end_time) = common.get_fnames(datapath, duration, start_time, end_time)
 
 # generate a command
-cmd = agurimcmd + common.generate_cmdargs(fs.getfirst('criteria'), fs.getfirst('interval'), fs.getfirst('threshold'), fs.getfirst('nflows'), duration, start_time, end_time, fs.getfirst('filter'), fs.getfirst('outfmt', 'text'), fs.getfirst('view'), files)
+cmd = agurimcmd + common.generate_cmdargs(fs.getfirst('criteria'), fs.getfirst('interval'), fs.getfirst('threshold'), fs.getfirst('nflows'), duration, start_time, end_time, fs.getfirst('filter'), fs.getfirst('outfmt', 'text'), fs.getfirst('view'), files, fs.getfirst('sample'), fs.getfirst('deadline'))
 
 # exec command
 #sys.stderr.write('datapath: %s cmd: %s' % (datapath, cmd))        
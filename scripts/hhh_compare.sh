@@ -0,0 +1,113 @@
+#!/bin/sh
+#
+# usage:
+#  hhh_compare.sh [-a agurim] [-o 'agurim options'] [-r aguri3] [-v] files
+#
+# compare the HHH engines of agurim (-e lattice and -e sort) on
+# agurim files: report the aggregation times and the speedup, and
+# the lines of the outputs that differ.
+# the protocol shares of the outputs are checked, and the lines with
+# shares that cannot be re-aggregated (not a number, or adding up to
+# more than 100%) are counted.
+# with -r, the files are pcap files, and they are summarized by
+# 'aguri3 -e rhhh' first, so that the randomized HHH output is checked
+# to be re-aggregated.
+#
+
+agurim="/usr/local/bin/agurim"	# agurim program
+options=""			# other options passed to agurim
+aguri3=""			# aguri3 program for pcap files
+verbose=false
+usage="Usage: hhh_compare.sh [-a agurim] [-o 'agurim options'] [-r aguri3] [-v] files"
+
+# process arguments
+while getopts "a:o:r:v" opt; do
+    case $opt in
+	"a" ) agurim="$OPTARG" ;;
+	"o" ) options="$OPTARG" ;;
+	"r" ) aguri3="$OPTARG" ;;
+	"v" ) verbose=true ;;
+	* ) echo "${usage}" 1>&2
+	    exit 1 ;;
+    esac
+done
+shift $(($OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+    echo "${usage}" 1>&2
+    exit 1
+fi
+
+tmpdir=$(mktemp -d /tmp/hhh_compare.XXXXXX) || exit $?
+trap 'rm -rf "${tmpdir}"' 0
+
+# run agurim with an engine, and print the total aggregation time in ms
+run() {
+    engine=$1
+    file=$2
+    out="${tmpdir}/${engine}.out"
+    cmd="${agurim} -e ${engine} ${options} ${file}"
+    ${verbose} && echo "exec cmd: ${cmd}" 1>&2
+    eval "${cmd}" > "${out}" || return $?
+    grep '^%aggregated in' "${out}" | \
+	awk '{ ms += $3 } END { printf "%d", ms }'
+    grep -v '^%aggregated in' "${out}" > "${out}.body"
+}
+
+# print the number of the lines with the protocol shares that cannot
+# be re-aggregated.  a share is printed with 2 decimals, so that the
+# sum can exceed 100% by 0.005% for each share.
+badshares() {
+    awk '/^\t\[/ {
+	b = 0; p = 0; n = 0
+	for (i = 1; i + 2 <= NF; i += 3) {
+	    x = $(i + 1); y = $(i + 2)
+	    if (x !~ /^(-0\.00|[0-9.]+)%$/ || y !~ /^(-0\.00|[0-9.]+)%$/) {
+		n = -1; break
+	    }
+	    b += x + 0; p += y + 0; n++
+	}
+	if (n < 0 || b > 100 + n * 0.005 || p > 100 + n * 0.005)
+	    bad++
+    } END { printf "%d", bad }' "$@"
+}
+
+printf "%-32s %10s %10s %8s %8s %8s\n" "file" "lattice" "sort" "speedup" \
+    "diffs" "badshares"
+total=0
+nbad=0
+for file in "$@"; do
+    name=$(basename "${file}")
+    if [ -n "${aguri3}" ]; then
+	# summarize the pcap file by the randomized HHH
+	cmd="${aguri3} -e rhhh -r ${file}"
+	${verbose} && echo "exec cmd: ${cmd}" 1>&2
+	eval "${cmd}" > "${tmpdir}/rhhh.agr" || exit $?
+	file="${tmpdir}/rhhh.agr"
+    fi
+    t0=$(run lattice "${file}") || exit $?
+    t1=$(run sort "${file}") || exit $?
+    ndiffs=$(diff "${tmpdir}/lattice.out.body" "${tmpdir}/sort.out.body" | \
+	grep -c '^[<>]')
+    speedup=$(awk -v t0="${t0}" -v t1="${t1}" \
+	'BEGIN { if (t1 > 0) printf "%.2f", t0 / t1; else print "-" }')
+    bad=$(badshares "${file}" "${tmpdir}/lattice.out.body" \
+	"${tmpdir}/sort.out.body")
+    printf "%-32s %8dms %8dms %8s %8d %8d\n" "${name}" \
+	"${t0}" "${t1}" "${speedup}" "${ndiffs}" "${bad}"
+    if ${verbose} && [ "${ndiffs}" -ne 0 ]; then
+	diff "${tmpdir}/lattice.out.body" "${tmpdir}/sort.out.body"
+    fi
+    total=$((total + ndiffs))
+    nbad=$((nbad + bad))
+done
+
+# exit with 3 when the shares cannot be re-aggregated, and with 2 when
+# the outputs differ
+if [ "${nbad}" -ne 0 ]; then
+    exit 3
+fi
+if [ "${total}" -ne 0 ]; then
+    exit 2
+fi
+exit 0
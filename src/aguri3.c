@@ -100,6 +100,9 @@ static volatile sig_atomic_t gotsig_close, gotsig_hup;
 static uint64_t epoch = 0;	/* interval epoch for the main thread */
 static int exiting = 0;
 static pthread_mutex_t resp_mutex[2];
+static pthread_cond_t resp_cond[2];
+static int resp_ready[2];	/* filled by main, not yet aggregated */
+static uint64_t input_t0;	/* start of the input of cur_resp (for -x) */
 
 struct query query;
 int plot_phase;
@@ -120,13 +123,14 @@ usage()
 {
 	fprintf(stderr, "usage:\n");
 	fprintf(stderr, "  aguri3 [-dhvD]\n");
-	fprintf(stderr, "         [-c count] [-f 'pcapfilters']\n");
-	fprintf(stderr, "         [-i interval[,output_interval]]\n"); 
+	fprintf(stderr, "         [-c count] [-e lattice|sort|rhhh] [-f 'pcapfilters']\n");
+	fprintf(stderr, "         [-i interval[,output_interval]] [-j threads]\n"); 
 	fprintf(stderr, "         [-m byte|packet]\n"); 
 	fprintf(stderr, "         [-p pid_file] \n");
 	fprintf(stderr, "         [-r pcapfile] [-s pcap_snaplen]\n");
-	fprintf(stderr, "         [-t thresh_percentage] [-w outputfile]\n");
+	fprintf(stderr, "         [-t thresh_percentage] [-w outputfile] [-x]\n");
 	fprintf(stderr, "         [-H max_hashentries] [-I pcap_interface]\n");
+	fprintf(stderr, "         [-K topk] [-M shrink_epochs]\n");
 	fprintf(stderr, "         [-P rtprio] [-S start_time] [-E end_time]\n");
 	fprintf(stderr, "         [-T timeoffset]\n");
 	exit(1);
@@ -206,15 +210,21 @@ int main(int argc, char **argv)
 #ifdef __FreeBSD__
 	pthread_set_name_np(aggregator_thread, "aggregator");
 #endif
+	if (hhh_profile)
+		input_t0 = prof_usec();
 	if (pcapfile != NULL || pcap_interface != NULL)
 		pcap_read(pcapfile, pcap_interface, pcapfilters, pcap_snaplen);
 	else
 		read_flow(stdin); /* read binary aguri_flow */
+	if (hhh_profile)
+		prof_add(cur_resp, PROF_INPUT, input_t0);
 
 	sleep(1); /* give the aggregator a chance to catch up */
 	
 	/* let the aggregator process remaining data if any */
 	exiting = 1;
+	resp_ready[epoch & 1] = 1;
+	pthread_cond_signal(&resp_cond[epoch & 1]);
 	pthread_mutex_unlock(&resp_mutex[epoch & 1]);
 
 	pthread_join(aggregator_thread, NULL);
@@ -234,6 +244,7 @@ init(int argc, char **argv)
 	for (i = 0; i < 2; i++) {
 		responses[i] = response_alloc();
 		pthread_mutex_init(&resp_mutex[i], NULL);
+		pthread_cond_init(&resp_cond[i], NULL);
 	}
 	cur_resp  = responses[0];
 }
@@ -274,6 +285,8 @@ response_alloc(void)
 	TAILQ_INIT(&resp->odfq.odfq_head);
 	resp->odfq.nrecord = 0;
 	odhash_init(resp);
+	if (hhh_engine == HHH_RHHH)
+		resp->rhhh = rhhh_alloc(resp, max_hashentries);
 	return (resp);
 }
 
@@ -283,7 +296,7 @@ option_parse(int argc, void *argv)
 	int ch;
 	char *cp;
 
-	while ((ch = getopt(argc, argv, "c:df:hi:m:p:r:s:t:vw:DE:H:I:P:S:T:")) != -1) {
+	while ((ch = getopt(argc, argv, "c:de:f:hi:j:m:p:r:s:t:vw:xDE:H:I:K:M:P:S:T:")) != -1) {
 		switch (ch) {
 		case 'c':
 			query.count = strtol(optarg, NULL, 10);
@@ -291,6 +304,16 @@ option_parse(int argc, void *argv)
 		case 'd':
 			debug++;
 			break;
+		case 'e':
+			if (!strcmp(optarg, "lattice"))
+				hhh_engine = HHH_LATTICE;
+			else if (!strcmp(optarg, "sort"))
+				hhh_engine = HHH_SORT;
+			else if (!strcmp(optarg, "rhhh"))
+				hhh_engine = HHH_RHHH;
+			else
+				usage();
+			break;
 		case 'f':
 			pcapfilters = optarg;
 			break;
@@ -304,6 +327,11 @@ option_parse(int argc, void *argv)
 			else
 				query.output_interval = 0;
 			break;
+		case 'j':
+			hhh_nthreads = strtol(optarg, NULL, 10);
+			if (hhh_nthreads < 1)
+				usage();
+			break;
 		case 'm':
 			if (!strncmp(optarg, "byte", 4))
 				query.criteria = BYTE;
@@ -330,6 +358,9 @@ option_parse(int argc, void *argv)
 		case 'w':
 			wfile = optarg;
 			break;
+		case 'x':
+			hhh_profile = 1;
+			break;
 		case 'D':
 			disable_heuristics++;  /* disable label heuristics */
 			break;
@@ -342,6 +373,14 @@ option_parse(int argc, void *argv)
 		case 'I':
 			pcap_interface = optarg;
 			break;
+		case 'K':
+			odproto_topk = strtol(optarg, NULL, 10);
+			if (odproto_topk < 1)
+				usage();
+			break;
+		case 'M':
+			odpool_shrinkepochs = strtol(optarg, NULL, 10);
+			break;
 		case 'P':
 			use_rtprio = strtol(optarg, NULL, 10);
 			break;
@@ -357,6 +396,9 @@ option_parse(int argc, void *argv)
 		}
 	}
 
+	if (hhh_engine == HHH_RHHH && query.output_interval != 0)
+		errx(1, "-e rhhh does not support output_interval");
+
 	if (wfile == NULL || !strcmp(wfile, "-"))
 		wfp = stdout;
 	else if ((wfp = fopen(wfile, "w")) == NULL)
@@ -368,7 +410,11 @@ switch_response(void)
 {
 	int rval;
 
-	/* release the current response */
+	if (hhh_profile)
+		prof_add(cur_resp, PROF_INPUT, input_t0);
+	/* hand the current response to the aggregator, and release it */
+	resp_ready[epoch & 1] = 1;
+	pthread_cond_signal(&resp_cond[epoch & 1]);
 	if ((rval = pthread_mutex_unlock(&resp_mutex[epoch & 1])) != 0)
 		err(1, "mutex_lock returned %d", rval);
 	
@@ -385,17 +431,37 @@ switch_response(void)
 		if ((rval = pthread_mutex_lock(&resp_mutex[epoch & 1])) != 0)
 			err(1, "mutex_lock returned %d", rval);
 	}
+	/*
+	 * the mutex alone does not order the threads: we could get the
+	 * lock again before the aggregator takes the response.
+	 */
+	while (resp_ready[epoch & 1]) {
+		blocking_count++;
+		if ((rval = pthread_cond_wait(&resp_cond[epoch & 1],
+		    &resp_mutex[epoch & 1])) != 0)
+			err(1, "cond_wait returned %d", rval);
+	}
+	if (hhh_profile)
+		input_t0 = prof_usec();
 }
 
 static void
 save_results(struct response *resp, struct saved_results *prev)
 {
+	struct odflow *odfp;
+
 	prev->start_time   = resp->start_time;
 	prev->end_time     = resp->end_time;
 	prev->total_byte   = resp->total_byte;
 	prev->total_packet = resp->total_packet;
 
-	/* move all odflows from the response to the results */
+	/*
+	 * move all odflows from the response to the results.
+	 * the sub-odflows still belong to the pool of the response,
+	 * so detach them before the pool is reset.
+	 */
+	TAILQ_FOREACH(odfp, &resp->odfq.odfq_head, odf_chain)
+		odflow_detach(odfp);
 	odfq_moveall(&resp->odfq, &prev->odfq);
 }
 
@@ -429,8 +495,8 @@ restore_results(struct response *resp, struct saved_results *prev)
 
 	/* move all the odflows from the saved results to the
 	 * corresponding hash in the response.
-	 * XXX place all odflows onto slot 0 of the hash table since 
-	 *  the odflows are soon moved to the flow_list for aggregation
+	 * the odflows are copied into the pool of the response so that
+	 * they can be dropped with the input odflows.
 	 */
 	while ((odfp = TAILQ_FIRST(&prev->odfq.odfq_head)) != NULL) {
 		TAILQ_REMOVE(&prev->odfq.odfq_head, odfp, odf_chain);
@@ -439,12 +505,7 @@ restore_results(struct response *resp, struct saved_results *prev)
 			odfh = resp->ip_hash;
 		else
 			odfh = resp->ip6_hash;
-
-		TAILQ_INSERT_TAIL(&odfh->tbl[0].odfq_head, odfp, odf_chain);
-		odfh->nrecord++;
-		odfh->tbl[0].nrecord++;
-		odfh->byte   += odfp->byte;
-		odfh->packet += odfp->packet;
+		odflow_import(odfh, odfp);
 	}
 
 	prev->start_time = 0;
@@ -470,6 +531,18 @@ aggregator(void *thdata)
 		if ((rval = pthread_mutex_lock(&resp_mutex[my_epoch & 1])) != 0)
 			err(1, "mutex_lock returned %d", rval);
 
+		/* wait until main has filled this response */
+		while (!resp_ready[my_epoch & 1] && !exiting) {
+			if ((rval = pthread_cond_wait(&resp_cond[my_epoch & 1],
+			    &resp_mutex[my_epoch & 1])) != 0)
+				err(1, "cond_wait returned %d", rval);
+		}
+		if (!resp_ready[my_epoch & 1]) {
+			/* exiting, and nothing left to process */
+			pthread_mutex_unlock(&resp_mutex[my_epoch & 1]);
+			break;
+		}
+
 		my_resp = responses[my_epoch & 1];
 
 		if (query.output_interval != 0 && prev->start_time != 0)
@@ -484,6 +557,13 @@ aggregator(void *thdata)
 			else
 				make_output(my_resp);
 		}
+		if (debug) {
+			odpool_stats(my_resp->pool);
+			odhash_stats(my_resp->ip_hash, "ip_hash");
+			odhash_stats(my_resp->ip6_hash, "ip6_hash");
+			if (my_resp->rhhh != NULL)
+				rhhh_stats(my_resp->rhhh);
+		}
 		odhash_resetall(my_resp);
 #ifndef NDEBUG	/* for thread-safe odflow accounting */
 		if (debug) {
@@ -491,13 +571,13 @@ aggregator(void *thdata)
 			odflow_stats();
 		}
 #endif
+		resp_ready[my_epoch & 1] = 0;
+		pthread_cond_signal(&resp_cond[my_epoch & 1]);
 		if ((rval = pthread_mutex_unlock(&resp_mutex[my_epoch & 1])) != 0)
 			err(1, "mutex_unlock returned %d", rval);
 
 		my_epoch++;
 
-		if (exiting)
-			break;
 		/*
 		 * when writing to a file, SIGHUP is used to
 		 * reopen the output file.
@@ -624,7 +704,10 @@ do_agflow(const struct aguri_flow *agf)
 	memcpy(&odfsp.dst, agf->agflow_fs.fs_dstaddr, len / 8);
 	odfsp.srclen = len;
 	odfsp.dstlen = len;
-	odfp = odflow_addcount(&odfsp, af, byte, packet, cur_resp);
+	if (cur_resp->rhhh != NULL)
+		odfp = rhhh_addcount(&odfsp, af, byte, packet, cur_resp);
+	else
+		odfp = odflow_addcount(&odfsp, af, byte, packet, cur_resp);
 
 	odpsp.src[0] = agf->agflow_fs.fs_prot;
 	odpsp.dst[0] = agf->agflow_fs.fs_prot;
@@ -632,7 +715,7 @@ do_agflow(const struct aguri_flow *agf)
 	memcpy(&odpsp.dst[1], &agf->agflow_fs.fs_dport, 2);
 	odpsp.srclen = 24;
 	odpsp.dstlen = 24;
-	odproto_addcount(odfp, &odpsp, AF_LOCAL, byte, packet);
+	odproto_addcount(odfp, &odpsp, AF_LOCAL, byte, packet, cur_resp);
 
 	return (1);
 }
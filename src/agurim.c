@@ -32,6 +32,7 @@
 #define _DEFAULT_SOURCE	/* for strsep in linux */
 #endif
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 
@@ -50,10 +51,26 @@
 #include <time.h>
 #include <unistd.h>
 #include <limits.h>
+#include <getopt.h>
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
 
 #include "agurim.h"
 #include "aguri_flow.h"
 
+/*
+ * an input file mapped in memory, or a stream read by fgets() when the
+ * input can't be mapped (e.g., a pipe).  the lines are parsed in place,
+ * and a line ends before '\n' or at the end of the input, without '\0'.
+ */
+struct input {
+	char	*cp, *end;	/* the rest of the mapped input */
+	char	*map;		/* the mapping, or NULL for fgets() */
+	size_t	mapsize;
+	FILE	*fp;
+	char	*buf;		/* a line read by fgets(), or a copy */
+	size_t	bufsz;
+};
 
 static void init(int argc, char **argv);
 static void finish(void);
@@ -62,17 +79,39 @@ static struct response *response_alloc(void);
 static void option_parse(int argc, void *argv);
 static int filter_parse(char *str);
 static void file_parse(char **files);
+static void read_path(const char *file);
 static void read_file(FILE *fp);
+static void parse_bench(FILE *fp, const char *file);
+static void input_open(struct input *in, FILE *fp, int map);
+static char *input_line(struct input *in, char **endp);
+static char *input_cstr(struct input *in, char *cp, char *end);
+static void input_close(struct input *in);
 static int is_preambles(char *buf);
+static void time_start(time_t t);
+static void time_end(time_t t);
+static void incache_event(int type);
+static void incache_time(int type, time_t t);
+static void incache_add(struct odflow_spec *odfsp, int af, uint64_t byte,
+    uint64_t packet);
+static void incache_flush(void);
+static void incache_replay(void);
+static void incache_free(void);
 static int ip_addrparser(char *buf, void *ip, uint8_t *prefixlen);
 static int address_parse(char *buf, struct odflow_spec *odfsp,
                             uint64_t *byte, uint64_t *packet);
 static int protospec_parse(char *buf, struct odflow_spec *odpsp,
 		double *perc, double *perc2);
-static char *proto_parse(char **strp, uint64_t byte, uint64_t packet,
-    struct odflow_spec *odpsp, uint64_t *byte2, uint64_t *packet2);
+static int addr_scan(char *cp, char *end, void *ip, uint8_t *prefixlen);
+static int address_scan(struct input *in, char *cp, char *end,
+    struct odflow_spec *odfsp, uint64_t *byte, uint64_t *packet);
+static char *proto_scan(char **strp, char *end, uint64_t byte,
+    uint64_t packet, struct odflow_spec *odpsp, uint64_t *byte2,
+    uint64_t *packet2);
 static int match_filter(struct odflow_spec *r);
+static int sample_weight(char *buf, char *end);
+static off_t input_size(char **files, int n);
 static int read_flow(FILE *fp);
+static int aggregate_output(void);
 static struct response *response;
 
 struct query query;
@@ -86,7 +125,44 @@ unsigned int blocking_count; /* thread blocking counter for aguri3 */
 FILE *wfp;
 
 static int flow_mode = 0;  /* read binary aguri_flow inputs from stdin */
+static int bench_parse = 0;  /* time parsing the inputs (--bench-parse) */
+
+/*
+ * input cache for plotting: the first pass records the start and end
+ * times of the summaries and the counts added to the flow hash(es) by
+ * the second pass, and the second pass replays them instead of reading
+ * the inputs again.  this allows plotting from stdin.
+ * the events are encoded in a byte stream: a type byte, followed by
+ * the time, or by af, the prefix lengths, the addresses (4, 16 or 3
+ * bytes for af) and the counts as varints for a count.
+ * above INCACHE_MAXMEM, the stream is spilled to a temporary file in
+ * blocks, and the blocks are read back in the replay.
+ */
+#define INC_FILE	1	/* a new input file */
+#define INC_START	2	/* StartTime */
+#define INC_END		3	/* EndTime */
+#define INC_LINE	4	/* a line, which stops a finished file */
+#define INC_ADD		5	/* counts added to the hash */
+#define INCACHE_MAXEVENT	(4 + 2 * MAXLEN + 2 * 10)
+#define INCACHE_MAXMEM	(64*1024*1024)
+
+static struct {
+	uint8_t *buf;
+	size_t	len, size;
+	FILE	*spill;		/* spilled blocks, or NULL */
+	uint64_t nbytes;	/* bytes in total (for -v) */
+	int	last;		/* type of the last event */
+} incache;
+static int incache_on;	/* recording in the first pass */
+static uint64_t input_t0;  /* start of the input phase (for -x) */
+/* for -R auto, take a sample of about this size from the inputs */
+#define SAMPLE_AUTOBYTES	(4*1024*1024)
 static char *filter_str = NULL;
+static const struct option longopts[] = {
+	{ "bench-parse", no_argument, NULL, 'B' },
+	{ "deadline-ms", required_argument, NULL, 'L' },
+	{ NULL, 0, NULL, 0 }
+};
 
 static void
 usage()
@@ -94,11 +170,14 @@ usage()
 	fprintf(stderr, "usage:\n");
 	fprintf(stderr, "  agurim [-dhpFP]\n");
 	fprintf(stderr, "         [-f '<src> <dst>' or '<proto>:<sport>:<dport>'\n");
-	fprintf(stderr, "         [-i interval]\n"); 
+	fprintf(stderr, "         [-e engine (lattice/sort)]\n"); 
+	fprintf(stderr, "         [-i interval] [-j threads]\n"); 
 	fprintf(stderr, "         [-m criteria (byte/packet)]\n"); 
 	fprintf(stderr, "         [-n nflows] [-s duration] \n");
-	fprintf(stderr, "         [-t thresh_percentage] [-w outputfile]\n");
+	fprintf(stderr, "         [-R sample_rate (n/auto)]\n");
+	fprintf(stderr, "         [-t thresh_percentage[,...]] [-w outputfile] [-x]\n");
 	fprintf(stderr, "         [-S start_time] [-E end_time]\n");
+	fprintf(stderr, "         [--deadline-ms ms] [--bench-parse]\n");
 	fprintf(stderr, "         files or directories\n");
 	exit(1);
 }
@@ -113,12 +192,34 @@ int main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (bench_parse) {
+		/* only time parsing the input files */
+		if (argc == 0)
+			usage();
+		for (i = 0; i < argc; i++)
+			file_parse(&argv[i]);
+		finish();
+		return (0);
+	}
+
+	if (query.sample_rate < 0) {
+		/* -R auto: choose the rate from the size of the inputs */
+		query.sample_rate = input_size(argv, argc) / SAMPLE_AUTOBYTES + 1;
+		if (verbose)
+			fprintf(stderr, "sample_rate: %d\n", query.sample_rate);
+	}
+
+	/* plotting reads the inputs once, and replays them from the cache */
+	incache_on = query.outfmt != REAGGREGATION;
+
 	for (i = 0; i < 2; i++) {
 		n = argc;
 		files = argv;
 
-		if (n == 0) {
-			if (query.outfmt != REAGGREGATION)
+		if (plot_phase) {
+			incache_replay();
+		} else if (n == 0) {
+			if (query.outfmt != REAGGREGATION && flow_mode)
 				usage();
 			if (isatty(fileno(stdin)))
 				fprintf(stderr, "reading %s data from stdin...\n",
@@ -148,23 +249,27 @@ int main(int argc, char **argv)
 			break;
 		}
 
+		if (query.outfmt == REAGGREGATION) {
+			/* only one pass for reaggregation */
+			(void)aggregate_output();
+			break;
+		}
+
 		/* aggregate odflows in the hash(es) */
 		nflows = hhh_run(response);
 		if (nflows == 0)
 			/* no output produced */
 			break;
 
-		if (query.outfmt == REAGGREGATION)
-			/* only one pass for reaggregation */
-			break;
-
-		/* for plotting, need to re-read the files in the 2nd pass */
+		/* for plotting, need to replay the inputs in the 2nd pass */
 		odhash_resetall(response);
 		plot_prepare(response);
 		is_finish = 0;
 		response->start_time = 0;
 		plot_phase = 1;
+		incache_on = 0;
 	}
+	incache_free();
 	if (nflows > 0)
 		make_output(response);
 
@@ -187,6 +292,8 @@ finish(void)
 	if (wfp != stdout)
 		if (fclose(wfp) != 0)
 			err(1, "fclose failed");
+	if (verbose)
+		odpool_stats(response->pool);
 }
 
 static void
@@ -202,6 +309,11 @@ query_init(void)
 		else
 			query.threshold = 3; /* 3% otherwise */
 	}
+	if (query.nthresholds <= 1) {
+		query.thresholds[0] = query.threshold;
+		query.nthresholds = 1;
+	} else if (query.outfmt != REAGGREGATION)
+		errx(1, "a list of thresholds is only for the aguri output");
 	if (query.outfmt == REAGGREGATION)
 		return;
 	if (!query.nflows)
@@ -240,15 +352,25 @@ response_alloc(void)
 static void
 option_parse(int argc, void *argv)
 {
-	int ch;
+	int ch, i, t;
+	char *cp, *ep;
 	const char *wfile = NULL;
 
-	while ((ch = getopt(argc, argv, "df:hi:m:n:ps:t:vw:DE:FPS:")) != -1) {
+	while ((ch = getopt_long(argc, argv,
+	    "de:f:hi:j:m:n:ps:t:vw:xBDE:FL:PR:S:", longopts, NULL)) != -1) {
 		switch (ch) {
 		case 'd':	/* Set the output format = txt */
 			query.outfmt = DEBUG;
 			query.criteria = BYTE;
 			break;
+		case 'e':
+			if (!strcmp(optarg, "lattice"))
+				hhh_engine = HHH_LATTICE;
+			else if (!strcmp(optarg, "sort"))
+				hhh_engine = HHH_SORT;
+			else
+				usage();
+			break;
 		case 'f':	/* Filter */
 			filter_str = optarg;
 			break;
@@ -258,6 +380,11 @@ option_parse(int argc, void *argv)
 		case 'i':
 			query.interval = strtol(optarg, NULL, 10);
 			break;
+		case 'j':
+			hhh_nthreads = strtol(optarg, NULL, 10);
+			if (hhh_nthreads < 1)
+				usage();
+			break;
 		case 'm':
 			if (!strncmp(optarg, "byte", 4))
 				query.criteria = BYTE;
@@ -280,7 +407,33 @@ option_parse(int argc, void *argv)
 			query.duration = strtol(optarg, NULL, 10);
 			break;
 		case 't':
-			query.threshold = strtod(optarg, NULL);
+			/* a threshold, or a list of them: "1,3,5" */
+			cp = optarg;
+			query.nthresholds = 0;
+			do {
+				t = strtod(cp, &ep);
+				if (ep == cp || (*ep != ',' && *ep != '\0'))
+					usage();  /* empty or not a number */
+				cp = ep;
+				for (i = 0; i < query.nthresholds; i++)
+					if (query.thresholds[i] == t)
+						break;
+				if (i < query.nthresholds)
+					continue;  /* a duplicate */
+				if (query.nthresholds == MAX_THRESHOLDS)
+					usage();
+				/* keep them in the ascending order */
+				for (i = query.nthresholds; i > 0 &&
+				    query.thresholds[i - 1] > t; i--)
+					query.thresholds[i] =
+					    query.thresholds[i - 1];
+				query.thresholds[i] = t;
+				query.nthresholds++;
+			} while (*cp++ == ',');
+			/* 0 is for the default, not in a list */
+			if (query.nthresholds > 1 && query.thresholds[0] < 1)
+				usage();
+			query.threshold = query.thresholds[0];
 			break;
 		case 'v':
 			verbose++;
@@ -288,6 +441,12 @@ option_parse(int argc, void *argv)
 		case 'w':
 			wfile = optarg;
 			break;
+		case 'x':
+			hhh_profile = 1;
+			break;
+		case 'B':	/* --bench-parse */
+			bench_parse = 1;
+			break;
 		case 'D':
 			disable_heuristics++;  /* disable label heuristics */
 			break;
@@ -297,9 +456,20 @@ option_parse(int argc, void *argv)
 		case 'F':
 			flow_mode = 1;
 			break;
+		case 'L':	/* --deadline-ms */
+			if ((hhh_deadline_ms = strtol(optarg, NULL, 10)) < 1)
+				usage();
+			break;
 		case 'P':
 			proto_view = 1;
 			break;
+		case 'R':
+			if (!strcmp(optarg, "auto"))
+				query.sample_rate = -1;
+			else if ((query.sample_rate =
+			    strtol(optarg, NULL, 10)) < 1)
+				usage();
+			break;
 		case 'S':
 			query.start_time = strtol(optarg, NULL, 10);
 			break;
@@ -319,6 +489,50 @@ option_parse(int argc, void *argv)
 
 }
 
+/*
+ * aggregate the odflows in the hash(es), and make the output for each
+ * threshold in the -t list.  each output is the same as the one of a
+ * run with the threshold alone.  the runs but the last leave the
+ * inputs in place for the next one, and share the input odflows and
+ * the memo of their aggregates.  the search below them depends on
+ * the threshold, and is made again for each.
+ * returns the number of the flows for the first threshold.
+ */
+static int
+aggregate_output(void)
+{
+	uint64_t sample_records = 0, sample_taken = 0;
+	double sample_sqbyte = 0.0, sample_sqpacket = 0.0;
+	int i, nflows, nflows0 = 0;
+
+	for (i = 0; i < query.nthresholds; i++) {
+		query.threshold = query.thresholds[i];
+		if (i == 0) {
+			/* make_output() clears the sample stats */
+			sample_records = response->sample_records;
+			sample_taken = response->sample_taken;
+			sample_sqbyte = response->sample_sqbyte;
+			sample_sqpacket = response->sample_sqpacket;
+		} else {
+			response->sample_records = sample_records;
+			response->sample_taken = sample_taken;
+			response->sample_sqbyte = sample_sqbyte;
+			response->sample_sqpacket = sample_sqpacket;
+		}
+		response->keep_inputs = (i + 1 < query.nthresholds);
+		nflows = hhh_run(response);
+		if (i == 0)
+			nflows0 = nflows;
+		if (nflows > 0)
+			make_output(response);
+		if (nflows == 0)
+			break;	/* no output produced */
+	}
+	response->keep_inputs = 0;
+	query.threshold = query.thresholds[0];
+	return (nflows0);
+}
+
 /* filter format: '<src> <dst>' */
 static int
 filter_parse(char *str)
@@ -358,7 +572,6 @@ static void
 file_parse(char **files)
 {
 	struct stat st;
-	FILE *fp;
         int i, m;
 	char file[PATH_MAX+1];
 
@@ -382,10 +595,7 @@ file_parse(char **files)
                         if (!strncmp(flist[i]->d_name, "..", 2)) 
                                 continue;
                         snprintf(file, sizeof(file), "%s/%s", *files, flist[i]->d_name);
-			if ((fp = fopen(file, "r")) == NULL)
-				err(1, "can't open %s", file);
-			read_file(fp);
-			(void)fclose(fp);
+			read_path(file);
                 }   
         } else  {
 #ifdef __linux__
@@ -393,41 +603,65 @@ file_parse(char **files)
 #else		
 		strlcpy(file, *files, sizeof(file));
 #endif		
-		if ((fp = fopen(file, "r")) == NULL)
-			err(1, "can't open %s", file);
-		read_file(fp);
-		(void)fclose(fp);
+		read_path(file);
 	}
 }
 
+/* read a file, or time parsing it for --bench-parse */
+static void
+read_path(const char *file)
+{
+	FILE *fp;
+
+	if ((fp = fopen(file, "r")) == NULL)
+		err(1, "can't open %s", file);
+	if (bench_parse)
+		parse_bench(fp, file);
+	else
+		read_file(fp);
+	(void)fclose(fp);
+}
+
 static void
 read_file(FILE *fp)
 {
 	struct odflow *odfp = NULL;
 	struct odflow_spec odfsp;
 	struct odflow_spec odpsp;
+	struct input in;
 	uint64_t byte, byte2;
 	uint64_t packet, packet2;
-	int af;
-	char *buf, *cp;
-	int bufsz;
+	int af, weight;
+	char *cp, *end;
 	static struct odflow_spec zero;	/* wildcard odflow_spec */
 
-	bufsz = BUFSIZ*2;
-	buf = malloc(bufsz);
+	if (hhh_profile)
+		input_t0 = prof_usec();
+	input_open(&in, fp, 1);
+	if (incache_on)
+		incache_event(INC_FILE);
 
-	while (fgets(buf, bufsz, fp)) {
-		if (is_preambles(buf))
+	while ((cp = input_line(&in, &end)) != NULL) {
+		if (cp < end && (*cp == '#' || *cp == '%') &&
+		    is_preambles(input_cstr(&in, cp, end)))
 			continue;
+		if (incache_on && incache.last != INC_ADD &&
+		    incache.last != INC_LINE)
+			incache_event(INC_LINE);
 		if (is_finish)	/* the duration is expired */
 			break;
 		/* skip until the specified start_time */
 		if (response->start_time == 0)
 			continue;
-		if (buf[0] != '[')  /* address line starts with "[rank]" */
+		if (cp == end || *cp != '[')  /* address line starts with "[rank]" */
+			continue;
+		/* the sub-odflow line of a skipped record is skipped above */
+		weight = 1;
+		if (query.sample_rate > 1 &&
+		    (weight = sample_weight(cp, end)) == 0)
 			continue;
 
-		af = address_parse(buf, &odfsp, &byte, &packet);
+		af = address_scan(&in, cp, end, &odfsp, &byte, &packet);
 		if (af < 0)
 			err(1, "address_parse() finds wrong address type.");
 
@@ -440,13 +674,28 @@ read_file(FILE *fp)
 				continue;
 		}
 
+		if (weight > 1) {
+			/* scale the counts of the record taken */
+			if (!plot_phase) {
+				response->sample_taken++;
+				response->sample_sqbyte += (double)byte * byte;
+				response->sample_sqpacket +=
+				    (double)packet * packet;
+			}
+			byte *= weight;
+			packet *= weight;
+		}
+
 		/* insert a record into a hash table */
-		if (proto_view == 0)
+		if (proto_view == 0) {
 			odfp = odflow_addcount(&odfsp, af, byte, packet, response);
+			if (incache_on)
+				incache_add(&odfsp, af, byte, packet);
+		}
 
 		/* add decomposition of the origin and destination flow */
-		if (fgets(buf, bufsz, fp) == NULL)
-			err(1, "fgets error\n");
+		if ((cp = input_line(&in, &end)) == NULL)
+			errx(1, "no sub-odflow line at the end of the input");
 
 		if (plot_phase != 0 && proto_view == 0)
 			continue;
@@ -454,18 +703,23 @@ read_file(FILE *fp)
 		/*
 		 * for the first round, add a sub-record into a hash table.
 		 */
-		cp = buf;
-		while (proto_parse(&cp, byte, packet, &odpsp, &byte2, &packet2) != NULL) {
+		while (proto_scan(&cp, end, byte, packet, &odpsp, &byte2,
+		    &packet2) != NULL) {
 			if (query.f_af == AF_LOCAL)
 				if (!match_filter(&odpsp))
 					continue;
 
 			if (proto_view == 0) {
-				odproto_addcount(odfp, &odpsp, AF_LOCAL, byte2, packet2);
+				odproto_addcount(odfp, &odpsp, AF_LOCAL, byte2, packet2,
+				    response);
 			} else {
 				odfp = odflow_addcount(&odpsp, AF_LOCAL, byte2, packet2, response);
+				if (incache_on)
+					incache_add(&odpsp, AF_LOCAL, byte2,
+					    packet2);
 				if (!plot_phase)
-					odproto_addcount(odfp, &odfsp, af, byte2, packet2);
+					odproto_addcount(odfp, &odfsp, af, byte2, packet2,
+					    response);
 				byte -= byte2;
 				packet -= packet2;
 			}
@@ -474,11 +728,368 @@ read_file(FILE *fp)
 			&& (byte > 0 || packet > 0)) {
 			/* add remaining counts to the wildcard proto */
 			odfp = odflow_addcount(&zero, AF_LOCAL, byte, packet, response);
+			if (incache_on)
+				incache_add(&zero, AF_LOCAL, byte, packet);
 			if (!plot_phase)
-				odproto_addcount(odfp, &odfsp, af, byte, packet);
+				odproto_addcount(odfp, &odfsp, af, byte, packet,
+				    response);
 		}
 	}
-	free(buf);
+	if (hhh_profile)
+		prof_add(response, PROF_INPUT, input_t0);
+	input_close(&in);
+}
+
+/*
+ * time parsing a file for --bench-parse: tokenize the lines and parse
+ * the records as read_file() does without adding them to the hash,
+ * from the mapped file and then by fgets(), and print the throughputs.
+ * the sum of the parsed values should be the same for both.
+ * a stream that can't be rewound (e.g., a pipe) is parsed once.
+ */
+static void
+parse_bench(FILE *fp, const char *file)
+{
+	struct odflow_spec odfsp, odpsp;
+	struct input in;
+	uint64_t byte, packet, byte2, packet2, sum[2], t;
+	uint64_t nbytes, nlines, nrecords, nsubs;
+	double mbps[2];
+	char *cp, *end;
+	size_t i;
+	int mapped = 0, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		if (pass > 0 && fseeko(fp, 0, SEEK_SET) < 0)
+			break;
+		sum[pass] = nbytes = nlines = nrecords = nsubs = 0;
+		t = prof_usec();
+		input_open(&in, fp, pass == 0);
+		if (pass == 0)
+			mapped = in.map != NULL;
+		while ((cp = input_line(&in, &end)) != NULL) {
+			nbytes += end - cp + 1;
+			nlines++;
+			if (cp == end || *cp != '[')
+				continue;
+			if (address_scan(&in, cp, end, &odfsp, &byte,
+			    &packet) < 0)
+				continue;
+			nrecords++;
+			for (i = 0; i < sizeof(odfsp.src); i++)
+				sum[pass] += odfsp.src[i] + odfsp.dst[i];
+			sum[pass] += odfsp.srclen + odfsp.dstlen + byte + packet;
+			if ((cp = input_line(&in, &end)) == NULL)
+				break;
+			nbytes += end - cp + 1;
+			nlines++;
+			while (proto_scan(&cp, end, byte, packet, &odpsp,
+			    &byte2, &packet2) != NULL) {
+				nsubs++;
+				sum[pass] += odpsp.src[0] + odpsp.src[1] +
+				    odpsp.src[2] + odpsp.dst[0] + odpsp.dst[1] +
+				    odpsp.dst[2] + odpsp.srclen + odpsp.dstlen +
+				    byte2 + packet2;
+			}
+		}
+		input_close(&in);
+		t = prof_usec() - t;
+		mbps[pass] = (double)nbytes / (t > 0 ? t : 1);
+	}
+	fprintf(wfp, "%s: %" PRIu64 " lines, %" PRIu64 " records, %" PRIu64
+	    " sub-records, %s %.1fMB/s", file, nlines, nrecords, nsubs,
+	    mapped ? "mmap" : "fgets", mbps[0]);
+	if (pass == 2)
+		fprintf(wfp, ", fgets %.1fMB/s, %s", mbps[1],
+		    sum[0] == sum[1] ? "same" : "DIFFERENT");
+	fprintf(wfp, "\n");
+}
+
+/*
+ * set up an input: map a regular file (or the rest of it) with
+ * sequential access and readahead, or fall back to fgets().
+ */
+static void
+input_open(struct input *in, FILE *fp, int map)
+{
+	struct stat st;
+	off_t off;
+	char *p;
+
+	memset(in, 0, sizeof(*in));
+	in->fp = fp;
+	in->bufsz = BUFSIZ*2;
+	if ((in->buf = malloc(in->bufsz)) == NULL)
+		err(1, "malloc");
+	if (!map || fstat(fileno(fp), &st) < 0 || !S_ISREG(st.st_mode) ||
+	    (off = ftello(fp)) < 0 || st.st_size <= off ||
+	    (uintmax_t)st.st_size > SIZE_MAX)
+		return;
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (p == MAP_FAILED)
+		return;
+	(void)madvise(p, st.st_size, MADV_SEQUENTIAL);
+	(void)madvise(p, st.st_size, MADV_WILLNEED);
+	in->map = p;
+	in->mapsize = st.st_size;
+	in->cp = p + off;
+	in->end = p + st.st_size;
+}
+
+/* the next line and its end (before '\n'), or NULL at the end */
+static char *
+input_line(struct input *in, char **endp)
+{
+	char *cp, *ep;
+
+	if (in->map == NULL) {
+		if (fgets(in->buf, in->bufsz, in->fp) == NULL)
+			return (NULL);
+		ep = in->buf + strlen(in->buf);
+		if (ep > in->buf && ep[-1] == '\n')
+			ep--;
+		*endp = ep;
+		return (in->buf);
+	}
+	if ((cp = in->cp) >= in->end)
+		return (NULL);
+	if ((ep = memchr(cp, '\n', in->end - cp)) != NULL)
+		in->cp = ep + 1;
+	else
+		in->cp = ep = in->end;
+	*endp = ep;
+	return (cp);
+}
+
+/* a '\0' terminated copy of a line for the parsers working on strings */
+static char *
+input_cstr(struct input *in, char *cp, char *end)
+{
+	size_t len = end - cp;
+
+	if (cp == in->buf) {
+		*end = '\0';	/* read by fgets(): in place */
+		return (cp);
+	}
+	if (len >= in->bufsz) {
+		in->bufsz = len + 1;
+		if ((in->buf = realloc(in->buf, in->bufsz)) == NULL)
+			err(1, "realloc");
+	}
+	memcpy(in->buf, cp, len);
+	in->buf[len] = '\0';
+	return (in->buf);
+}
+
+static void
+input_close(struct input *in)
+{
+	if (in->map != NULL) {
+		(void)munmap(in->map, in->mapsize);
+		/* leave the stream at the end as if read through */
+		(void)fseeko(in->fp, 0, SEEK_END);
+	}
+	free(in->buf);
+}
+
+/* make room for an event: grow the buffer, or spill it */
+static void
+incache_event(int type)
+{
+	if (incache.len + INCACHE_MAXEVENT > incache.size) {
+		if (incache.size < INCACHE_MAXMEM) {
+			incache.size = incache.size == 0 ?
+			    1024*1024 : incache.size * 2;
+			incache.buf = realloc(incache.buf, incache.size);
+			if (incache.buf == NULL)
+				err(1, "realloc(incache) failed!");
+		} else
+			incache_flush();
+	}
+	incache.buf[incache.len++] = type;
+	incache.last = type;
+}
+
+static void
+incache_time(int type, time_t t)
+{
+	int64_t v = t;
+
+	incache_event(type);
+	memcpy(&incache.buf[incache.len], &v, sizeof(v));
+	incache.len += sizeof(v);
+}
+
+static inline uint8_t *
+varint_put(uint8_t *p, uint64_t v)
+{
+	while (v >= 0x80) {
+		*p++ = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return (p);
+}
+
+static inline uint8_t *
+varint_get(uint8_t *p, uint64_t *vp)
+{
+	uint64_t v = 0;
+	int shift = 0;
+
+	while (*p & 0x80) {
+		v |= (uint64_t)(*p++ & 0x7f) << shift;
+		shift += 7;
+	}
+	*vp = v | (uint64_t)*p++ << shift;
+	return (p);
+}
+
+/* bytes of the addresses kept for af */
+static inline int
+incache_addrlen(int af)
+{
+	switch (af) {
+	case AF_INET:
+		return (4);
+	case AF_INET6:
+		return (16);
+	case AF_LOCAL:
+		return (3);	/* proto:sport:dport */
+	default:
+		return (MAXLEN);
+	}
+}
+
+static void
+incache_add(struct odflow_spec *odfsp, int af, uint64_t byte, uint64_t packet)
+{
+	uint8_t *p;
+	int n = incache_addrlen(af);
+
+	incache_event(INC_ADD);
+	p = &incache.buf[incache.len];
+	*p++ = af;
+	*p++ = odfsp->srclen;
+	*p++ = odfsp->dstlen;
+	memcpy(p, odfsp->src, n);
+	p += n;
+	memcpy(p, odfsp->dst, n);
+	p += n;
+	p = varint_put(p, byte);
+	p = varint_put(p, packet);
+	incache.len = p - incache.buf;
+}
+
+/* write the buffer to the spill file as a block */
+static void
+incache_flush(void)
+{
+	if (incache.spill == NULL && (incache.spill = tmpfile()) == NULL)
+		err(1, "tmpfile(incache) failed!");
+	if (fwrite(&incache.len, sizeof(incache.len), 1, incache.spill) != 1 ||
+	    fwrite(incache.buf, 1, incache.len, incache.spill) != incache.len)
+		err(1, "fwrite(incache) failed!");
+	incache.nbytes += incache.len;
+	incache.len = 0;
+}
+
+/*
+ * replay the events in a block as read_file() and is_preambles() do
+ * in the second pass.  once the duration is expired, the rest of the
+ * file is skipped from the next line, but the preambles at the top
+ * of the following files are still processed.
+ */
+static void
+incache_play(uint8_t *p, uint8_t *end)
+{
+	static int skip;
+	struct odflow_spec odfsp;
+	uint64_t byte, packet;
+	int64_t t;
+	int af, n;
+
+	while (p < end) {
+		switch (*p++) {
+		case INC_FILE:
+			skip = 0;
+			break;
+		case INC_START:
+		case INC_END:
+			memcpy(&t, p, sizeof(t));
+			if (!skip) {
+				if (p[-1] == INC_START)
+					time_start(t);
+				else
+					time_end(t);
+			}
+			p += sizeof(t);
+			break;
+		case INC_LINE:
+			if (is_finish)
+				skip = 1;
+			break;
+		case INC_ADD:
+			af = *p++;
+			n = incache_addrlen(af);
+			memset(&odfsp, 0, sizeof(odfsp));
+			odfsp.srclen = *p++;
+			odfsp.dstlen = *p++;
+			memcpy(odfsp.src, p, n);
+			p += n;
+			memcpy(odfsp.dst, p, n);
+			p += n;
+			p = varint_get(p, &byte);
+			p = varint_get(p, &packet);
+			if (is_finish)
+				skip = 1;
+			if (!skip)
+				(void)odflow_addcount(&odfsp, af, byte, packet,
+				    response);
+			break;
+		default:
+			errx(1, "incache: broken event");
+		}
+	}
+}
+
+/* the second pass: replay the spilled blocks, and then the buffer */
+static void
+incache_replay(void)
+{
+	uint8_t *buf;
+	size_t len;
+
+	if (hhh_profile)
+		input_t0 = prof_usec();
+	incache.nbytes += incache.len;
+	if (verbose)
+		fprintf(stderr, "input cache: %" PRIu64 " bytes%s\n",
+		    incache.nbytes, incache.spill != NULL ? " (spilled)" : "");
+	if (incache.spill != NULL) {
+		rewind(incache.spill);
+		if ((buf = malloc(incache.size)) == NULL)
+			err(1, "malloc(incache) failed!");
+		while (fread(&len, sizeof(len), 1, incache.spill) == 1) {
+			if (len > incache.size ||
+			    fread(buf, 1, len, incache.spill) != len)
+				errx(1, "incache: broken spill file");
+			incache_play(buf, buf + len);
+		}
+		free(buf);
+	}
+	incache_play(incache.buf, incache.buf + incache.len);
+	if (hhh_profile)
+		prof_add(response, PROF_INPUT, input_t0);
+}
+
+static void
+incache_free(void)
+{
+	if (incache.spill != NULL)
+		(void)fclose(incache.spill);
+	free(incache.buf);
+	memset(&incache, 0, sizeof(incache));
 }
 
 /*
@@ -491,7 +1102,6 @@ is_preambles(char *buf)
 	char *cp;
         struct tm tm;
         time_t t = 0;
-	static time_t ts_next;
 
 	if (buf[0] == '\0' || buf[0] == '#')
 		return (1);
@@ -507,47 +1117,9 @@ is_preambles(char *buf)
 			err(1, "date format is incorrect.");
 		if ((t = mktime(&tm)) < 0)
 			warnx("mktime failed.");
-
-		if (query.start_time > t)
-			return (1);
-		if (response->start_time == 0) {
-			response->start_time = t;
-			if (response->interval != 0) {
-				/* try to align the interval */
-				int interval = response->interval;
-				if (interval > 3600)
-					interval = 3600; /* for timezone */
-				ts_next = t / interval * interval + response->interval;
-			}
-		}
-		if (!plot_phase)
-			response->current_time = t;
-		if (query.outfmt == REAGGREGATION && response->interval != 0 &&
-		    t >= ts_next) {
-			if (hhh_run(response) > 0)
-				make_output(response);
-			odhash_resetall(response);
-			response->start_time = t;
-			if (t >= ts_next)
-				ts_next += response->interval;
-		}
-		if (plot_phase) {
-			time_t slottime = plot_getslottime();
-			if (t - slottime >= response->interval) {
-				plot_addupinterval(response);
-
-				/* check empty period. if there exists
-				 * a blank interval, insert blank timeslots
-				 */
-				if (t - slottime >= response->interval * 2)
-					plot_addslot(slottime + response->interval, 1);
-				if (t - slottime >= response->interval * 3)
-					plot_addslot(t - response->interval, 1);
-				/* for next interval */
-				plot_addslot(t, 0);
-				odhash_resetall(response);
-			}
-		}
+		if (incache_on)
+			incache_time(INC_START, t);
+		time_start(t);
 		return (1);
 	}   
 	if (!strncmp("EndTime:", &buf[2], 8)) {
@@ -561,26 +1133,86 @@ is_preambles(char *buf)
 			return (-1);
 		if ((t = mktime(&tm)) < 0)
 			warnx("mktime failed.");
-		if (query.end_time && query.end_time < t) {
-			is_finish = 1;
-			return (1);
-		}
-		if (!plot_phase) {
-			response->end_time = t;
-			response->max_interval = max(response->max_interval,
-			    t - response->current_time);
-			if (t - response->start_time > query.duration)
-				return (1);
-		}
-		if (plot_phase && t > response->end_time) {
-			is_finish = 1;
-			return (1);
-		}
+		if (incache_on)
+			incache_time(INC_END, t);
+		time_end(t);
 		return (1);
 	}
 	return (0);
 }
 
+/* the start time of a summary (also replayed from the input cache) */
+static void
+time_start(time_t t)
+{
+	static time_t ts_next;
+
+	if (query.start_time > t)
+		return;
+	if (response->start_time == 0) {
+		response->start_time = t;
+		if (response->interval != 0) {
+			/* try to align the interval */
+			int interval = response->interval;
+			if (interval > 3600)
+				interval = 3600; /* for timezone */
+			ts_next = t / interval * interval + response->interval;
+		}
+	}
+	if (!plot_phase)
+		response->current_time = t;
+	if (query.outfmt == REAGGREGATION && response->interval != 0 &&
+	    t >= ts_next) {
+		if (hhh_profile)
+			prof_add(response, PROF_INPUT, input_t0);
+		(void)aggregate_output();
+		odhash_resetall(response);
+		if (hhh_profile)
+			input_t0 = prof_usec();
+		response->start_time = t;
+		if (t >= ts_next)
+			ts_next += response->interval;
+	}
+	if (plot_phase) {
+		time_t slottime = plot_getslottime();
+		if (t - slottime >= response->interval) {
+			plot_addupinterval(response);
+
+			/* check empty period. if there exists
+			 * a blank interval, insert blank timeslots
+			 */
+			if (t - slottime >= response->interval * 2)
+				plot_addslot(slottime + response->interval, 1);
+			if (t - slottime >= response->interval * 3)
+				plot_addslot(t - response->interval, 1);
+			/* for next interval */
+			plot_addslot(t, 0);
+			odhash_resetall(response);
+		}
+	}
+}
+
+/* the end time of a summary (ditto) */
+static void
+time_end(time_t t)
+{
+	if (!response->start_time)
+		return;
+	if (query.end_time && query.end_time < t) {
+		is_finish = 1;
+		return;
+	}
+	if (!plot_phase) {
+		response->end_time = t;
+		response->max_interval = max(response->max_interval,
+		    t - response->current_time);
+		if (t - response->start_time > query.duration)
+			return;
+	}
+	if (plot_phase && t > response->end_time)
+		is_finish = 1;
+}
+
 /* parse IP address */
 static int
 ip_addrparser(char *buf, void *ip, uint8_t *prefixlen)
@@ -763,38 +1395,404 @@ protospec_parse(char *buf, struct odflow_spec *odpsp, double *perc, double *perc
 }
 
 /*
- * parse src_proto, dst_proto and port, e.g.,
+ * the scanners below parse the fields of a line in place, bounded by
+ * the end of the line.  they take the forms written by agurim and
+ * aguri3, and leave the others to the string parsers above.
+ */
+
+/* an unsigned decimal of up to 19 digits, or NULL */
+static char *
+u64_scan(char *cp, char *end, uint64_t *vp)
+{
+	uint64_t v = 0;
+	char *p;
+
+	for (p = cp; p < end && *p >= '0' && *p <= '9'; p++) {
+		if (p - cp == 19)
+			return (NULL);
+		v = v * 10 + (*p - '0');
+	}
+	if (p == cp)
+		return (NULL);
+	*vp = v;
+	return (p);
+}
+
+/*
+ * a decimal fraction after blanks, e.g., " 92.8", or NULL.
+ * the value is the same as strtod(): both the digits (up to 15) and
+ * the power of 10 are exact in double, and the division rounds
+ * correctly.
+ */
+static char *
+perc_scan(char *cp, char *end, double *dp)
+{
+	static const double tens[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6,
+	    1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+	uint64_t m = 0;
+	int ndigits = 0, nfrac = -1;
+
+	while (cp < end && (*cp == ' ' || *cp == '\t'))
+		cp++;
+	for (; cp < end; cp++) {
+		if (*cp >= '0' && *cp <= '9') {
+			m = m * 10 + (*cp - '0');
+			ndigits++;
+			if (nfrac >= 0)
+				nfrac++;
+		} else if (*cp == '.' && nfrac < 0)
+			nfrac = 0;
+		else
+			break;
+	}
+	if (ndigits == 0 || ndigits > 15)
+		return (NULL);
+	*dp = nfrac > 0 ? (double)m / tens[nfrac] : (double)m;
+	return (cp);
+}
+
+/* the value of a percentage, e.g., "3.19%)" */
+static double
+perc_value(char *cp, char *end)
+{
+	char tok[64];
+	double d;
+	char *p;
+	size_t len;
+
+	if ((p = perc_scan(cp, end, &d)) != NULL && p < end && *p == '%')
+		return (d);
+	len = end - cp;
+	if (len >= sizeof(tok))
+		len = sizeof(tok) - 1;
+	memcpy(tok, cp, len);
+	tok[len] = '\0';
+	return (strtod(tok, NULL));
+}
+
+static int
+hex_value(int c)
+{
+	if (c >= '0' && c <= '9')
+		return (c - '0');
+	if (c >= 'a' && c <= 'f')
+		return (c - 'a' + 10);
+	if (c >= 'A' && c <= 'F')
+		return (c - 'A' + 10);
+	return (-1);
+}
+
+/* a dotted IPv4 address as inet_pton() takes it, or -1 */
+static int
+addr4_scan(char *cp, char *end, uint8_t *ip)
+{
+	int i, n, v;
+
+	for (i = 0; i < 4; i++) {
+		if (i > 0 && (cp == end || *cp++ != '.'))
+			return (-1);
+		for (n = v = 0; cp < end && *cp >= '0' && *cp <= '9'; cp++) {
+			if (n++ > 0 && v == 0)
+				return (-1);	/* a leading zero */
+			if ((v = v * 10 + (*cp - '0')) > 255)
+				return (-1);
+		}
+		if (n == 0)
+			return (-1);
+		ip[i] = v;
+	}
+	return (cp == end ? 0 : -1);
+}
+
+/* an IPv6 address of hex groups with an optional "::", or -1 */
+static int
+addr6_scan(char *cp, char *end, uint8_t *ip)
+{
+	uint16_t w[8];
+	int i, d, n = 0, gap = -1, v;
+
+	if (cp < end && *cp == ':') {
+		if (end - cp < 2 || cp[1] != ':')
+			return (-1);
+		gap = 0;
+		cp += 2;
+	}
+	while (cp < end) {
+		for (i = v = 0; i < 4 && cp < end &&
+		    (d = hex_value(*cp)) >= 0; i++, cp++)
+			v = v << 4 | d;
+		if (i == 0 || n == 8)
+			return (-1);
+		w[n++] = v;
+		if (cp == end)
+			break;
+		if (*cp++ != ':' || cp == end)
+			return (-1);
+		if (*cp == ':') {
+			if (gap >= 0)
+				return (-1);
+			gap = n;
+			cp++;
+		}
+	}
+	if (gap < 0 ? n != 8 : n == 8)
+		return (-1);
+	memset(ip, 0, 16);
+	for (i = 0; i < n; i++) {
+		d = i < gap || gap < 0 ? i : 8 - n + i;
+		ip[d * 2] = w[i] >> 8;
+		ip[d * 2 + 1] = w[i] & 0xff;
+	}
+	return (0);
+}
+
+/* an address with an optional prefix length, as ip_addrparser() */
+static int
+addr_scan(char *cp, char *end, void *ip, uint8_t *prefixlen)
+{
+	uint64_t len = 0;
+	char *ap;
+	int i, af = AF_UNSPEC;
+
+	if (cp < end && *cp == '*') {
+		if (end - cp >= 3 && cp[1] == ':' && cp[2] == ':') {
+			af = AF_INET6;
+			memset(ip, 0, 16);
+		} else {
+			af = AF_INET;
+			memset(ip, 0, 4);
+		}
+		*prefixlen = 0;
+		return (af);
+	}
+	/* check the first 5 chars for address family (v4 or v6) */
+	for (i = 1; i < 5 && i < end - cp; i++) {
+		if (cp[i] == '.') {
+			af = AF_INET;
+			break;
+		} else if (cp[i] == ':') {
+			af = AF_INET6;
+			break;
+		}
+	}
+	if (af == AF_UNSPEC)
+		return (-1);
+	if ((ap = memchr(cp, '/', end - cp)) != NULL) {
+		if (u64_scan(ap + 1, end, &len) != end || len > 255)
+			return (-1);
+	} else {
+		ap = end;
+		len = af == AF_INET ? 32 : 128;
+	}
+	if (af == AF_INET ? addr4_scan(cp, ap, ip) : addr6_scan(cp, ap, ip))
+		return (-1);
+	*prefixlen = len;
+	return (af);
+}
+
+/*
+ * address_parse() in place, e.g.,
+ * [ 8] 10.178.141.0/24 *: 21817049 (3.19%)	17852 (1.21%)
+ */
+static int
+address_scan(struct input *in, char *buf, char *end,
+    struct odflow_spec *odfsp, uint64_t *byte, uint64_t *packet)
+{
+	char *cp, *sp, *dp;
+	int af;
+
+	memset(odfsp, 0, sizeof(struct odflow_spec));
+	if (end - buf < 3 || (sp = memchr(&buf[2], ' ', end - buf - 2)) == NULL)
+		goto slow;
+	sp++;
+	if ((dp = memchr(sp, ' ', end - sp)) == NULL ||
+	    (af = addr_scan(sp, dp, odfsp->src, &odfsp->srclen)) < 0)
+		goto slow;
+	dp++;
+	/* the dst address ends with the delimiter ':' */
+	if ((cp = memchr(dp, ' ', end - dp)) == NULL || cp[-1] != ':' ||
+	    addr_scan(dp, cp - 1, odfsp->dst, &odfsp->dstlen) != af)
+		goto slow;
+	if ((cp = u64_scan(cp + 1, end, byte)) == NULL || cp == end ||
+	    *cp != ' ' || (cp = memchr(cp, '\t', end - cp)) == NULL ||
+	    u64_scan(cp + 1, end, packet) == NULL)
+		goto slow;
+	return (af);
+slow:
+	return (address_parse(input_cstr(in, buf, end), odfsp, byte, packet));
+}
+
+/* a port or a port range of protospec_parse(), followed by delim */
+static char *
+port_scan(char *cp, char *end, int delim, uint8_t *ap, uint8_t *lenp)
+{
+	uint64_t val = 0, last;
+
+	if (cp < end && *cp == '*')
+		cp++;
+	else if ((cp = u64_scan(cp, end, &val)) == NULL || val > 65535)
+		return (NULL);
+	if (cp < end && *cp == '-') {
+		/* port range */
+		uint16_t e;
+
+		if ((cp = u64_scan(cp + 1, end, &last)) == NULL ||
+		    last > 65535)
+			return (NULL);
+		e = last;
+		ap[1] = val >> 8;
+		ap[2] = val & 0xff;
+		*lenp = 8 + 17 - ffs(e - (long)val + 1);
+	} else if (val == 0) {
+		*lenp = ap[0] == 0 ? 0 : 8;
+	} else {
+		ap[1] = val >> 8;
+		ap[2] = val & 0xff;
+		*lenp = 24;
+	}
+	if (cp == end || *cp != delim)
+		return (NULL);
+	return (cp + 1);
+}
+
+/* protospec_parse() in place, e.g., "[6:80:*] 92.8% 77.0%" */
+static int
+protospec_scan(char *cp, char *end, struct odflow_spec *odpsp,
+    double *perc, double *perc2)
+{
+	uint64_t val = 0;
+
+	memset(odpsp, 0, sizeof(struct odflow_spec));
+	if (cp < end && *cp == '[')
+		cp++;
+	if (cp < end && *cp == '*')
+		cp++;
+	else if ((cp = u64_scan(cp, end, &val)) == NULL || val > 255)
+		return (-1);
+	odpsp->src[0] = odpsp->dst[0] = val;
+	if (cp == end || *cp++ != ':')
+		return (-1);
+	if ((cp = port_scan(cp, end, ':', odpsp->src, &odpsp->srclen)) == NULL ||
+	    (cp = port_scan(cp, end, ']', odpsp->dst, &odpsp->dstlen)) == NULL)
+		return (-1);
+	if ((cp = perc_scan(cp, end, perc)) == NULL || cp == end ||
+	    *cp++ != '%' ||
+	    (cp = perc_scan(cp, end, perc2)) == NULL || cp == end || *cp != '%')
+		return (-1);
+	return (0);
+}
+
+/*
+ * parse src_proto, dst_proto and port in place, e.g.,
  *      [6:80:*]92.8% 77.0% [6:443:*]6.3% 11.1% [*:*:*]0.6% 9.7%
  */
 static char *
-proto_parse(char **strp, uint64_t byte, uint64_t packet,
+proto_scan(char **strp, char *end, uint64_t byte, uint64_t packet,
     struct odflow_spec *odpsp, uint64_t *byte2, uint64_t *packet2)
 {
-	char *cp, *ap;
-	double perc, perc2;
+	char *cp, *ap, *tend;
+	double perc = 0, perc2 = 0;
+	char tok[128];
+	size_t len;
 
-	if (strp == NULL || (cp = *strp) == NULL)
+	if ((cp = *strp) == NULL)
 		return (NULL);
-	while (isspace(*cp))
+	while (cp < end && isspace(*cp))
 		cp++;
-	if (*cp == '\0')
+	if (cp == end)
 		return (NULL);
 
-	ap = strchr(&cp[1], '[');
+	ap = memchr(&cp[1], '[', end - cp - 1);
 	*strp = ap;	/* set the ptr to the next token, or NULL */
 	if (ap != NULL) {
-		ap[-1] = '\0';  /* terminate the token string */
+		tend = ap - 1;	/* the token ends before a blank */
 	} else {
 		/* last entry */
-		if (strchr(cp, ']') == NULL)
+		if (memchr(cp, ']', end - cp) == NULL)
 			return (NULL);
+		tend = end;
+	}
+	if (protospec_scan(cp, tend, odpsp, &perc, &perc2) < 0) {
+		len = tend > cp ? tend - cp : 0;
+		if (len >= sizeof(tok))
+			len = sizeof(tok) - 1;
+		memcpy(tok, cp, len);
+		tok[len] = '\0';
+		protospec_parse(tok, odpsp, &perc, &perc2);
 	}
-	protospec_parse(cp, odpsp, &perc, &perc2);
 	*byte2 = (uint64_t)(perc * byte / 100);
 	*packet2 = (uint64_t)(perc2 * packet / 100);
 	return (cp);
 }
 
+/*
+ * decide if a record is taken in the sample, and return the weight
+ * of the record: 0 when skipped, query.sample_rate when taken as a
+ * sample, or 1 for a large record, which is always taken as it is.
+ * a record is large when its share in its own summary is at least
+ * sample_rate times the threshold, as the records in the summaries
+ * are mostly above the threshold.
+ * the decision is made by the hash of the address line, so that the
+ * same records are taken in the plotting pass and in the other runs.
+ */
+static int
+sample_weight(char *buf, char *end)
+{
+	char *cp;
+	double large;
+	uint32_t h = 2166136261U;	/* FNV-1a */
+
+	if (!plot_phase)
+		response->sample_records++;
+	/* the percentages of the bytes and the packets, e.g., "(3.19%)" */
+	large = (double)query.threshold * query.sample_rate;
+	if ((cp = memchr(buf, '(', end - buf)) != NULL &&
+	    (perc_value(cp + 1, end) >= large ||
+	    ((cp = memchr(cp + 1, '(', end - cp - 1)) != NULL &&
+	    perc_value(cp + 1, end) >= large)))
+		return (1);
+	for (cp = buf; cp < end; cp++)
+		h = (h ^ (uint8_t)*cp) * 16777619U;
+	/* mix the bits before taking the modulo */
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	return (h % query.sample_rate == 0 ? query.sample_rate : 0);
+}
+
+/* total size of the input files (for -R auto) */
+static off_t
+input_size(char **files, int n)
+{
+	struct stat st;
+	struct dirent **flist;
+	off_t size = 0;
+	int i, m;
+	char file[PATH_MAX+1];
+
+	for (; n > 0; files++, n--) {
+		if (stat(*files, &st) < 0)
+			continue;
+		if ((st.st_mode & S_IFMT) != S_IFDIR) {
+			size += st.st_size;
+			continue;
+		}
+		if ((m = scandir(*files, &flist, NULL, alphasort)) < 0)
+			continue;
+		for (i = 0; i < m; i++) {
+			if (flist[i]->d_name[0] != '.') {
+				snprintf(file, sizeof(file), "%s/%s", *files,
+				    flist[i]->d_name);
+				if (stat(file, &st) == 0)
+					size += st.st_size;
+			}
+			free(flist[i]);
+		}
+		free(flist);
+	}
+	return (size);
+}
+
 static int
 match_filter(struct odflow_spec *odfsp)
 {
@@ -838,9 +1836,12 @@ check_flowtime(const struct aguri_flow *agf)
 	}
 
 	if (response->interval != 0 && ts >= ts_next) {
-		if (hhh_run(response) > 0)
-			make_output(response);
+		if (hhh_profile)
+			prof_add(response, PROF_INPUT, input_t0);
+		(void)aggregate_output();
 		odhash_resetall(response);
+		if (hhh_profile)
+			input_t0 = prof_usec();
 		response->start_time = ts;
 		ts_next += response->interval;
 	}
@@ -891,7 +1892,7 @@ do_agflow(const struct aguri_flow *agf)
 	memcpy(&odpsp.dst[1], &agf->agflow_fs.fs_dport, 2);
 	odpsp.srclen = 24;
 	odpsp.dstlen = 24;
-	odproto_addcount(odfp, &odpsp, AF_LOCAL, byte, packet);
+	odproto_addcount(odfp, &odpsp, AF_LOCAL, byte, packet, response);
 
 	return (1);
 }
@@ -903,11 +1904,13 @@ read_flow(FILE *fp)
 	int rval;
 	unsigned long n = 0;
 
+	if (hhh_profile)
+		input_t0 = prof_usec();
 	while (1) {
 		if (fread(&agflow, sizeof(agflow), 1, fp) != 1) {
 			if (feof(fp)) {
 				fprintf(stderr, "\n read %lu flows\n", n);
-				return (0);
+				break;
 			}
 			warn("fread failed!");
 			return (-1);
@@ -922,6 +1925,8 @@ read_flow(FILE *fp)
 		if (verbose && n % 10000 == 0)
 			fprintf(stderr, "+");
 	}
+	if (hhh_profile)
+		prof_add(response, PROF_INPUT, input_t0);
 	return (0);
 }
 #endif /*experimental */
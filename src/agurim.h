@@ -47,6 +47,12 @@ enum out_format {
 	JSON
 };
 
+enum hhh_engine {
+	HHH_LATTICE,	/* recursive lattice search */
+	HHH_SORT,	/* sort-based bottom-up search */
+	HHH_RHHH	/* randomized counters at input (aguri3) */
+};
+
 /* origin-destination flow spec */
 struct odflow_spec {
 	uint8_t src[MAXLEN];	/* source ip */
@@ -71,36 +77,196 @@ struct odf_tailq {
 	int nrecord;	/* number of record */
 };
 
+/*
+ * odflow_hash is a flat open-addressing table with linear probing.
+ * each slot keeps the hash value next to the odflow pointer so that
+ * most mismatches are resolved without touching the odflow.
+ * when the table gets full, a table of double size is allocated, and
+ * the slots of the old table are moved a few at a time by the
+ * following lookups (incremental resize).
+ */
+#define ODHASH_PROBEWARN	8  /* report avg probe length over this */
+
+/*
+ * key types of odflow_hash.  a table of a specific type takes only
+ * the specs of that type (with zeros beyond the address), and
+ * hashes and compares them as integers.
+ */
+enum odkey_type {
+	ODKEY_SPEC = 0,	/* any odflow_spec */
+	ODKEY_IPV4,	/* 32-bit src and dst */
+	ODKEY_IPV6,	/* 128-bit src and dst */
+	ODKEY_PROTO	/* proto:sport:dport (24 bits) */
+};
+
+struct odhash_slot {
+	uint32_t hval;		/* hash value of the spec */
+	struct odflow *odfp;	/* NULL for an empty slot */
+};
+
 struct odflow_hash {
-	struct odf_tailq *tbl;
+	enum odkey_type keytype;
+	struct odhash_slot *tbl;
+	int nbuckets;	/* number of slots for tbl (power of 2) */
+	int tblsize;	/* slots allocated for tbl (>= nbuckets) */
+	int nused;	/* number of slots in use in tbl */
+	struct odhash_slot *otbl; /* old table being moved to tbl */
+	int onbuckets;	/* number of slots for otbl */
+	int omove;	/* next slot to move in otbl */
+	struct odflow_pool *pool;  /* pool for odflows (NULL for malloc) */
 	uint64_t packet;
 	uint64_t byte;
 	int nrecord;	/* number of records */
-	int nbuckets;	/* number of buckets for tbl */
+	int maxrecord;	/* high-water mark of nrecord (for odhash_shrink) */
+	/* probe length statistics of odflow_lookup() */
+	uint64_t nlookups;
+	uint64_t nprobes;
+	int maxprobe;
 };
 
+/*
+ * iterate over the odflows in the hash.  the pending resize is
+ * completed first, so that only tbl needs to be walked.
+ * the odflows can be taken out during the iteration, but the table
+ * should be emptied by odhash_clear() afterwards.
+ */
+#define ODHASH_FOREACH(var, odfh, i)					\
+	for (odhash_settle(odfh), (i) = 0; (i) < (odfh)->nbuckets; (i)++) \
+		if (((var) = (odfh)->tbl[(i)].odfp) != NULL)
+
 struct odflow {
 	struct odflow_spec s;
 	int af;
 	uint64_t packet;
 	uint64_t byte;
-	struct cache_list *odf_cache; /* keeps odflow indices during
-				       * aggregation (and plot counts
-				       * during plotting)
-				       */
+	struct cache_list odf_cache; /* keeps odflow indices during
+				      * aggregation (and plot counts
+				      * during plotting)
+				      */
 	TAILQ_ENTRY(odflow) odf_chain;  /* for hash table */
 	struct odf_tailq odf_odpq;  /* list of lower odflows for this flow */
+	struct odflow_pool *odf_pool; /* pool this odflow belongs to */
+	struct odproto_index *odf_index; /* index of odf_odpq (or NULL) */
+};
+
+/*
+ * odflow_pool is a slab allocator for odflows.
+ * odflows are carved out of large slabs, and released odflows are
+ * kept in the freelist for reuse.  odpool_reset() drops all the
+ * odflows in the pool at once, keeping the slabs for the next round.
+ * other memory for the odflows (e.g., sub-odflow indices) is taken
+ * as blocks cached by size class, and also kept across resets.
+ * odpool_shrink() releases the memory above the high-water mark.
+ * a pool is not thread-safe; it should be used by one thread at a time.
+ */
+#define ODPOOL_NCLASSES	16	/* size classes of blocks (64B to 2MB) */
+
+struct odflow_slab;
+struct odpool_block;
+struct odproto_index;
+struct odflow_pool {
+	struct odflow_slab *slabs;	/* list of slabs */
+	struct odflow_slab *cur_slab;	/* slab currently used */
+	int	nused;			/* odflows used in cur_slab */
+	struct odflow *freelist;	/* released odflows */
+	size_t	bytes_inuse;		/* bytes of odflows in use */
+	size_t	max_bytes_inuse;	/* peak of bytes_inuse */
+	size_t	bytes_allocated;	/* bytes of slabs and blocks allocated */
+	/* sub-odflow indices of the odflows in the pool */
+	TAILQ_HEAD(odpxh, odproto_index) indices;
+	/* released blocks by size class (for indices and scratch) */
+	struct odpool_block *blocks[ODPOOL_NCLASSES];
+	int	blk_inuse[ODPOOL_NCLASSES];
+	int	blk_cached[ODPOOL_NCLASSES];
+	/* high-water marks since the last odpool_shrink() */
+	int	blk_peak[ODPOOL_NCLASSES];
+	int	slabs_peak;
+	int	nresets;		/* number of odpool_reset() */
+	/* heap allocations made for the pool (and its hashes) */
+	unsigned long nallocs;
+	unsigned long nallocs_epoch;	/* since the last odpool_reset() */
+	/*
+	 * while frozen, released odflows and indices are left in place
+	 * until odpool_reset(), so that threads can free them at once.
+	 */
+	int	frozen;
 };
 
+/*
+ * per-phase profile (-x), collected since the last output.
+ * the times are in microseconds.  the find_hhh() times and the
+ * counters are summed over the threads.
+ */
+enum prof_phase {
+	PROF_INPUT,	/* reading the inputs, including addcount */
+	PROF_ADDCOUNT,	/* odflow_addcount() and odproto_addcount() */
+	PROF_FIND4,	/* find_hhh() for IPv4 addresses */
+	PROF_FIND6,	/* find_hhh() for IPv6 addresses */
+	PROF_FINDPROTO,	/* find_hhh() for protocols and ports */
+	PROF_SORT,	/* odfq_countsort() and odfq_listreduce() */
+	PROF_OUTPUT,	/* make_output() */
+	PROF_NPHASES
+};
+
+struct prof_stats {
+	uint64_t usec[PROF_NPHASES];
+	uint64_t nodes;		/* lattice nodes (or labels) visited */
+	uint64_t pruned;	/* lattice nodes skipped by the bounds */
+	uint64_t scratch;	/* scratch tables allocated */
+	uint64_t extracted;	/* odflows extracted */
+	uint64_t peak_odflows;	/* peak of the live odflows in the pool */
+};
+
+/*
+ * odmatch is a list of flow_specs laid out by 32-bit address words,
+ * for finding the first one overlapping a given flow_spec with the
+ * vector instructions (see odmatch_first()).
+ * a long list is also put in a trie of the src prefixes, each node
+ * holding a trie of the dst prefixes, and searched by the trie.
+ */
+#define ODMATCH_LANES	8	/* entries compared at once (avx2) */
+#define ODMATCH_TRIEMIN	512	/* min entries to search by the trie */
+
+struct odmatch_node;
+
+enum odmatch_isa {
+	ODMATCH_AUTO,		/* the best one the cpu supports */
+	ODMATCH_SCALAR,
+	ODMATCH_SSE2,
+	ODMATCH_AVX2
+};
+
+struct odmatch {
+	int	n;		/* number of entries */
+	int	nslots;		/* n rounded up to ODMATCH_LANES */
+	int	nsrcwords;	/* words of src to compare */
+	int	ndstwords;	/* words of dst to compare */
+	int32_t	*af, *srclen, *dstlen;
+	uint32_t *src[MAXLEN / 4], *srcmask[MAXLEN / 4];
+	uint32_t *dst[MAXLEN / 4], *dstmask[MAXLEN / 4];
+	int	(*first)(struct odmatch *, struct odflow_spec *, int);
+	void	*buf;		/* memory of the arrays */
+	struct odmatch_node *nodes;	/* the trie, or NULL */
+	struct odflow_spec *specs;	/* the entries for the trie */
+	int	nnodes, maxnodes;
+	int	roots[3];	/* src tries for IPv4, IPv6, protocols */
+};
+
+#define MAX_THRESHOLDS	8	/* thresholds in a -t list (agurim) */
+#define HHH_NLEVELS	4	/* levels of the coarse-to-fine search */
+
 struct query {
 	/* essential parameters */
 	enum aggr_criteria criteria;
 	int interval;	/* aggregation interval */
 	int output_interval; /* interval for outputs in 2-stage aggregation */
 	int threshold;	/* threshold in percent */
+	int thresholds[MAX_THRESHOLDS]; /* -t list, in the ascending order */
+	int nthresholds;
 	int nflows;	/* the number of result flows */
 	int duration;	/* total duration */
 	int count;	/* if non-zero, exit after processing 'count' packets */
+	int sample_rate; /* if > 1, read 1 in sample_rate records (agurim) */
 	time_t start_time;
 	time_t end_time;
 
@@ -127,10 +293,31 @@ struct response {
 	uint64_t thresh_byte, thresh_packet;
 	uint64_t input_odflows;  /* # of input IPv4 odflows */
 	uint64_t input_odflows6; /* (for IPv6, these are just informational) */
+	double hash_avgprobe;	/* avg probe length of the input hashes */
+	int hash_maxprobe;	/* max probe length of the input hashes */
+	/* sub-odflow summary (odproto_topk) */
+	uint64_t topk_evicted;	/* sub-odflows taken over */
+	uint64_t topk_errbyte;	/* bound of over-counted bytes */
+	uint64_t topk_errpacket; /* bound of over-counted packets */
+	/* sampled inputs (query.sample_rate) */
+	uint64_t sample_records;	/* input records */
+	uint64_t sample_taken;		/* records taken in the sample */
+	double	sample_sqbyte;		/* sum of squares of the taken counts */
+	double	sample_sqpacket;
+	/* coarse-to-fine search (hhh_deadline_ms) */
+	int	refined;		/* levels finished, of HHH_NLEVELS */
+	int	refined_len4, refined_len6; /* prefix lengths of the level */
+	int	subs_dropped;		/* results left without the protocols */
 	int	processing_time;	/* processing time in ms */
+	/* runs for the thresholds of a -t list (agurim) */
+	int	keep_inputs;		/* hhh_run() leaves the inputs */
+	struct hhh_memo *memo[2];	/* memo of the inputs for the runs */
 	struct odflow_hash *ip_hash;
 	struct odflow_hash *ip6_hash;
 	struct odflow_hash *proto_hash;
+	struct odflow_pool *pool;	/* pool for the input odflows */
+	struct rhhh *rhhh;	/* counters for HHH_RHHH (or NULL) */
+	struct prof_stats prof;	/* per-phase profile (hhh_profile) */
 };
 
 extern struct query query;
@@ -138,6 +325,14 @@ extern struct response *resp;
 
 extern int proto_view;
 extern int disable_heuristics;	/* do not use label heuristics */
+extern int odproto_topk;	/* sub-odflows kept per odflow (0: quickmerge) */
+extern int odpool_shrinkepochs;	/* shrink input memory every n epochs */
+extern int hhh_profile;		/* collect and print prof_stats (-x) */
+extern int hhh_nthreads;	/* threads used by hhh_run() */
+extern int hhh_deadline_ms;	/* time limit of hhh_run() (0: none) */
+extern enum odmatch_isa odmatch_isa; /* instructions of odmatch_first() */
+extern int odmatch_triemin;	/* min entries to search by the trie */
+extern enum hhh_engine hhh_engine; /* algorithm used by hhh_run() */
 extern int verbose;
 extern int debug;
 extern unsigned int blocking_count; /* thread blocking counter for aguri3 */
@@ -146,14 +341,16 @@ extern FILE *wfp;
 /* agurim_subr.c */
 int prefix_comp(uint8_t *r, uint8_t *r2, uint8_t len);
 void prefix_set(uint8_t *r0, uint8_t len, uint8_t *r1, int bytesize);
+struct odmatch *odmatch_alloc(struct odflow **flows, int n);
+void odmatch_free(struct odmatch *om);
+#define odmatch_first(om, odfsp, af)	((om)->first((om), (odfsp), (af)))
 void odflow_print(struct odflow *odfp);
 void odproto_print(struct odflow *odpp);
 void odproto_countfrac_print(struct odflow *odpp);
 void odflow_countfrac_print(struct odflow *odfp);
+uint64_t prof_usec(void);
 
 #define CL_INLINE	/* use inline macros */
-struct cache_list *cl_alloc(void);
-void cl_free(struct cache_list *clp);
 void cl_clear(struct cache_list *clp);
 int cl_append(struct cache_list *clp, uint64_t val);
 #ifdef CL_INLINE
@@ -170,18 +367,32 @@ int cl_add(struct cache_list *clp, int i, uint64_t val);
 
 /* odflow.c */
 void odhash_init(struct response *resp);
-struct odflow_hash *odhash_alloc(int n);
+struct odflow_hash *odhash_alloc(int n, enum odkey_type keytype);
 void odhash_free(struct odflow_hash *odfh);
 void odhash_reset(struct odflow_hash *odfh);
+void odhash_clear(struct odflow_hash *odfh);
+void odhash_shrink(struct odflow_hash *odfh);
+void odhash_prepare(struct odflow_hash *odfh, int n, enum odkey_type keytype);
+void odhash_settle(struct odflow_hash *odfh);
+void odhash_stats(struct odflow_hash *odfh, const char *name);
+void odhash_probestats(struct response *resp);
+void odhash_remove(struct odflow_hash *odfh, struct odflow *odfp);
 void odhash_resetall(struct response *resp);
+struct odflow_pool *odpool_alloc(void);
+void odpool_free(struct odflow_pool *pool);
+void odpool_reset(struct odflow_pool *pool);
+void odpool_shrink(struct odflow_pool *pool);
+void odpool_stats(struct odflow_pool *pool);
 struct odflow *
 odflow_addcount(struct odflow_spec *odfsp, int af, uint64_t byte,
     uint64_t packet, struct response *resp);
 void odproto_addcount(struct odflow *odfp, struct odflow_spec *odpsp, int af,
-    uint64_t byte, uint64_t packet);
+    uint64_t byte, uint64_t packet, struct response *resp);
 struct odflow *
 odflow_lookup(struct odflow_hash *odfh, struct odflow_spec *odfsp);
-struct odflow *odflow_alloc(struct odflow_spec *odfsp);
+void odflow_detach(struct odflow *odfp);
+struct odflow *odflow_import(struct odflow_hash *odfh, struct odflow *odfp);
+struct odflow *odflow_alloc(struct odflow_spec *odfsp, struct odflow_pool *pool);
 void odflow_free(struct odflow *odfp);
 void odflow_stats(void);
 
@@ -190,8 +401,30 @@ void odflow_stats(void);
 
 /* hhh.c */
 int hhh_run(struct response *resp);
+void prof_add(struct response *resp, int phase, uint64_t t0);
 struct odflow_spec odflowspec_gen(struct odflow_spec *odfsp, int label[], int bytesize);
 
+/* rhhh.c */
+struct rhhh;
+struct rhhh *rhhh_alloc(struct response *resp, int maxentries);
+void rhhh_reset(struct rhhh *rh);
+struct odflow *
+rhhh_addcount(struct odflow_spec *odfsp, int af, uint64_t byte,
+    uint64_t packet, struct response *resp);
+int rhhh_find(struct response *resp, int bitlen, struct odf_tailq *odfqp);
+void rhhh_stats(struct rhhh *rh);
+
+/* taskq.c */
+struct taskq_group {
+	int	pending;		/* tasks not finished yet */
+};
+void taskq_init(int n);
+int taskq_nthreads(void);
+void taskq_spawn(struct taskq_group *group, void (*func)(void *, int),
+    void *arg, int i);
+void taskq_wait(struct taskq_group *group);
+void taskq_run(void (*func)(void *, int), void *arg, int ntasks);
+
 /* agurim_plot.c */
 void odfq_listreduce(struct odf_tailq *odfq, int nflows);
 void odfq_areasort(struct odf_tailq *odfq);
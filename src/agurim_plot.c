@@ -27,6 +27,8 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/socket.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <err.h>
@@ -43,28 +45,39 @@ extern int timeoffset;
 
 static void addupcounts(struct response *resp, struct odflow_hash *odfh);
 static int calc_interval(int duration);
-static struct odflow *odfq_parentlookup(struct odf_tailq *odfq, struct odflow *odfp);
-static void odfq_insert(struct odf_tailq *odfq, struct odflow *odfp, enum aggr_criteria criteria);
+struct lr_state;
+static inline uint64_t lr_count(struct odflow *odfp);
+static int lr_newnode(struct lr_state *st);
+static void lr_insert(struct lr_state *st, int e);
+static int lr_parent(struct lr_state *st, struct odflow *odfp);
+static void lr_push(struct lr_state *st, int e);
+static int lr_pop(struct lr_state *st);
+static int lr_comp(const void *p0, const void *p1);
 static void odproto_countsort(struct odflow *odfp);
 static int area_comp(const void *p0, const void *p1);
 static int count_comp(const void *p0, const void *p1);
 static void aguri_preamble_print(struct response *resp);
 static void aguri_odflow_print(struct response *resp);
+static double sample_error(double sqsum, uint64_t total);
 static void json_preamble_print(struct response *resp);
 static void json_odflow_print(struct response *resp);
 static void debug_preamble_print(struct response *resp);
 static void debug_odflow_print(struct response *resp);
+static void prof_print(struct response *resp, int json);
 /* XXX total byte/packet ratio used for count sort.  need to set this 
- * value (total_byte/total_packet) before qsort (ugly...) */
-static double bpratio4sort;
+ * value (total_byte/total_packet) before qsort (ugly...)
+ * thread local, as hhh_run() sorts in several threads. */
+static __thread double bpratio4sort;
 
 static int time_slot = 0;
 static time_t *plot_timestamps;
+static struct odflow **plot_flows;	/* resp->odfq in the list order */
+static struct odmatch *plot_match;	/* specs of plot_flows */
 
 void plot_prepare(struct response *resp)
 {
 	struct odflow *odfp;
-	int duration;
+	int duration, nflows = 0;
 	    
 	/* calculate time buffers */
 	duration = resp->end_time - resp->start_time;
@@ -80,15 +93,23 @@ void plot_prepare(struct response *resp)
 	if (plot_timestamps == NULL)
 		plot_timestamps = calloc(resp->timeslots, sizeof(time_t));
 
+	plot_flows = malloc(sizeof(struct odflow *) *
+	    max(resp->odfq.nrecord, 1));
+	if (plot_flows == NULL)
+		err(1, "malloc(plot_flows) failed!");
+
 	/* make zero entries in the cl caches for plot values */
 	TAILQ_FOREACH(odfp, &resp->odfq.odfq_head, odf_chain) {
-		int i, n = cl_size(odfp->odf_cache);
+		int i, n = cl_size(&odfp->odf_cache);
 		for (i = 0; i < resp->timeslots; i++)
 			if (i < n)
-				cl_set(odfp->odf_cache, i, 0);
+				cl_set(&odfp->odf_cache, i, 0);
 			else
-				cl_append(odfp->odf_cache, 0);
+				cl_append(&odfp->odf_cache, 0);
+		plot_flows[nflows++] = odfp;
 	}
+	/* addupcounts() looks up the list in this order */
+	plot_match = odmatch_alloc(plot_flows, nflows);
 
 	/* create the first time slot */
 	plot_addslot(resp->start_time, 0);
@@ -120,34 +141,29 @@ static void
 addupcounts(struct response *resp, struct odflow_hash *odfh)
 {
 	struct odflow *odfp0, *odfp1;
-	int i;
+	int i, j;
 
 	/* lookup overlapped label and update counts */
 	if (odfh->nrecord == 0)  /* no traffic? */
 		return;
 
-        for (i = 0; i < odfh->nbuckets; i++) {
-                while ((odfp1 = TAILQ_FIRST(&odfh->tbl[i].odfq_head)) != NULL) {
-                        TAILQ_REMOVE(&odfh->tbl[i].odfq_head, odfp1, odf_chain);
-			odfh->tbl[i].nrecord--;
-			/* find the first matching odflow in the list assuming
-			 * the list is already ordered by the prefix lengths */
-			TAILQ_FOREACH(odfp0, &resp->odfq.odfq_head, odf_chain) {
-				if (odfp0->af == odfp1->af &&
-				    odflowspec_is_overlapped(&(odfp0->s), &(odfp1->s))) {
-					uint64_t cnt;
-					/* add count to this entry */
-					if (query.criteria == BYTE)
-						cnt = odfp1->byte;
-					else
-						cnt = odfp1->packet;
-					cl_add(odfp0->odf_cache, time_slot, cnt);
-					break;
-				}
-			}
-			odflow_free(odfp1);
+	ODHASH_FOREACH(odfp1, odfh, i) {
+		/* find the first matching odflow in the list assuming
+		 * the list is already ordered by the prefix lengths */
+		j = odmatch_first(plot_match, &odfp1->s, odfp1->af);
+		if (j >= 0) {
+			uint64_t cnt;
+			/* add count to this entry */
+			odfp0 = plot_flows[j];
+			if (query.criteria == BYTE)
+				cnt = odfp1->byte;
+			else
+				cnt = odfp1->packet;
+			cl_add(&odfp0->odf_cache, time_slot, cnt);
 		}
+		odflow_free(odfp1);
 	}
+	odhash_clear(odfh);
 }
 
 /*
@@ -171,18 +187,33 @@ void
 make_output(struct response *resp)
 {
 	struct odflow *odfp;
+	uint64_t t0 = 0;
 
+	if (hhh_profile)
+		t0 = prof_usec();
 	odfq_countsort(&resp->odfq, resp->total_byte, resp->total_packet);
+	if (hhh_profile) {
+		prof_add(resp, PROF_SORT, t0);
+		t0 = prof_usec();
+	}
 
 	switch (query.outfmt) {
 	case REAGGREGATION:
 		aguri_preamble_print(resp);
 		aguri_odflow_print(resp);
+		if (hhh_profile) {
+			prof_add(resp, PROF_OUTPUT, t0);
+			prof_print(resp, 0);
+		}
 		break;
 	case JSON:
 		fprintf(wfp, "{\n");
 		json_preamble_print(resp);
 		json_odflow_print(resp);
+		if (hhh_profile) {
+			prof_add(resp, PROF_OUTPUT, t0);
+			prof_print(resp, 1);
+		}
 		fprintf(wfp, "}\n");
 		break;
 	case DEBUG:
@@ -200,6 +231,44 @@ make_output(struct response *resp)
 	}
 	assert(resp->odfq.nrecord == 0);
 	resp->nflows = 0;
+	resp->sample_records = resp->sample_taken = 0;
+	resp->sample_sqbyte = resp->sample_sqpacket = 0.0;
+	memset(&resp->prof, 0, sizeof(resp->prof));
+}
+
+/*
+ * print the profile (-x) at the end of the output: a "%stats:" line
+ * of name:value pairs for the aguri format, or a "stats" object for
+ * JSON.  the times are in usec.
+ */
+static void
+prof_print(struct response *resp, int json)
+{
+	static const char *names[PROF_NPHASES] = {
+		"input", "addcount", "find4", "find6", "findproto",
+		"sort", "output"
+	};
+	struct prof_stats *ps = &resp->prof;
+	int i;
+
+	if (json) {
+		fprintf(wfp, ", \"stats\": {");
+		for (i = 0; i < PROF_NPHASES; i++)
+			fprintf(wfp, "\"%s_us\": %" PRIu64 ", ",
+			    names[i], ps->usec[i]);
+		fprintf(wfp, "\"nodes\": %" PRIu64 ", \"pruned\": %" PRIu64
+		    ", \"scratch\": %" PRIu64 ", \"extracted\": %" PRIu64
+		    ", \"peak_odflows\": %" PRIu64 "}\n", ps->nodes,
+		    ps->pruned, ps->scratch, ps->extracted, ps->peak_odflows);
+	} else {
+		fprintf(wfp, "%%stats:");
+		for (i = 0; i < PROF_NPHASES; i++)
+			fprintf(wfp, " %s_us:%" PRIu64, names[i], ps->usec[i]);
+		fprintf(wfp, " nodes:%" PRIu64 " pruned:%" PRIu64
+		    " scratch:%" PRIu64 " extracted:%" PRIu64
+		    " peak_odflows:%" PRIu64 "\n", ps->nodes, ps->pruned,
+		    ps->scratch, ps->extracted, ps->peak_odflows);
+	}
 }
 
 /* compute the appropriate interval from the duration */
@@ -252,50 +321,317 @@ calc_interval(int duration)
 	return (interval); 
 }
 
-/* aggregate the tailq to the specified numbers */
+/*
+ * state of odfq_listreduce().
+ * the odflows are kept in a heap by the count to find the smallest
+ * one, and in a prefix trie to find the parent: a binary trie of the
+ * src prefixes for each address family, and a node of it has a trie
+ * of the dst prefixes of the odflows with the src prefix.
+ * the order of the odflows is the one of the sorted tailq: by the
+ * count, and an odflow grown by a merge goes after the ones with the
+ * same count.  seq keeps the order among the same counts.
+ */
+struct lr_ent {
+	struct odflow *odfp;	/* NULL when merged */
+	uint64_t count;		/* count by the criteria */
+	int	seq;		/* order among the same count */
+	int	node;		/* dst trie node pointing to this */
+};
+
+struct lr_node {
+	int	child[2];
+	int	sub;		/* root of the dst trie (src trie only) */
+	int	ent;		/* odflow with this prefix (dst trie only) */
+};
+
+struct lr_heapent {
+	uint64_t count;
+	int	seq;
+	int	ent;
+};
+
+struct lr_state {
+	struct lr_ent *ents;
+	int	nents, nextseq;
+	struct lr_node *nodes;
+	int	nnodes, maxnodes;
+	int	roots[3];		/* src tries for IPv4, IPv6, protocols */
+	struct lr_heapent *heap;	/* min-heap of the odflows */
+	int	nheap;
+};
+
+#define LR_BIT(p, i)	(((p)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+/* the tail of the tailq is the smallest count, the largest seq */
+#define LR_LESS(a, b)	((a).count < (b).count || \
+			 ((a).count == (b).count && (a).seq > (b).seq))
+
+/* the count to sort the tailq, as count_comp() */
+static inline uint64_t
+lr_count(struct odflow *odfp)
+{
+	switch (query.criteria) {
+	case BYTE:
+		return (odfp->byte);
+	case PACKET:
+		return (odfp->packet);
+	default:
+		/* XXX assuming bpratio4sort is set in odfq_countsort() */
+		return (max(odfp->byte,
+		    (uint64_t)(bpratio4sort * odfp->packet)));
+	}
+}
+
+static int
+lr_newnode(struct lr_state *st)
+{
+	struct lr_node *np;
+
+	if (st->nnodes == st->maxnodes) {
+		st->maxnodes *= 2;
+		st->nodes = realloc(st->nodes,
+		    sizeof(struct lr_node) * st->maxnodes);
+		if (st->nodes == NULL)
+			err(1, "lr_newnode: realloc");
+	}
+	np = &st->nodes[st->nnodes];
+	np->child[0] = np->child[1] = -1;
+	np->sub = np->ent = -1;
+	return (st->nnodes++);
+}
+
+/* put an odflow in the trie */
+static void
+lr_insert(struct lr_state *st, int e)
+{
+	struct odflow *odfp = st->ents[e].odfp;
+	int *rootp, i, b, n, next;
+
+	rootp = &st->roots[odfp->af == AF_INET ? 0 :
+	    (odfp->af == AF_INET6 ? 1 : 2)];
+	if (*rootp < 0)
+		*rootp = lr_newnode(st);
+	n = *rootp;
+	for (i = 0; i < odfp->s.srclen; i++) {
+		b = LR_BIT(odfp->s.src, i);
+		if ((next = st->nodes[n].child[b]) < 0) {
+			next = lr_newnode(st);
+			st->nodes[n].child[b] = next;
+		}
+		n = next;
+	}
+	if (st->nodes[n].sub < 0) {
+		next = lr_newnode(st);
+		st->nodes[n].sub = next;
+	}
+	n = st->nodes[n].sub;
+	for (i = 0; i < odfp->s.dstlen; i++) {
+		b = LR_BIT(odfp->s.dst, i);
+		if ((next = st->nodes[n].child[b]) < 0) {
+			next = lr_newnode(st);
+			st->nodes[n].child[b] = next;
+		}
+		n = next;
+	}
+	if (st->nodes[n].ent < 0) {
+		st->nodes[n].ent = e;
+		st->ents[e].node = n;
+	} else
+		st->ents[e].node = -1;	/* XXX same spec, never a parent */
+}
+
+/*
+ * look for the parent of an odflow: the longest srclen + dstlen among
+ * the odflows containing it.  a tie goes to the first one in the
+ * order, as the linear search of the tailq did.
+ */
+static int
+lr_parent(struct lr_state *st, struct odflow *odfp)
+{
+	struct lr_ent *ep, *bp = NULL;
+	int n, m, i, j, e, best = -1, bestlen = -1;
+
+	n = st->roots[odfp->af == AF_INET ? 0 :
+	    (odfp->af == AF_INET6 ? 1 : 2)];
+	for (i = 0; n >= 0; i++) {
+		m = st->nodes[n].sub;
+		for (j = 0; m >= 0; j++) {
+			if ((e = st->nodes[m].ent) >= 0) {
+				ep = &st->ents[e];
+				if (i + j > bestlen || (i + j == bestlen &&
+				    (ep->count > bp->count ||
+				    (ep->count == bp->count &&
+				    ep->seq < bp->seq)))) {
+					best = e;
+					bp = ep;
+					bestlen = i + j;
+				}
+			}
+			if (j == odfp->s.dstlen)
+				break;
+			m = st->nodes[m].child[LR_BIT(odfp->s.dst, j)];
+		}
+		if (i == odfp->s.srclen)
+			break;
+		n = st->nodes[n].child[LR_BIT(odfp->s.src, i)];
+	}
+	return (best);
+}
+
+static void
+lr_push(struct lr_state *st, int e)
+{
+	struct lr_heapent h;
+	int i, parent;
+
+	h.count = st->ents[e].count;
+	h.seq = st->ents[e].seq;
+	h.ent = e;
+	i = st->nheap++;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!LR_LESS(h, st->heap[parent]))
+			break;
+		st->heap[i] = st->heap[parent];
+		i = parent;
+	}
+	st->heap[i] = h;
+}
+
+/* take the smallest odflow, skipping the stale heap entries */
+static int
+lr_pop(struct lr_state *st)
+{
+	struct lr_heapent h, last;
+	struct lr_ent *ep;
+	int i, c;
+
+	while (st->nheap > 0) {
+		h = st->heap[0];
+		last = st->heap[--st->nheap];
+		i = 0;
+		while ((c = 2 * i + 1) < st->nheap) {
+			if (c + 1 < st->nheap &&
+			    LR_LESS(st->heap[c + 1], st->heap[c]))
+				c++;
+			if (!LR_LESS(st->heap[c], last))
+				break;
+			st->heap[i] = st->heap[c];
+			i = c;
+		}
+		st->heap[i] = last;
+
+		ep = &st->ents[h.ent];
+		if (ep->odfp != NULL && ep->count == h.count &&
+		    ep->seq == h.seq)
+			return (h.ent);
+	}
+	return (-1);
+}
+
+/* helper for qsort: restore the order of the tailq */
+static int
+lr_comp(const void *p0, const void *p1)
+{
+	const struct lr_ent *e0 = p0, *e1 = p1;
+
+	if (e0->count != e1->count)
+		return (e0->count > e1->count ? -1 : 1);
+	return (e0->seq - e1->seq);
+}
+
+/*
+ * aggregate the tailq to the specified numbers.
+ * the tailq should be sorted by odfq_countsort().  the smallest odflow
+ * other than the wildcard is merged into its parent, until nflows
+ * odflows are left.
+ */
 void
 odfq_listreduce(struct odf_tailq *odfq, int nflows)
 {
+	struct lr_state st;
+	struct lr_ent *ep, *pp;
 	struct odflow *odfp, *par;
-	int n;
+	uint64_t count;
+	int e, p, n;
 
 	n = odfq->nrecord;
-	
-	/* reduce # of entries from the tail */
-	odfp = TAILQ_LAST(&odfq->odfq_head, odfqh);
-	assert(odfp != NULL);
-	while (n > nflows) {
-		/* don't aggregate the wildcard */
-		if (odfp->s.srclen == 0 && odfp->s.dstlen == 0) {
-			odfp = TAILQ_PREV(odfp, odfqh, odf_chain);
-			continue;
-		}
-		/* lookup a parent of this entry */
-		TAILQ_REMOVE(&odfq->odfq_head, odfp, odf_chain);
-		odfq->nrecord--;
-		par = odfq_parentlookup(odfq, odfp);
+	if (n <= nflows)
+		return;
 
-		if (par != NULL) {
+	memset(&st, 0, sizeof(st));
+	st.ents = malloc(sizeof(struct lr_ent) * n);
+	st.heap = malloc(sizeof(struct lr_heapent) * n * 2);
+	st.maxnodes = n * 16;
+	st.nodes = malloc(sizeof(struct lr_node) * st.maxnodes);
+	if (st.ents == NULL || st.heap == NULL || st.nodes == NULL)
+		err(1, "odfq_listreduce: malloc");
+	st.roots[0] = st.roots[1] = st.roots[2] = -1;
+
+	/* take the odflows out of the tailq in the order */
+	while ((odfp = TAILQ_FIRST(&odfq->odfq_head)) != NULL) {
+		TAILQ_REMOVE(&odfq->odfq_head, odfp, odf_chain);
+		ep = &st.ents[st.nents];
+		ep->odfp = odfp;
+		ep->count = lr_count(odfp);
+		ep->seq = st.nextseq++;
+		lr_insert(&st, st.nents);
+		/* don't aggregate the wildcard */
+		if (odfp->s.srclen != 0 || odfp->s.dstlen != 0)
+			lr_push(&st, st.nents);
+		st.nents++;
+	}
+	odfq->nrecord = 0;
+
+	while (n > nflows && (e = lr_pop(&st)) >= 0) {
+		ep = &st.ents[e];
+		odfp = ep->odfp;
+		/* remove this entry, and lookup a parent */
+		if (ep->node >= 0)
+			st.nodes[ep->node].ent = -1;
+		ep->odfp = NULL;
+		p = lr_parent(&st, odfp);
+
+		if (p >= 0) {
 			/* update a parent */
+			pp = &st.ents[p];
+			par = pp->odfp;
 			par->byte += odfp->byte;
 			par->packet += odfp->packet;
 
 			/* move protocols as well */
 			odfq_moveall(&odfp->odf_odpq, &par->odf_odpq);
 
-			/* insert this parent to the proper position */
-			odfq_insert(odfq, par, query.criteria);
+			/* the parent goes after the ones with the same count */
+			count = lr_count(par);
+			if (count != pp->count) {
+				pp->count = count;
+				pp->seq = st.nextseq++;
+				if (par->s.srclen != 0 || par->s.dstlen != 0)
+					lr_push(&st, p);
+			}
 		} else {
 			/* XXX can't do much here, just discard the entry */
 		}
 		/* free this entry */
 		odflow_free(odfp);
 		n--;
-
-		odfp = TAILQ_LAST(&odfq->odfq_head, odfqh);
 	}
-	assert(n == nflows);
+	/* only the wildcards can be left, when nflows is too small */
+	assert(n >= nflows);
+
+	/* put the remaining odflows back in the order */
+	for (e = 0, p = 0; e < st.nents; e++)
+		if (st.ents[e].odfp != NULL)
+			st.ents[p++] = st.ents[e];
+	qsort(st.ents, p, sizeof(struct lr_ent), lr_comp);
+	for (e = 0; e < p; e++) {
+		TAILQ_INSERT_TAIL(&odfq->odfq_head, st.ents[e].odfp, odf_chain);
+		odfq->nrecord++;
+	}
 	assert(n == odfq->nrecord);
+	free(st.ents);
+	free(st.heap);
+	free(st.nodes);
 }
 
 /* move all odflows from one tailq to another */
@@ -315,28 +651,6 @@ odfq_moveall(struct odf_tailq *from, struct odf_tailq *to)
 	return (n);
 }
 
-/* look for a parent odflow in the given tailq */
-static struct odflow *
-odfq_parentlookup(struct odf_tailq *odfq, struct odflow *odfp)
-{
-	struct odflow *par, *_odfp;
-
-	par = NULL;
-	TAILQ_FOREACH(_odfp, &odfq->odfq_head, odf_chain) {
-		if (_odfp->af != odfp->af)
-			continue;
-		if (odflowspec_is_overlapped(&(_odfp->s), &(odfp->s))) {
-			if (par == NULL) {
-				par = _odfp;
-				continue;
-			}
-			if (par->s.srclen + par->s.dstlen < _odfp->s.srclen + _odfp->s.dstlen) 
-				par = _odfp;
-		}
-	}
-	return (par);
-}
-
 /* is the first flow_spec is a superset of the second one? */
 int
 odflowspec_is_overlapped(struct odflow_spec *s0, struct odflow_spec *s1)
@@ -351,45 +665,6 @@ odflowspec_is_overlapped(struct odflow_spec *s0, struct odflow_spec *s1)
 	return (1);
 }
 
-/* insert this parent to the proper position in the sorted tailq */
-static void
-odfq_insert(struct odf_tailq *odfq, struct odflow *odfp, enum aggr_criteria criteria)
-{
-        struct odflow *_odfp;
-
-        _odfp = TAILQ_PREV(odfp, odfqh, odf_chain);
-        while (_odfp != NULL) {
-		if (criteria == PACKET) {
-                        if (odfp->packet <= _odfp->packet)
-                                break;
-		}
-		if (criteria == BYTE) {
-                        if (odfp->byte <= _odfp->byte)
-                                break;
-                }
-		if (criteria == COMBINATION) {
-			/* XXX assuming bpratio4sort is set in odfq_countsort() */
-			uint64_t c, _c, scaledpkt;
-			scaledpkt = (uint64_t)(bpratio4sort * odfp->packet);
-			c = max(odfp->byte, scaledpkt);
-			scaledpkt = (uint64_t)(bpratio4sort * _odfp->packet);
-			_c = max(_odfp->byte, scaledpkt);
-			if (c <= _c)
-				break;
-		}
-                _odfp = TAILQ_PREV(_odfp, odfqh, odf_chain);
-        }
-        if (_odfp != NULL) {
-                if (TAILQ_NEXT(odfp, odf_chain) != _odfp) {
-                        TAILQ_REMOVE(&odfq->odfq_head, odfp, odf_chain);
-                        TAILQ_INSERT_AFTER(&odfq->odfq_head, _odfp, odfp, odf_chain);
-                }
-        } else if (TAILQ_FIRST(&odfq->odfq_head) != odfp) {
-                TAILQ_REMOVE(&odfq->odfq_head, odfp, odf_chain);
-                TAILQ_INSERT_HEAD(&odfq->odfq_head, odfp, odf_chain);
-        }
-}
-
 /* helper for qsort: compare the sum of prefix length */
 static int
 area_comp(const void *p0, const void *p1)
@@ -407,7 +682,8 @@ area_comp(const void *p0, const void *p1)
 		return (1);
 	if (len0 > len1)
 		return (-1);
-	return (0);
+	/* break a tie by the spec, not to depend on the hash order */
+	return (memcmp(&e0->s, &e1->s, sizeof(struct odflow_spec)));
 }
 
 /*
@@ -482,7 +758,11 @@ count_comp(const void *p0, const void *p1)
 		break;
 	}
 	}
-	return (0);
+	/*
+	 * break a tie by the spec, not to depend on the hash order.
+	 * the list is reversed after sorting, so compare in reverse.
+	 */
+	return (memcmp(&odfp1->s, &odfp0->s, sizeof(struct odflow_spec)));
 }
 
 /* sort the tailq by the count */
@@ -615,9 +895,33 @@ aguri_preamble_print(struct response *resp)
 	    disable_heuristics < 2 ? query.threshold * 4 : query.threshold);
 	fprintf(wfp, "%%input odflows: IPv4:%"PRIu64" IPv6:%"PRIu64"\n",
 	    resp->input_odflows, resp->input_odflows6);
+	if (odproto_topk > 0 && resp->total_byte > 0)
+		fprintf(wfp, "%%topk: %d sub-odflows, %"PRIu64" taken over, "
+		    "error <= %.2f%% bytes %.2f%% packets\n", odproto_topk,
+		    resp->topk_evicted,
+		    (double)resp->topk_errbyte / resp->total_byte * 100,
+		    (double)resp->topk_errpacket / resp->total_packet * 100);
+	if (query.sample_rate > 1 && resp->total_byte > 0)
+		fprintf(wfp, "%%sampled: 1/%d records (%"PRIu64" of %"PRIu64"), "
+		    "error <= %.2f%% bytes %.2f%% packets\n", query.sample_rate,
+		    resp->sample_taken, resp->sample_records,
+		    sample_error(resp->sample_sqbyte, resp->total_byte),
+		    sample_error(resp->sample_sqpacket, resp->total_packet));
+	if (hhh_deadline_ms > 0 && resp->refined > 0) {
+		fprintf(wfp, "%%refined: %d/%d levels, IPv4:/%d IPv6:/%d",
+		    resp->refined, HHH_NLEVELS, resp->refined_len4,
+		    resp->refined_len6);
+		if (resp->subs_dropped > 0)
+			fprintf(wfp, ", %d without protocols",
+			    resp->subs_dropped);
+		fprintf(wfp, "\n");
+	}
 	fprintf(wfp, "%%aggregated in %d ms", resp->processing_time);
 	if (blocking_count > 0)
 		fprintf(wfp, ", blocking_count:%u", blocking_count);
+	if (resp->hash_avgprobe > ODHASH_PROBEWARN)
+		fprintf(wfp, ", hash_probe:avg %.2f max %d",
+		    resp->hash_avgprobe, resp->hash_maxprobe);
 	fprintf(wfp, "\n\n");
 }
 
@@ -663,6 +967,24 @@ aguri_odflow_print(struct response *resp)
 	}
 }
 
+/*
+ * bound of the estimation error by sampling, in percent of the total,
+ * at the 95% confidence level.  a count estimated from records taken
+ * with probability p = 1/n has the variance (1-p)/p * sum(x^2) over
+ * the records, and sum(x^2) is estimated by n * sum(x^2) over the
+ * taken ones.  the sum over all the taken records bounds the variance
+ * of any odflow, so the bound holds for each odflow in the output.
+ */
+static double
+sample_error(double sqsum, uint64_t total)
+{
+	double n = query.sample_rate;
+
+	if (total == 0)
+		return (0.0);
+	return (1.96 * sqrt(n * (n - 1) * sqsum) / total * 100);
+}
+
 static void
 json_preamble_print(struct response *resp)
 {
@@ -685,6 +1007,22 @@ json_preamble_print(struct response *resp)
 	*/
 
 	fprintf(wfp, "\"nflows\": %d, \n", resp->nflows);
+
+	if (query.sample_rate > 1 && resp->total_byte > 0) {
+		fprintf(wfp, "\"sample_rate\": %d, \n", query.sample_rate);
+		fprintf(wfp, "\"sampled_records\": [%"PRIu64", %"PRIu64"], \n",
+		    resp->sample_taken, resp->sample_records);
+		fprintf(wfp, "\"sample_error\": [%.2f, %.2f], \n",
+		    sample_error(resp->sample_sqbyte, resp->total_byte),
+		    sample_error(resp->sample_sqpacket, resp->total_packet));
+	}
+	if (hhh_deadline_ms > 0 && resp->refined > 0) {
+		fprintf(wfp, "\"refined\": [%d, %d], \n",
+		    resp->refined, HHH_NLEVELS);
+		if (resp->subs_dropped > 0)
+			fprintf(wfp, "\"without_protocols\": %d, \n",
+			    resp->subs_dropped);
+	}
 	
 	fprintf(wfp, "\"interval\": %d, \n", resp->interval);
 }
@@ -737,7 +1075,7 @@ json_odflow_print(struct response *resp)
 		tmp_total = 0;
 		fprintf(wfp, "[%ld, ", plot_timestamps[i]);
 		TAILQ_FOREACH(odfp, &resp->odfq.odfq_head, odf_chain) {
-			uint64_t cnt = cl_get(odfp->odf_cache, i);
+			uint64_t cnt = cl_get(&odfp->odf_cache, i);
 			tmp_total += cnt;
 			fprintf(wfp, "%" PRIu64 ", ", cnt);
 		}
@@ -819,7 +1157,7 @@ debug_odflow_print(struct response *resp)
 		fprintf(wfp, "%ld, ", plot_timestamps[i]);
 		TAILQ_FOREACH(odfp, &resp->odfq.odfq_head, odf_chain) {
 			uint64_t cnt;
-			cnt = cl_get(odfp->odf_cache, i);
+			cnt = cl_get(&odfp->odf_cache, i);
 			tmp_total += cnt;
 			fprintf(wfp, "%" PRIu64 ", ", cnt);
 		}
@@ -33,11 +33,20 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <err.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ODMATCH_X86	/* sse2 and avx2 kernels, chosen at run time */
+#endif
 
 #include "agurim.h"
 
+enum odmatch_isa odmatch_isa = ODMATCH_AUTO;
+int odmatch_triemin = ODMATCH_TRIEMIN;
+
 static uint8_t prefixmask[8]
     = { 0x00, 0x80, 0xc0, 0xe0, 0xf0, 0xf8, 0xfc, 0xfe };
 
@@ -72,20 +81,401 @@ void
 prefix_set(uint8_t *r0, uint8_t len, uint8_t *r1, int bytesize)
 {
 	uint8_t bits, bytes = len / 8;
-	uint8_t pad = bytesize - bytes;
 
 	bits = len & 7;
-	if (bits)
-		pad--;
+	memcpy(r1, r0, bytes);
+	if (bits != 0) {
+		r1[bytes] = r0[bytes] & prefixmask[bits];
+		bytes++;
+	}
+	if (bytesize > bytes)
+		memset(&r1[bytes], 0, bytesize - bytes);
+}
 
-	while (bytes-- != 0)
-		*r1++ = *r0++;
+/*
+ * odmatch_first() returns the index of the first entry of the odmatch
+ * which is a superset of the given flow_spec of the address family
+ * (odflowspec_is_overlapped()), or -1.
+ * the entries are laid out by 32-bit words of the masked addresses,
+ * so that the vector kernels compare a word of ODMATCH_LANES (avx2)
+ * or 4 (sse2) entries by an instruction.  the words are compared in
+ * the memory order, so the byte order does not matter.
+ * the padding entries have af -1, which does not match any flow.
+ */
+static int
+odmatch_scalar(struct odmatch *om, struct odflow_spec *odfsp, int af)
+{
+	uint32_t src[MAXLEN / 4], dst[MAXLEN / 4];
+	int j, w;
+
+	memcpy(src, odfsp->src, MAXLEN);
+	memcpy(dst, odfsp->dst, MAXLEN);
+	for (j = 0; j < om->n; j++) {
+		if (om->af[j] != af || om->srclen[j] > odfsp->srclen ||
+		    om->dstlen[j] > odfsp->dstlen)
+			continue;
+		for (w = 0; w < om->nsrcwords; w++)
+			if ((src[w] & om->srcmask[w][j]) != om->src[w][j])
+				break;
+		if (w < om->nsrcwords)
+			continue;
+		for (w = 0; w < om->ndstwords; w++)
+			if ((dst[w] & om->dstmask[w][j]) != om->dst[w][j])
+				break;
+		if (w == om->ndstwords)
+			return (j);
+	}
+	return (-1);
+}
 
-	if (bits != 0)
-		*r1++= *r0 & prefixmask[bits]; 
+#ifdef ODMATCH_X86
+__attribute__((__target__("sse2"))) static int
+odmatch_sse2(struct odmatch *om, struct odflow_spec *odfsp, int af)
+{
+	uint32_t src[MAXLEN / 4], dst[MAXLEN / 4];
+	__m128i vaf, vsrclen, vdstlen, vsrc[MAXLEN / 4], vdst[MAXLEN / 4];
+	__m128i ok, x;
+	int j, w, m;
+
+#define LOAD(p)	_mm_loadu_si128((__m128i *)(p))
+	memcpy(src, odfsp->src, MAXLEN);
+	memcpy(dst, odfsp->dst, MAXLEN);
+	vaf = _mm_set1_epi32(af);
+	vsrclen = _mm_set1_epi32(odfsp->srclen);
+	vdstlen = _mm_set1_epi32(odfsp->dstlen);
+	for (w = 0; w < om->nsrcwords; w++)
+		vsrc[w] = _mm_set1_epi32(src[w]);
+	for (w = 0; w < om->ndstwords; w++)
+		vdst[w] = _mm_set1_epi32(dst[w]);
+	for (j = 0; j < om->nslots; j += 4) {
+		ok = _mm_cmpeq_epi32(LOAD(&om->af[j]), vaf);
+		/* the entry is not longer than the flow */
+		ok = _mm_andnot_si128(_mm_cmpgt_epi32(LOAD(&om->srclen[j]),
+		    vsrclen), ok);
+		ok = _mm_andnot_si128(_mm_cmpgt_epi32(LOAD(&om->dstlen[j]),
+		    vdstlen), ok);
+		for (w = 0; w < om->nsrcwords; w++) {
+			x = _mm_and_si128(vsrc[w], LOAD(&om->srcmask[w][j]));
+			ok = _mm_and_si128(ok,
+			    _mm_cmpeq_epi32(x, LOAD(&om->src[w][j])));
+		}
+		for (w = 0; w < om->ndstwords; w++) {
+			x = _mm_and_si128(vdst[w], LOAD(&om->dstmask[w][j]));
+			ok = _mm_and_si128(ok,
+			    _mm_cmpeq_epi32(x, LOAD(&om->dst[w][j])));
+		}
+		if ((m = _mm_movemask_ps(_mm_castsi128_ps(ok))) != 0)
+			return (j + __builtin_ctz(m));
+	}
+	return (-1);
+#undef LOAD
+}
 
-	while (pad--)
-		*r1++ = 0;
+__attribute__((__target__("avx2"))) static int
+odmatch_avx2(struct odmatch *om, struct odflow_spec *odfsp, int af)
+{
+	uint32_t src[MAXLEN / 4], dst[MAXLEN / 4];
+	__m256i vaf, vsrclen, vdstlen, vsrc[MAXLEN / 4], vdst[MAXLEN / 4];
+	__m256i ok, x;
+	int j, w, m;
+
+#define LOAD(p)	_mm256_loadu_si256((__m256i *)(p))
+	memcpy(src, odfsp->src, MAXLEN);
+	memcpy(dst, odfsp->dst, MAXLEN);
+	vaf = _mm256_set1_epi32(af);
+	vsrclen = _mm256_set1_epi32(odfsp->srclen);
+	vdstlen = _mm256_set1_epi32(odfsp->dstlen);
+	for (w = 0; w < om->nsrcwords; w++)
+		vsrc[w] = _mm256_set1_epi32(src[w]);
+	for (w = 0; w < om->ndstwords; w++)
+		vdst[w] = _mm256_set1_epi32(dst[w]);
+	for (j = 0; j < om->nslots; j += ODMATCH_LANES) {
+		ok = _mm256_cmpeq_epi32(LOAD(&om->af[j]), vaf);
+		ok = _mm256_andnot_si256(_mm256_cmpgt_epi32(LOAD(&om->srclen[j]),
+		    vsrclen), ok);
+		ok = _mm256_andnot_si256(_mm256_cmpgt_epi32(LOAD(&om->dstlen[j]),
+		    vdstlen), ok);
+		for (w = 0; w < om->nsrcwords; w++) {
+			x = _mm256_and_si256(vsrc[w], LOAD(&om->srcmask[w][j]));
+			ok = _mm256_and_si256(ok,
+			    _mm256_cmpeq_epi32(x, LOAD(&om->src[w][j])));
+		}
+		for (w = 0; w < om->ndstwords; w++) {
+			x = _mm256_and_si256(vdst[w], LOAD(&om->dstmask[w][j]));
+			ok = _mm256_and_si256(ok,
+			    _mm256_cmpeq_epi32(x, LOAD(&om->dst[w][j])));
+		}
+		if ((m = _mm256_movemask_ps(_mm256_castsi256_ps(ok))) != 0)
+			return (j + __builtin_ctz(m));
+	}
+	return (-1);
+#undef LOAD
+}
+#endif /* ODMATCH_X86 */
+
+/*
+ * the trie of an odmatch, as lr_state in agurim_plot.c: a node of the
+ * src trie has the root of a dst trie for the entries with its src
+ * prefix, and the dst trie has the first entry of each prefix pair.
+ * min is the first entry under the node, including the dst tries for
+ * a src node, so that a subtree which cannot have an earlier entry
+ * than the one already found is skipped.
+ * the chains of nodes with a single child and nothing else are
+ * skipped by the links (path compression).  the prefix of a node is
+ * that of its min entry, which is checked when the node is reached.
+ */
+struct odmatch_node {
+	int	child[2];
+	int	sub;		/* root of the dst trie (src trie only) */
+	int	ent;		/* entry with this prefix (dst trie only) */
+	int	min;		/* first entry in the subtree */
+	int	depth;		/* prefix length of the node */
+};
+
+#define ODMATCH_BIT(p, i)	(((p)[(i) >> 3] >> (7 - ((i) & 7))) & 1)
+#define ODMATCH_ROOT(af)	((af) == AF_INET ? 0 : ((af) == AF_INET6 ? 1 : 2))
+
+static int
+odmatch_newnode(struct odmatch *om, int e, int depth)
+{
+	struct odmatch_node *np;
+
+	if (om->nnodes == om->maxnodes) {
+		om->maxnodes = om->maxnodes == 0 ? 256 : om->maxnodes * 2;
+		om->nodes = realloc(om->nodes,
+		    sizeof(struct odmatch_node) * om->maxnodes);
+		if (om->nodes == NULL)
+			err(1, "odmatch_newnode: realloc");
+	}
+	np = &om->nodes[om->nnodes];
+	np->child[0] = np->child[1] = -1;
+	np->sub = np->ent = -1;
+	np->min = e;
+	np->depth = depth;
+	return (om->nnodes++);
+}
+
+/*
+ * put the entry e in the trie.  the entries are put in the order,
+ * so that the first one stays in a node and min is set on creation.
+ */
+static void
+odmatch_insert(struct odmatch *om, int e)
+{
+	struct odflow_spec *odfsp = &om->specs[e];
+	int *rootp, i, b, n, next;
+
+	rootp = &om->roots[ODMATCH_ROOT(om->af[e])];
+	if (*rootp < 0)
+		*rootp = odmatch_newnode(om, e, 0);
+	n = *rootp;
+	for (i = 0; i < odfsp->srclen; i++) {
+		b = ODMATCH_BIT(odfsp->src, i);
+		if ((next = om->nodes[n].child[b]) < 0) {
+			next = odmatch_newnode(om, e, i + 1);
+			om->nodes[n].child[b] = next;
+		}
+		n = next;
+	}
+	if (om->nodes[n].sub < 0) {
+		next = odmatch_newnode(om, e, 0);
+		om->nodes[n].sub = next;
+	}
+	n = om->nodes[n].sub;
+	for (i = 0; i < odfsp->dstlen; i++) {
+		b = ODMATCH_BIT(odfsp->dst, i);
+		if ((next = om->nodes[n].child[b]) < 0) {
+			next = odmatch_newnode(om, e, i + 1);
+			om->nodes[n].child[b] = next;
+		}
+		n = next;
+	}
+	if (om->nodes[n].ent < 0)
+		om->nodes[n].ent = e;
+}
+
+/* the end of the chain of single-child nodes from n */
+static int
+odmatch_skip(struct odmatch *om, int n)
+{
+	struct odmatch_node *np;
+
+	while (n >= 0) {
+		np = &om->nodes[n];
+		if (np->sub >= 0 || np->ent >= 0 ||
+		    (np->child[0] >= 0 && np->child[1] >= 0))
+			break;
+		n = np->child[0] >= 0 ? np->child[0] : np->child[1];
+	}
+	return (n);
+}
+
+/* link over the chains, by the nodes reachable from the roots */
+static void
+odmatch_compress(struct odmatch *om)
+{
+	struct odmatch_node *np;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		om->roots[i] = odmatch_skip(om, om->roots[i]);
+	/* the chains are skipped in any node, reachable or not */
+	for (i = 0; i < om->nnodes; i++) {
+		np = &om->nodes[i];
+		np->child[0] = odmatch_skip(om, np->child[0]);
+		np->child[1] = odmatch_skip(om, np->child[1]);
+		np->sub = odmatch_skip(om, np->sub);
+	}
+}
+
+/*
+ * walk the src trie along the src of the flow, and the dst trie of
+ * each src node along the dst, and take the first entry on the way.
+ */
+static int
+odmatch_trie(struct odmatch *om, struct odflow_spec *odfsp, int af)
+{
+	struct odmatch_node *nodes = om->nodes;
+	int n, m, d, e, best = INT_MAX;
+
+	for (n = om->roots[ODMATCH_ROOT(af)]; n >= 0 && nodes[n].min < best;
+	    n = nodes[n].child[ODMATCH_BIT(odfsp->src, d)]) {
+		d = nodes[n].depth;
+		if (d > odfsp->srclen ||
+		    prefix_comp(odfsp->src, om->specs[nodes[n].min].src, d) != 0)
+			break;
+		for (m = nodes[n].sub; m >= 0 && nodes[m].min < best;
+		    m = nodes[m].child[ODMATCH_BIT(odfsp->dst, e)]) {
+			e = nodes[m].depth;
+			if (e > odfsp->dstlen || prefix_comp(odfsp->dst,
+			    om->specs[nodes[m].min].dst, e) != 0)
+				break;
+			if (nodes[m].ent >= 0 && nodes[m].ent < best)
+				best = nodes[m].ent;
+			if (e == odfsp->dstlen)
+				break;
+		}
+		if (d == odfsp->srclen)
+			break;
+	}
+	return (best == INT_MAX ? -1 : best);
+}
+
+/* the address and the mask of a prefix as 32-bit words */
+static void
+odmatch_words(uint8_t *addr, uint8_t len, uint32_t *val, uint32_t *mask)
+{
+	uint8_t ones[MAXLEN], buf[MAXLEN];
+	int w;
+
+	memset(ones, 0xff, MAXLEN);
+	prefix_set(ones, len, buf, MAXLEN);
+	memcpy(mask, buf, MAXLEN);
+	prefix_set(addr, len, buf, MAXLEN);
+	memcpy(val, buf, MAXLEN);
+	for (w = 0; w < MAXLEN / 4; w++)
+		val[w] &= mask[w];
+}
+
+/*
+ * make an odmatch of the odflows in the given order, and choose the
+ * kernel by odmatch_isa and the cpu.
+ */
+struct odmatch *
+odmatch_alloc(struct odflow **flows, int n)
+{
+	struct odmatch *om;
+	uint32_t *p, val[MAXLEN / 4], mask[MAXLEN / 4];
+#ifdef ODMATCH_X86
+	enum odmatch_isa isa = odmatch_isa;
+#endif
+	int j, w;
+
+	if ((om = calloc(1, sizeof(struct odmatch))) == NULL)
+		err(1, "odmatch_alloc: calloc");
+	om->n = n;
+	om->nslots = (n + ODMATCH_LANES - 1) / ODMATCH_LANES * ODMATCH_LANES;
+	/* af, srclen, dstlen, and 4 arrays of words for src and dst */
+	om->buf = calloc((3 + 4 * MAXLEN / 4) * max(om->nslots, 1),
+	    sizeof(uint32_t));
+	if ((p = om->buf) == NULL)
+		err(1, "odmatch_alloc: calloc");
+	om->af = (int32_t *)p;
+	om->srclen = (int32_t *)(p += om->nslots);
+	om->dstlen = (int32_t *)(p += om->nslots);
+	for (w = 0; w < MAXLEN / 4; w++) {
+		om->src[w] = (p += om->nslots);
+		om->srcmask[w] = (p += om->nslots);
+		om->dst[w] = (p += om->nslots);
+		om->dstmask[w] = (p += om->nslots);
+	}
+	for (j = 0; j < om->nslots; j++)
+		om->af[j] = -1;
+
+	for (j = 0; j < n; j++) {
+		struct odflow_spec *odfsp = &flows[j]->s;
+
+		om->af[j] = flows[j]->af;
+		om->srclen[j] = odfsp->srclen;
+		om->dstlen[j] = odfsp->dstlen;
+		odmatch_words(odfsp->src, odfsp->srclen, val, mask);
+		for (w = 0; w < MAXLEN / 4; w++) {
+			om->src[w][j] = val[w];
+			om->srcmask[w][j] = mask[w];
+		}
+		odmatch_words(odfsp->dst, odfsp->dstlen, val, mask);
+		for (w = 0; w < MAXLEN / 4; w++) {
+			om->dst[w][j] = val[w];
+			om->dstmask[w][j] = mask[w];
+		}
+		om->nsrcwords = max(om->nsrcwords, (odfsp->srclen + 31) / 32);
+		om->ndstwords = max(om->ndstwords, (odfsp->dstlen + 31) / 32);
+	}
+
+#ifdef ODMATCH_X86
+	if ((isa == ODMATCH_AUTO || isa == ODMATCH_AVX2) &&
+	    !__builtin_cpu_supports("avx2"))
+		isa = ODMATCH_SSE2;
+	if (isa == ODMATCH_SSE2 && !__builtin_cpu_supports("sse2"))
+		isa = ODMATCH_SCALAR;
+	switch (isa) {
+	case ODMATCH_SCALAR:
+		om->first = odmatch_scalar;
+		break;
+	case ODMATCH_SSE2:
+		om->first = odmatch_sse2;
+		break;
+	default:
+		om->first = odmatch_avx2;
+		break;
+	}
+#else
+	om->first = odmatch_scalar;
+#endif
+
+	/* a long list is searched by the trie */
+	om->roots[0] = om->roots[1] = om->roots[2] = -1;
+	if (n >= odmatch_triemin) {
+		om->specs = malloc(sizeof(struct odflow_spec) * n);
+		if (om->specs == NULL)
+			err(1, "odmatch_alloc: malloc");
+		for (j = 0; j < n; j++) {
+			om->specs[j] = flows[j]->s;
+			odmatch_insert(om, j);
+		}
+		odmatch_compress(om);
+		om->first = odmatch_trie;
+	}
+	return (om);
+}
+
+void
+odmatch_free(struct odmatch *om)
+{
+	free(om->buf);
+	free(om->nodes);
+	free(om->specs);
+	free(om);
 }
 
 static void
@@ -174,24 +564,6 @@ odproto_print(struct odflow *odpp)
  */
 /* use simpler malloc/realloc */
 #define CL_INITSIZE	64	/* initial array size */
-struct cache_list *
-cl_alloc(void)
-{
-	struct cache_list *clp;
-
-	if ((clp = calloc(1, sizeof(struct cache_list))) == NULL)
-		return NULL;
-	return (clp);
-}
-
-void
-cl_free(struct cache_list *clp)
-{
-	if (clp->cl_data != NULL)
-		free(clp->cl_data);
-	free(clp);
-}
-
 void
 cl_clear(struct cache_list *clp)
 {
@@ -260,3 +632,13 @@ cl_add(struct cache_list *clp, int i, uint64_t val)
 	return (0);
 }
 #endif /* !CL_INLINE */
+
+/* monotonic clock in microseconds (for the profile) */
+uint64_t
+prof_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
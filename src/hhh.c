@@ -35,6 +35,7 @@
 
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -57,26 +58,257 @@ struct hhh_params {
 	int	cutoff;	    /* apply coarser granularity when prefixlen is 
 			       shorter than this value */
 	int	cutoffres;  /* resolution for cutoff region */
+	enum odkey_type keytype; /* key type of the hashes for aggregation */
 	struct response *resp;  /* response */
 	struct odf_tailq *odfqp;/* queue for placing extracted odflows */
+	struct hhh_memo *memo;	/* memo of the aggregates, or NULL */
+	int	keep;		/* leave the original odflows as they are */
+	struct odflow **inputs;	/* all the original odflows, to make the
+				   memo tables kept over the runs, or NULL */
+	struct odflow *root;	/* dummy top node listing all of them */
+	uint64_t nodes;		/* nodes visited (for the profile) */
+	uint64_t pruned;	/* nodes skipped by the bounds (ditto) */
 };
 
+struct hhh_scratch;
+struct hhh_bound;
+
 inline static int label_check(struct odflow_spec *odfsp, int label[]);
 inline static int thresh_check(struct odflow *odfp, 
 				uint64_t thresh, uint64_t thresh2);
 static int odflow_aggregate(struct odflow_hash *odfh, struct odflow *parent,
-		int label[], struct hhh_params *params);
+		int label[], struct hhh_scratch *sc, struct hhh_params *params);
 static int odflow_extract(struct odflow_hash *odfh, struct odflow *parent,
 				struct hhh_params *params);
+static void odflow_layout(struct odflow_hash *odfh, struct hhh_scratch *sc);
+static int aggregate_parallel(struct odflow_hash *odfh, struct odflow *parent,
+		int label[], struct hhh_scratch *sc, struct hhh_params *params);
+static void aggregate_task(void *arg, int i);
+static int memo_aggregate(struct odflow_hash *odfh, struct odflow *parent,
+		int label[], struct hhh_scratch *sc, struct hhh_params *params);
+static struct memo_table *memo_lookup(struct hhh_memo *memo, int label[]);
+static void memo_save(struct hhh_memo *memo, int label[],
+		struct odflow_hash *odfh, int *rest, int nrest);
+static void memo_free(struct hhh_memo *memo);
+static void memo_complete(struct hhh_params *params, int label[]);
+static void odflow_remove(struct hhh_params *params, int idx,
+		struct odflow *odfp);
+static void bound_make(struct hhh_bound *hb, struct odflow *odfp,
+		struct hhh_params *params);
+inline static int bound_check(struct hhh_bound *hb, int pl0, int pl1,
+		struct hhh_params *params);
 static int lattice_search(struct odflow *parent, int pl0, int pl1, int size,
 			int pos, struct hhh_params *params);
+static int lattice_visit(struct odflow *odfp, int pl0, int pl1, int delta,
+			int subsize, int on_edge, struct hhh_params *params,
+			uint64_t *dpacket, uint64_t *dbyte);
+static int lattice_fork(struct odflow *parent, struct odflow_hash *my_hash,
+			int pl0, int pl1, int delta, int subsize, int on_edge,
+			struct hhh_params *params);
+static void lattice_task(void *arg, int i);
+static int sort_search(struct hhh_params *params, int n, int af);
+static struct hhh_scratch *scratch_push(int n);
+static void scratch_pop(struct hhh_scratch *sc);
+struct hhh_input;
 static int find_hhh(struct odflow_hash *hash, int bitlen,
 		uint64_t thresh, uint64_t thresh2,
-		struct response *resp, struct odf_tailq *odfqp);
+		struct response *resp, struct odf_tailq *odfqp,
+		struct hhh_input *in);
+inline static int hhh_expired(void);
+static struct odflow_hash *hhh_coarsen(struct odflow_hash *hash,
+		struct odflow **origs, int bitlen, int len,
+		struct response *resp);
+static void hhh_takesubs(struct odf_tailq *results, struct odflow **origs,
+		uint64_t deadline);
+static struct odflow **hhh_origs(struct odflow_hash *hash);
+static void hhh_subinputs(struct odflow *odfp, struct odflow **origs,
+		struct hhh_input *in);
+
+/*
+ * inputs of find_hhh() for the runs of a -t list (resp->keep_inputs).
+ * the odflows are searched in place, and left as they are for the
+ * next run.  an extracted odflow gets a proxy in place of the
+ * sub-odflows of its inputs, as in hhh_coarsen(), and hhh_subtask()
+ * searches the sub-odflows of the inputs in place.
+ * the memo is kept over the runs.  only the tables of all the
+ * inputs are kept, as the others depend on the odflows extracted
+ * for the threshold.
+ */
+struct hhh_input {
+	struct odflow **odfs;	/* odflows to search in place, or NULL */
+	int	n;
+	struct hhh_memo *memo;	/* memo kept over the runs, or NULL */
+};
+
+/*
+ * pieces of hhh_run() run by taskq_run().  find_hhh() for ip_hash and
+ * ip6_hash, and then for the sub-attributes of each result, are
+ * independent of each other.
+ */
+struct hhh_task {
+	struct response *resp;
+	struct odflow_hash *hash;	/* input of the main attribute */
+	int	bitlen;
+	struct odf_tailq odfq;		/* results of this piece */
+	int	nflows;
+	struct hhh_input in;		/* for the runs of a -t list */
+};
+
+struct hhh_subtasks {
+	struct response *resp;
+	struct odflow **results;	/* results of the main attribute */
+	struct odflow **origs[2];	/* inputs of the tasks, or NULL */
+};
+
+static void hhh_maintask(void *arg, int i);
+static void hhh_subtask(void *arg, int i);
+static void hhh_dropsubs(struct response *resp, struct odflow *odfp);
+static void hhh_anytime(struct response *resp, struct hhh_task *tasks,
+		int ntasks, uint64_t deadline);
+
+/*
+ * prefix lengths of the levels of the coarse-to-fine search, for IPv4
+ * and IPv6.  the last level is the full search.
+ */
+static const int refine_lens[HHH_NLEVELS][2] = {
+	{ 8, 16 }, { 16, 32 }, { 24, 48 }, { 32, 128 }
+};
+/*
+ * the full search takes up to about this many times the first level
+ * (7x to 13x for 5k to 400k input odflows).  the first level hashes
+ * all the inputs once, so it tells the speed of the machine for them.
+ */
+#define HHH_PROBERATIO	16
+
+/*
+ * the sub-areas of the aggregated odflows in a hash (siblings) are
+ * searched as tasks when there are several threads.  a sibling takes
+ * the original odflows in its own cache_list, so the searches of the
+ * siblings are independent.  each task places the extracted odflows
+ * in its own queue, and the queues and the counts to subtract from
+ * the parent are merged in the hash order after all have finished.
+ */
+struct lattice_task {
+	struct odflow *odfp;		/* sibling to visit */
+	int	pl0, pl1, delta, subsize, on_edge;
+	struct hhh_params params;	/* odfqp points to odfq below */
+	struct odf_tailq odfq;		/* odflows extracted by this task */
+	int	nflows;
+	uint64_t dpacket, dbyte;	/* counts extracted from odfp */
+};
+
+#define HHH_TASKMIN	1024	/* min original odflows to make a task */
+
+/*
+ * a large cache_list is aggregated in chunks by tasks when there are
+ * several threads (see aggregate_parallel()).  each task aggregates
+ * a contiguous chunk of the parent's list into its own hash, and
+ * the partial aggregates are merged into the hash of the node in
+ * the order of the chunks, so that the entries are created in the
+ * same order as by a single thread.
+ */
+struct hhh_partial {
+	struct odflow *parent;
+	int	*label;
+	struct hhh_params *params;
+	int	start, end;		/* chunk of the parent's list */
+	struct odflow_hash *hash;	/* partial aggregates */
+	struct odflow_pool *pool;
+	struct odflow **groups;		/* partial aggregates in order made */
+	int	ngroups;
+	int	*owners;		/* group of each index, or -1 */
+	int	nflows;
+};
+
+#define HHH_PARAGGMIN	65536	/* min list size to aggregate in chunks */
+
+/*
+ * memo of the aggregates of the whole flow_list, shared by the passes
+ * of lattice_search() in find_hhh().
+ * each pass starts by aggregating all the original odflows, and so do
+ * the first levels of the sub-areas under the [0,0] wildcard.  the
+ * aggregates for a label pair can be made from a memo table for a
+ * longer label pair, with a lookup per memo entry instead of a lookup
+ * per original odflow.
+ * the counts are not kept in the tables: the odflows extracted after
+ * a table is made are removed from the flow_list, so the counts are
+ * summed up again from the remaining odflows when the table is used.
+ */
+struct memo_ent {
+	struct odflow_spec s;	/* aggregated spec for the label */
+	int	start, size;	/* original odflows in memo_table.indices */
+};
 
+struct memo_table {
+	int	label[2];
+	struct memo_ent *ents;
+	int	nents;
+	int	*indices;	/* original odflows of the entries */
+	int	*rest;		/* original odflows not fitting the label */
+	int	nrest;
+};
+
+struct hhh_memo {
+	struct memo_table *tables;
+	int	ntables, maxtables;
+};
+
+#define HHH_MEMOMIN	1024	/* min original odflows to use the memo */
+
+/*
+ * upper bounds of the aggregates under an aggregated odflow, for
+ * pruning the lattice search.  an aggregate for a longer label pair
+ * is a part of the source prefix, and of the destination prefix,
+ * a few bits longer than the odflow.  when none of these can be
+ * above the threshold, the search for the label pair is skipped.
+ */
+#define HHH_BOUNDBITS	8	/* bits looked ahead */
+
+struct hhh_bound {
+	int	len[2];		/* prefix lengths of the odflow: src, dst */
+	int	nbits[2];	/* bits looked ahead for src, dst */
+	uint64_t byte[2][HHH_BOUNDBITS + 1];   /* largest part by bits */
+	uint64_t packet[2][HHH_BOUNDBITS + 1];
+};
+
+#define HHH_BOUNDMIN	64	/* min original odflows to make the bounds */
+
+/*
+ * scratch space for a lattice node: a hash with a pool for the
+ * aggregated odflows, and a buffer for their cache_lists.
+ * each thread keeps a stack of them.  a node takes one when it
+ * aggregates, and returns it emptied before returning, so the
+ * nodes visited later at the same depth reuse the memory instead of
+ * allocating a hash, odflows and cache_lists for each node.
+ * a stack (not a slot per depth) is used because a thread waiting
+ * for tasks in lattice_fork() may run a stolen task on top of its
+ * own nodes.
+ */
+struct hhh_scratch {
+	struct odflow_hash *hash;	/* aggregated odflows */
+	struct odflow_pool *pool;	/* odflows in hash */
+	uint64_t *indices;		/* cache_lists of the odflows */
+	struct odflow **owners;		/* odflow taking each index */
+	int	size;			/* entries of indices and owners */
+};
+
+static __thread struct hhh_scratch **scratch_stack;
+static __thread int scratch_top, scratch_max;
+
+/*
+ * dummy_hash is shared by the threads.  it is created before the
+ * tasks start, and only iterated in lattice_search().
+ */
 static struct odflow_hash *dummy_hash;  /* used in lattice_search for
 					 * dummy iteration */
 int disable_heuristics = 0;  /* do not use label heuristics */
+int hhh_nthreads = 1;	/* threads used by hhh_run() */
+int hhh_profile = 0;	/* collect the profile in the response */
+int hhh_deadline_ms = 0; /* time limit of hhh_run() (0: none) */
+static uint64_t hhh_stoptime;	/* deadline of the search being run */
+static int hhh_stopped;		/* the search has been abandoned */
+static uint64_t scratch_allocs;	/* scratch tables allocated so far */
+enum hhh_engine hhh_engine = HHH_LATTICE; /* algorithm used by find_hhh() */
 
 /*
  * check if the odflow fits into the given label pair
@@ -116,6 +348,17 @@ thresh_check(struct odflow *odfp, uint64_t thresh, uint64_t thresh2)
 	return (0);
 }
 
+/* prefix_set() for a 32-bit address */
+inline static void
+prefix_set4(uint8_t *r0, uint8_t len, uint8_t *r1)
+{
+	uint32_t addr;
+
+	memcpy(&addr, r0, 4);
+	addr = len == 0 ? 0 : htonl(ntohl(addr) & (~0U << (32 - len)));
+	memcpy(r1, &addr, 4);
+}
+
 /*
  * create new odflow record based on the flowspec and the label
  */
@@ -127,8 +370,14 @@ odflowspec_gen(struct odflow_spec *odfsp, int label[], int bytesize)
 	memset(&(_odfsp), 0, sizeof(struct odflow_spec));
 	_odfsp.srclen = label[0];
 	_odfsp.dstlen = label[1];
-	prefix_set(odfsp->src, _odfsp.srclen, _odfsp.src, bytesize);
-	prefix_set(odfsp->dst, _odfsp.dstlen, _odfsp.dst, bytesize);
+	if (bytesize == 4) {
+		/* IPv4: mask as 32-bit integers */
+		prefix_set4(odfsp->src, _odfsp.srclen, _odfsp.src);
+		prefix_set4(odfsp->dst, _odfsp.dstlen, _odfsp.dst);
+	} else {
+		prefix_set(odfsp->src, _odfsp.srclen, _odfsp.src, bytesize);
+		prefix_set(odfsp->dst, _odfsp.dstlen, _odfsp.dst, bytesize);
+	}
 
 	return (_odfsp);	/* struct return */
 }
@@ -142,11 +391,12 @@ odflowspec_gen(struct odflow_spec *odfsp, int label[], int bytesize)
 /*
  * try to aggregate odflows in the list for the given label.
  * new entries matching for the label are created on the hash.
+ * the cache_lists of the new entries are laid out in sc->indices.
  * returns the number of original flows aggregated.
  */
 static int
 odflow_aggregate(struct odflow_hash *odfh, struct odflow *parent,
-	int label[], struct hhh_params *params)
+	int label[], struct hhh_scratch *sc, struct hhh_params *params)
 {
 	int i, n = 0, listsize;
 	struct odflow *odfp, *_odfp, **fl;
@@ -154,9 +404,11 @@ odflow_aggregate(struct odflow_hash *odfh, struct odflow *parent,
 
 	/* walk through the odflow cache_list of parent */
 	fl = params->flow_list;
-	listsize = cl_size(parent->odf_cache);
+	listsize = cl_size(&parent->odf_cache);
+	if (listsize >= HHH_PARAGGMIN && taskq_nthreads() > 1)
+		return (aggregate_parallel(odfh, parent, label, sc, params));
 	for (i = 0; i < listsize; i++) {
-		int index = cl_get(parent->odf_cache, i);
+		int index = cl_get(&parent->odf_cache, i);
 		if ((_odfp = fl[index]) == NULL)
 			continue;  /* removed subentry */
 		if (!label_check(&(_odfp->s), label))
@@ -171,13 +423,399 @@ odflow_aggregate(struct odflow_hash *odfh, struct odflow *parent,
 		odfp->packet += _odfp->packet;
 		odfp->af = _odfp->af;
 
-		/* save this index in the cache list for sub-attr aggregation */
-		cl_append(odfp->odf_cache, index);
-		n++;
+		/* count the indices to save for sub-attr aggregation */
+		odfp->odf_cache.cl_size++;
+		sc->owners[n++] = odfp;
+	}
+	if (n == 0)
+		return (0);
+
+	odflow_layout(odfh, sc);
+	/* save the indices in the order of the parent's list */
+	n = 0;
+	for (i = 0; i < listsize; i++) {
+		int index = cl_get(&parent->odf_cache, i);
+		if ((_odfp = fl[index]) == NULL ||
+		    !label_check(&(_odfp->s), label))
+			continue;
+		odfp = sc->owners[n++];
+		odfp->odf_cache.cl_data[odfp->odf_cache.cl_size++] = index;
+	}
+	return (n);
+}
+
+/*
+ * give each new odflow in the hash its part of the index buffer.
+ * cl_size of the odflows has the number of indices to save, and
+ * is reset to 0.
+ */
+static void
+odflow_layout(struct odflow_hash *odfh, struct hhh_scratch *sc)
+{
+	struct odflow *odfp;
+	int i, off = 0;
+
+	ODHASH_FOREACH(odfp, odfh, i) {
+		odfp->odf_cache.cl_data = &sc->indices[off];
+		odfp->odf_cache.cl_max = odfp->odf_cache.cl_size;
+		off += odfp->odf_cache.cl_size;
+		odfp->odf_cache.cl_size = 0;
+	}
+}
+
+/*
+ * aggregate a chunk of the parent's list into the partial hash.
+ * a new partial aggregate keeps its number in odf_cache.cl_max,
+ * which is not used until odflow_layout().
+ */
+static void
+aggregate_task(void *arg, int i)
+{
+	struct hhh_partial *pt = (struct hhh_partial *)arg + i;
+	struct odflow *odfp, *_odfp, **fl;
+	struct odflow_spec odfsp;
+	int nrecord;
+
+	fl = pt->params->flow_list;
+	for (i = pt->start; i < pt->end; i++) {
+		int index = cl_get(&pt->parent->odf_cache, i);
+		pt->owners[i] = -1;
+		if ((_odfp = fl[index]) == NULL)
+			continue;  /* removed subentry */
+		if (!label_check(&(_odfp->s), pt->label))
+			continue;  /* doesn't fit the label */
+
+		odfsp = odflowspec_gen(&_odfp->s, pt->label,
+		    pt->params->prefixlen/8);
+		nrecord = pt->hash->nrecord;
+		odfp = odflow_lookup(pt->hash, &odfsp);
+		if (pt->hash->nrecord != nrecord) {
+			odfp->odf_cache.cl_max = pt->ngroups;
+			pt->groups[pt->ngroups++] = odfp;
+		}
+		odfp->byte += _odfp->byte;
+		odfp->packet += _odfp->packet;
+		odfp->af = _odfp->af;
+		odfp->odf_cache.cl_size++;
+		pt->owners[i] = odfp->odf_cache.cl_max;
+		pt->nflows++;
+	}
+}
+
+/*
+ * odflow_aggregate() for a large list, in chunks by tasks.
+ * the partial aggregates are merged chunk by chunk in the order
+ * made, which is the order of their first odflows in the list.
+ * the entries of odfh are created in the same order as in
+ * odflow_aggregate(), and odfh is prepared not to grow, so that
+ * the hash order, and so the result of the search, do not depend
+ * on the number of threads.
+ * when the label tells most of the odflows apart, the merge costs
+ * as much as the aggregation itself.
+ */
+static int
+aggregate_parallel(struct odflow_hash *odfh, struct odflow *parent,
+	int label[], struct hhh_scratch *sc, struct hhh_params *params)
+{
+	struct hhh_partial *parts, *pt;
+	struct taskq_group group;
+	struct odflow *odfp, *_odfp;
+	int i, j, t, ntasks, chunk, listsize, n = 0, *owners;
+
+	listsize = cl_size(&parent->odf_cache);
+	ntasks = taskq_nthreads();
+	chunk = (listsize + ntasks - 1) / ntasks;
+	parts = calloc(ntasks, sizeof(struct hhh_partial));
+	owners = malloc(sizeof(int) * listsize);
+	if (parts == NULL || owners == NULL)
+		err(1, "malloc(hhh_partial) failed!");
+	memset(&group, 0, sizeof(group));
+	for (t = 0; t < ntasks; t++) {
+		pt = &parts[t];
+		pt->parent = parent;
+		pt->label = label;
+		pt->params = params;
+		pt->start = t * chunk;
+		pt->end = min(pt->start + chunk, listsize);
+		pt->pool = odpool_alloc();
+		pt->hash = odhash_alloc(pt->end - pt->start,
+		    params->keytype);
+		if (pt->pool == NULL || pt->hash == NULL)
+			err(1, "odhash_alloc failed!");
+		pt->hash->pool = pt->pool;
+		/* the groups of a chunk fit in its part of sc->owners */
+		pt->groups = &sc->owners[pt->start];
+		pt->owners = owners;
+		taskq_spawn(&group, aggregate_task, parts, t);
 	}
+	taskq_wait(&group);
+
+	/* merge the partial aggregates */
+	for (t = 0; t < ntasks; t++) {
+		pt = &parts[t];
+		for (j = 0; j < pt->ngroups; j++) {
+			_odfp = pt->groups[j];
+			odfp = odflow_lookup(odfh, &_odfp->s);
+			odfp->byte += _odfp->byte;
+			odfp->packet += _odfp->packet;
+			odfp->af = _odfp->af;
+			odfp->odf_cache.cl_size += _odfp->odf_cache.cl_size;
+			pt->groups[j] = odfp;
+		}
+		n += pt->nflows;
+	}
+	if (n > 0) {
+		odflow_layout(odfh, sc);
+		/* save the indices in the order of the parent's list */
+		for (t = 0; t < ntasks; t++) {
+			pt = &parts[t];
+			for (i = pt->start; i < pt->end; i++) {
+				if (owners[i] < 0)
+					continue;
+				odfp = pt->groups[owners[i]];
+				odfp->odf_cache.cl_data[odfp->odf_cache.cl_size++] =
+				    cl_get(&parent->odf_cache, i);
+			}
+		}
+	}
+
+	for (t = 0; t < ntasks; t++) {
+		odhash_free(parts[t].hash);
+		odpool_free(parts[t].pool);
+	}
+	free(owners);
+	free(parts);
 	return (n);
 }
 
+/*
+ * odflow_aggregate() for a parent holding the whole flow_list (the
+ * root, or the [0,0] wildcard), using the memo.
+ * when the memo has a table for a longer label pair, the entries
+ * of the table, and then the odflows not fitting the table, are
+ * aggregated.  the indices are saved in this order, not in the
+ * order of the parent's list.
+ * a table much smaller than the list is kept in the memo for the
+ * later labels.
+ * a memo kept over the runs of a -t list (params->inputs) only takes
+ * the tables of all the inputs, made by memo_complete() when the
+ * memo has none for the label.
+ */
+static int
+memo_aggregate(struct odflow_hash *odfh, struct odflow *parent,
+	int label[], struct hhh_scratch *sc, struct hhh_params *params)
+{
+	struct memo_table *mt;
+	struct memo_ent *me;
+	struct odflow *odfp, *_odfp, **fl;
+	struct odflow_spec odfsp;
+	int i, j, k, idx, n = 0, nflows = 0, nrest = 0, *rest;
+	int listsize = cl_size(&parent->odf_cache);
+
+	fl = params->flow_list;
+	mt = memo_lookup(params->memo, label);
+	if (params->inputs != NULL && fl != params->inputs && (mt == NULL ||
+	    mt->label[0] != label[0] || mt->label[1] != label[1])) {
+		memo_complete(params, label);
+		mt = memo_lookup(params->memo, label);
+	}
+	if (mt == NULL || mt->nents + mt->nrest >= listsize) {
+		/* no use of the memo, aggregate the original odflows */
+		nflows = odflow_aggregate(odfh, parent, label, sc, params);
+		if (params->inputs == NULL ? (nflows == 0 ||
+		    odfh->nrecord * 2 > listsize) : fl != params->inputs)
+			return (nflows);
+		/* keep the odflows not fitting the label for the memo */
+		if ((rest = malloc(sizeof(int) * (listsize - nflows))) == NULL)
+			err(1, "malloc(memo rest) failed!");
+		for (i = 0; i < listsize; i++) {
+			idx = cl_get(&parent->odf_cache, i);
+			if (fl[idx] != NULL && !label_check(&fl[idx]->s, label))
+				rest[nrest++] = idx;
+		}
+		memo_save(params->memo, label, odfh, rest, nrest);
+		return (nflows);
+	}
+
+	/* count the remaining odflows of the memo entries */
+	if ((rest = malloc(sizeof(int) * (mt->nrest + 1))) == NULL)
+		err(1, "malloc(memo rest) failed!");
+	for (i = 0; i < mt->nents; i++) {
+		me = &mt->ents[i];
+		odfp = NULL;
+		for (j = 0; j < me->size; j++) {
+			if ((_odfp = fl[mt->indices[me->start + j]]) == NULL)
+				continue;  /* removed subentry */
+			if (odfp == NULL) {
+				odfsp = odflowspec_gen(&me->s, label,
+				    params->prefixlen/8);
+				odfp = odflow_lookup(odfh, &odfsp);
+				odfp->af = _odfp->af;
+				sc->owners[n++] = odfp;
+			}
+			odfp->byte += _odfp->byte;
+			odfp->packet += _odfp->packet;
+			odfp->odf_cache.cl_size++;
+			nflows++;
+		}
+	}
+	/* and the odflows not fitting the memo table */
+	for (i = 0; i < mt->nrest; i++) {
+		idx = mt->rest[i];
+		if ((_odfp = fl[idx]) == NULL)
+			continue;  /* removed subentry */
+		if (!label_check(&_odfp->s, label)) {
+			rest[nrest++] = idx;
+			continue;  /* doesn't fit the label */
+		}
+		odfsp = odflowspec_gen(&_odfp->s, label, params->prefixlen/8);
+		odfp = odflow_lookup(odfh, &odfsp);
+		odfp->byte += _odfp->byte;
+		odfp->packet += _odfp->packet;
+		odfp->af = _odfp->af;
+		odfp->odf_cache.cl_size++;
+		sc->owners[n++] = odfp;
+		nflows++;
+	}
+	if (nflows == 0 && fl != params->inputs) {
+		free(rest);
+		return (0);
+	}
+
+	odflow_layout(odfh, sc);
+	/* save the indices in the same order */
+	k = 0;
+	for (i = 0; i < mt->nents; i++) {
+		me = &mt->ents[i];
+		odfp = NULL;
+		for (j = 0; j < me->size; j++) {
+			idx = mt->indices[me->start + j];
+			if (fl[idx] == NULL)
+				continue;
+			if (odfp == NULL)
+				odfp = sc->owners[k++];
+			odfp->odf_cache.cl_data[odfp->odf_cache.cl_size++] = idx;
+		}
+	}
+	for (i = 0; i < mt->nrest; i++) {
+		idx = mt->rest[i];
+		if (fl[idx] == NULL || !label_check(&fl[idx]->s, label))
+			continue;
+		odfp = sc->owners[k++];
+		odfp->odf_cache.cl_data[odfp->odf_cache.cl_size++] = idx;
+	}
+
+	if (params->inputs == NULL ? (odfh->nrecord + nrest) * 2 <= listsize :
+	    fl == params->inputs)
+		memo_save(params->memo, label, odfh, rest, nrest);
+	else
+		free(rest);
+	return (nflows);
+}
+
+/*
+ * make a memo table of all the inputs for the label, including the
+ * ones already extracted in this run, so that the runs for the other
+ * thresholds can use it.
+ */
+static void
+memo_complete(struct hhh_params *params, int label[])
+{
+	struct hhh_params all;
+	struct hhh_scratch *sc;
+	int n;
+
+	all = *params;
+	all.flow_list = params->inputs;	/* none removed */
+	n = cl_size(&params->root->odf_cache);
+	sc = scratch_push(n);
+	if (label[0] + label[1] < 30 && n > (1 << (label[0] + label[1])))
+		n = 1 << (label[0] + label[1]);
+	odhash_prepare(sc->hash, n, params->keytype);
+	(void)memo_aggregate(sc->hash, params->root, label, sc, &all);
+	scratch_pop(sc);
+}
+
+/*
+ * find the smallest memo table for a label pair not shorter than
+ * the given label in both fields.  a tie goes to the table for the
+ * label itself.
+ */
+static struct memo_table *
+memo_lookup(struct hhh_memo *memo, int label[])
+{
+	struct memo_table *mt, *best = NULL;
+	int i;
+
+	for (i = 0; i < memo->ntables; i++) {
+		mt = &memo->tables[i];
+		if (mt->label[0] < label[0] || mt->label[1] < label[1])
+			continue;
+		if (best == NULL ||
+		    mt->nents + mt->nrest < best->nents + best->nrest ||
+		    (mt->nents + mt->nrest == best->nents + best->nrest &&
+		    mt->label[0] == label[0] && mt->label[1] == label[1]))
+			best = mt;
+	}
+	return (best);
+}
+
+/*
+ * keep the aggregated odflows in the hash as a memo table.
+ * rest is taken by the table.
+ */
+static void
+memo_save(struct hhh_memo *memo, int label[], struct odflow_hash *odfh,
+	int *rest, int nrest)
+{
+	struct memo_table *mt;
+	struct memo_ent *me;
+	struct odflow *odfp;
+	int i, j, n = 0, off = 0;
+
+	if (memo->ntables == memo->maxtables) {
+		memo->maxtables += 8;
+		memo->tables = realloc(memo->tables,
+		    sizeof(struct memo_table) * memo->maxtables);
+		if (memo->tables == NULL)
+			err(1, "realloc(memo) failed!");
+	}
+	mt = &memo->tables[memo->ntables++];
+	mt->label[0] = label[0];
+	mt->label[1] = label[1];
+	mt->nents = odfh->nrecord;
+	ODHASH_FOREACH(odfp, odfh, i)
+		off += cl_size(&odfp->odf_cache);
+	mt->ents = malloc(sizeof(struct memo_ent) * mt->nents);
+	mt->indices = malloc(sizeof(int) * off);
+	if (mt->ents == NULL || mt->indices == NULL)
+		err(1, "malloc(memo_table) failed!");
+	off = 0;
+	ODHASH_FOREACH(odfp, odfh, i) {
+		me = &mt->ents[n++];
+		me->s = odfp->s;
+		me->start = off;
+		me->size = cl_size(&odfp->odf_cache);
+		for (j = 0; j < me->size; j++)
+			mt->indices[off++] = cl_get(&odfp->odf_cache, j);
+	}
+	mt->rest = rest;
+	mt->nrest = nrest;
+}
+
+static void
+memo_free(struct hhh_memo *memo)
+{
+	int i;
+
+	for (i = 0; i < memo->ntables; i++) {
+		free(memo->tables[i].ents);
+		free(memo->tables[i].indices);
+		free(memo->tables[i].rest);
+	}
+	free(memo->tables);
+}
+
 /*
  * extract odflows from odflow_hash to tailq.
  * returns the number of flows extracted.
@@ -187,54 +825,170 @@ odflow_extract(struct odflow_hash *odfh,
 	struct odflow *parent, struct hhh_params *params)
 {
 	int i, j, size, nflows = 0;
-	struct odflow *odfp, **fl;
+	struct odflow *odfp, *_odfp, **fl;
 
 	/* walk through the odflow_hash */
 	fl = params->flow_list;
-	for (i = 0; i < odfh->nbuckets; i++) {
-                while ((odfp = TAILQ_FIRST(&odfh->tbl[i].odfq_head)) != NULL) {
-                        TAILQ_REMOVE(&odfh->tbl[i].odfq_head, odfp, odf_chain);
-			odfh->tbl[i].nrecord--;
-			if (!thresh_check(odfp, params->thresh, params->thresh2)) {
-				/* under the threshold, discard this entry */
-				odflow_free(odfp);
-				continue;
-			}
+	ODHASH_FOREACH(odfp, odfh, i) {
+		if (!thresh_check(odfp, params->thresh, params->thresh2)) {
+			/* under the threshold, left to the scratch pool */
+			continue;
+		}
 #if 1	/* for debug */
-			if (verbose) {
-				printf("# extract: ");
-				odflow_print(odfp);
-				printf(" packet:%" PRIu64 "\n", odfp->packet);
-			}
+		if (verbose) {
+			printf("# extract: ");
+			odflow_print(odfp);
+			printf(" packet:%" PRIu64 "\n", odfp->packet);
+		}
 #endif
 
-			/* book keeping extracted packets/bytes */
-			parent->packet -= odfp->packet;
-			parent->byte   -= odfp->byte;
+		/* book keeping extracted packets/bytes */
+		parent->packet -= odfp->packet;
+		parent->byte   -= odfp->byte;
 
-			/* add this entry to the tail of the queue */
-			TAILQ_INSERT_TAIL(&params->odfqp->odfq_head, odfp, odf_chain);
-			params->odfqp->nrecord++;
-			nflows++;
-				
-			/* remove prcoessed odflows from the list */
-			size = cl_size(odfp->odf_cache);
-			for (j = 0; j < size; j++) {
-				int idx = cl_get(odfp->odf_cache, j);
-				if (fl[idx] != NULL) {
-					if (fl[idx]->odf_odpq.nrecord > 0)
-						/* move the sub-odflows (for main attribute) */
-						odfq_moveall(&fl[idx]->odf_odpq, &odfp->odf_odpq);
-					odflow_free(fl[idx]);
-					fl[idx] = NULL;
-				}
-			}
-			cl_clear(odfp->odf_cache);
-		} /* while */
-	} /* for */
+		/* the scratch entry is reused, add a copy to the queue */
+		_odfp = odflow_alloc(&odfp->s, NULL);
+		_odfp->af = odfp->af;
+		_odfp->byte = odfp->byte;
+		_odfp->packet = odfp->packet;
+		TAILQ_INSERT_TAIL(&params->odfqp->odfq_head, _odfp, odf_chain);
+		params->odfqp->nrecord++;
+		nflows++;
+			
+		/* remove prcoessed odflows from the list */
+		size = cl_size(&odfp->odf_cache);
+		for (j = 0; j < size; j++) {
+			int idx = cl_get(&odfp->odf_cache, j);
+			if (fl[idx] != NULL)
+				odflow_remove(params, idx, _odfp);
+		}
+	}
+	odhash_clear(odfh);
 	return (nflows);
 }
 
+/*
+ * remove an original odflow extracted as odfp from the flow_list.
+ * the sub-odflows (for main attribute) are moved to odfp.  when the
+ * original odflows are left as they are, odfp gets a proxy keeping
+ * the index instead (see struct hhh_input).
+ */
+static void
+odflow_remove(struct hhh_params *params, int idx, struct odflow *odfp)
+{
+	struct odflow *_odfp = params->flow_list[idx], *proxy;
+
+	if (_odfp->odf_odpq.nrecord > 0) {
+		if (!params->keep)
+			odfq_moveall(&_odfp->odf_odpq, &odfp->odf_odpq);
+		else {
+			proxy = TAILQ_FIRST(&odfp->odf_odpq.odfq_head);
+			if (proxy == NULL) {
+				proxy = odflow_alloc(&odfp->s, NULL);
+				TAILQ_INSERT_TAIL(&odfp->odf_odpq.odfq_head,
+				    proxy, odf_chain);
+				odfp->odf_odpq.nrecord++;
+			}
+			cl_append(&proxy->odf_cache, idx);
+		}
+	}
+	if (!params->keep)
+		odflow_free(_odfp);
+	params->flow_list[idx] = NULL;
+}
+
+/* the n (<= 8) bits of the address after the first len bits */
+inline static int
+bound_bits(uint8_t *addr, int len, int n)
+{
+	int i = len >> 3;
+	uint32_t v;
+
+	v = addr[i] << 8;
+	if (i + 1 < MAXLEN)
+		v |= addr[i + 1];
+	return ((v >> (16 - (len & 7) - n)) & ((1 << n) - 1));
+}
+
+/*
+ * make the bounds for the sub-areas of an aggregated odflow.
+ * its original odflows are counted by the next HHH_BOUNDBITS bits of
+ * the source and of the destination, and the largest parts for each
+ * number of the bits are kept.
+ */
+static void
+bound_make(struct hhh_bound *hb, struct odflow *odfp,
+	struct hhh_params *params)
+{
+	uint64_t byte[2][1 << HHH_BOUNDBITS], packet[2][1 << HHH_BOUNDBITS];
+	struct odflow *_odfp;
+	int i, j, d, f, n, size, bits;
+
+	memset(byte, 0, sizeof(byte));
+	memset(packet, 0, sizeof(packet));
+	memset(hb, 0, sizeof(*hb));
+	hb->len[0] = odfp->s.srclen;
+	hb->len[1] = odfp->s.dstlen;
+	for (f = 0; f < 2; f++)
+		hb->nbits[f] = min(HHH_BOUNDBITS,
+		    params->prefixlen - hb->len[f]);
+
+	size = cl_size(&odfp->odf_cache);
+	for (i = 0; i < size; i++) {
+		_odfp = params->flow_list[cl_get(&odfp->odf_cache, i)];
+		if (_odfp == NULL)
+			continue;  /* removed subentry */
+		for (f = 0; f < 2; f++) {
+			bits = 0;
+			if (hb->nbits[f] > 0)
+				bits = bound_bits(f == 0 ?
+				    _odfp->s.src : _odfp->s.dst,
+				    hb->len[f], hb->nbits[f]);
+			byte[f][bits] += _odfp->byte;
+			packet[f][bits] += _odfp->packet;
+		}
+	}
+
+	for (f = 0; f < 2; f++) {
+		n = 1 << hb->nbits[f];
+		for (d = hb->nbits[f]; d >= 0; d--) {
+			for (j = 0; j < n; j++) {
+				hb->byte[f][d] = max(hb->byte[f][d], byte[f][j]);
+				hb->packet[f][d] = max(hb->packet[f][d],
+				    packet[f][j]);
+			}
+			/* merge the pairs for one bit less */
+			for (j = 0; j < n / 2; j++) {
+				byte[f][j] = byte[f][2 * j] +
+				    byte[f][2 * j + 1];
+				packet[f][j] = packet[f][2 * j] +
+				    packet[f][2 * j + 1];
+			}
+			n /= 2;
+		}
+	}
+}
+
+/*
+ * check if an aggregate for the label pair under the odflow of the
+ * bounds can be above the threshold.
+ */
+inline static int
+bound_check(struct hhh_bound *hb, int pl0, int pl1,
+	struct hhh_params *params)
+{
+	struct odflow agg;
+	int d0, d1;
+
+	d0 = min(pl0 - hb->len[0], hb->nbits[0]);
+	d1 = min(pl1 - hb->len[1], hb->nbits[1]);
+	agg.s.srclen = pl0;
+	agg.s.dstlen = pl1;
+	agg.byte = min(hb->byte[0][d0], hb->byte[1][d1]);
+	agg.packet = min(hb->packet[0][d0], hb->packet[1][d1]);
+	return (thresh_check(&agg, params->thresh, params->thresh2));
+}
+
 /*
  * recursive lattice search algorithm for fiding HHH.
  * aggregate flows in the parent cache_list by the given label [pl0,pl1].
@@ -264,9 +1018,13 @@ lattice_search(struct odflow *parent, int pl0, int pl1, int size, int pos,
 {
 	int nflows = 0;	/* how many odflows extracted */
 	struct odflow_hash *my_hash = NULL;
+	struct hhh_scratch *sc = NULL;
 	int on_edge = 0;
 	int do_aggregate = 1, do_recurse = 1;
 
+	if (hhh_expired())
+		return 0;  /* the results are thrown away */
+
 	/* check if this is on the bottom edge */
 	if (pl0 == params->maxsize)
 		on_edge = ON_LEFTEDGE;
@@ -317,12 +1075,23 @@ lattice_search(struct odflow *parent, int pl0, int pl1, int size, int pos,
 		int n, label[2] = {pl0, pl1};
 
 		/* create new odflows in the hash by the given label pair */
-		n = cl_size(parent->odf_cache) / 8;  /* estimate hash size */
-		my_hash = odhash_alloc(n);
-		n = odflow_aggregate(my_hash, parent, label, params);
-		if (n == 0) {
-			/* no aggregate flow was created */
-			odhash_free(my_hash);
+		params->nodes++;
+		n = cl_size(&parent->odf_cache);
+		sc = scratch_push(n);
+		my_hash = sc->hash;
+		/* no more entries than the label can tell apart */
+		if (pl0 + pl1 < 30 && n > (1 << (pl0 + pl1)))
+			n = 1 << (pl0 + pl1);
+		odhash_prepare(my_hash, n, params->keytype);
+		if (params->memo != NULL &&
+		    parent->s.srclen == 0 && parent->s.dstlen == 0)
+			/* the whole flow_list, see the memo */
+			n = memo_aggregate(my_hash, parent, label, sc, params);
+		else
+			n = odflow_aggregate(my_hash, parent, label, sc, params);
+		if (n == 0 || hhh_expired()) {
+			/* no aggregate flow was created, or thrown away */
+			scratch_pop(sc);
 			return 0;
 		}
 	} else {
@@ -335,7 +1104,9 @@ lattice_search(struct odflow *parent, int pl0, int pl1, int size, int pos,
 	 * note: for the bottom edge, only lower and upper are used
 	 */
 	if (do_recurse) {
+		struct odflow *odfp;
 		int i, delta, subsize;
+		uint64_t dpacket, dbyte;
 
 		if (size == params->minsize) { 	/* minimum aggregation unit */
 			delta = size; subsize = 0;
@@ -347,64 +1118,26 @@ lattice_search(struct odflow *parent, int pl0, int pl1, int size, int pos,
 			delta = size; subsize = 0;
 		}
 #endif
-		for (i = 0; i < my_hash->nbuckets; i++) {
-			struct odflow *odfp;
-
-			TAILQ_FOREACH(odfp, &(my_hash->tbl[i].odfq_head), odf_chain) {
-				/* recursively visit sub-areas */
-				int n, subpos, subpl0, subpl1;
-				uint64_t packet, byte;
-
+		if (do_aggregate && taskq_nthreads() > 1 &&
+		    cl_size(&parent->odf_cache) >= HHH_TASKMIN) {
+			/* search the siblings in parallel */
+			nflows += lattice_fork(parent, my_hash, pl0, pl1,
+			    delta, subsize, on_edge, params);
+		} else {
+			ODHASH_FOREACH(odfp, my_hash, i) {
 				if (!do_aggregate) /* dummy iteration */
 					odfp = parent; /* use parent's */
-				for (subpos = 0; subpos < 4; subpos++) {
-					if (on_edge &&
-					    (subpos == POS_LEFT || subpos == POS_RIGHT))
-						/* if on edge, skip left/right */
-						continue;
-					if (thresh_check(odfp, params->thresh, params->thresh2) == 0)
-						break; /* residual < thresh */
-					/* adjust prefixlen pair for sub-area */
-					subpl0 = pl0; subpl1 = pl1;
-					switch (subpos) {
-					case POS_LOWER:
-						if (on_edge) {
-							if (on_edge == ON_LEFTEDGE)
-								subpl1 += delta;
-							else
-								subpl0 += delta;
-						} else {
-							subpl0 += delta; subpl1 += delta;
-						}
-						break;
-					case POS_LEFT:
-						subpl0 += delta; break;
-					case POS_RIGHT:
-						subpl1 += delta; break;
-					}
-
-					if (!disable_heuristics) {
-						int subpl_min = min(subpl0, subpl1);
-						if (subpl_min < params->cutoff &&
-							(subpl_min & (params->cutoffres - 1)) != 0)
-							continue;  /* skip this area */
-					}
-
-					/* visit this sub-area */
-					packet = odfp->packet;
-					byte   = odfp->byte;
-					n = lattice_search(odfp, subpl0, subpl1, subsize, subpos, params);
-					nflows += n;
-					if (n > 0 && do_aggregate) {
-						/* propagate extracted pkts/bytes to parent */
-						parent->packet -= packet - odfp->packet;
-						parent->byte -= byte - odfp->byte;
-					}
+				nflows += lattice_visit(odfp, pl0, pl1, delta,
+				    subsize, on_edge, params, &dpacket, &dbyte);
+				if (do_aggregate) {
+					/* propagate extracted pkts/bytes to parent */
+					parent->packet -= dpacket;
+					parent->byte -= dbyte;
 				}
 				if (!do_aggregate) /* XXX for dummy_hash */
-					break; /* out of TAILQ_FOREACH */
+					break; /* out of ODHASH_FOREACH */
 			}
-		} /* for */
+		}
 	} /* do_recurse */
 	/*
 	 * walk through the hash again, and extract remaining odflows
@@ -414,48 +1147,828 @@ lattice_search(struct odflow *parent, int pl0, int pl1, int size, int pos,
 	if (do_aggregate) {
 		if (thresh_check(parent, params->thresh, params->thresh2))
 			nflows += odflow_extract(my_hash, parent, params);
-		odhash_free(my_hash);
+		scratch_pop(sc);
 	}
 
 	return nflows;
 }
 
-static int
-find_hhh(struct odflow_hash *hash, int bitlen, uint64_t thresh, uint64_t thresh2,
-	struct response *resp, struct odf_tailq *odfqp)
+/*
+ * take a scratch space for a list of n original odflows from the
+ * stack of this thread.
+ */
+static struct hhh_scratch *
+scratch_push(int n)
 {
-	struct odflow *root, *odfp, *next;
-	struct odflow_spec spec;
-	struct hhh_params params;
-	int i, n, nrecord, nflows = 0;
+	struct hhh_scratch *sc;
 
-	/* sanity check */
-	if (hash != NULL) { /* for main attribute */
-		if (hash->nrecord == 0)
-			return (0);
-	} else { /* for sub-attribute */
-		if (TAILQ_EMPTY(&odfqp->odfq_head))
-			return (0);
+	if (scratch_top == scratch_max) {
+		scratch_max += 16;
+		scratch_stack = realloc(scratch_stack,
+		    sizeof(struct hhh_scratch *) * scratch_max);
+		if (scratch_stack == NULL)
+			err(1, "realloc(scratch_stack) failed!");
+		memset(&scratch_stack[scratch_top], 0,
+		    sizeof(struct hhh_scratch *) * 16);
 	}
+	if ((sc = scratch_stack[scratch_top]) == NULL) {
+		if ((sc = calloc(1, sizeof(struct hhh_scratch))) == NULL)
+			err(1, "calloc(hhh_scratch) failed!");
+		__atomic_add_fetch(&scratch_allocs, 1, __ATOMIC_RELAXED);
+		sc->pool = odpool_alloc();
+		sc->hash = odhash_alloc(1, ODKEY_SPEC);
+		sc->hash->pool = sc->pool;
+		scratch_stack[scratch_top] = sc;
+	}
+	scratch_top++;
+	if (n > sc->size) {
+		free(sc->indices);
+		free(sc->owners);
+		sc->indices = malloc(sizeof(uint64_t) * n);
+		sc->owners = malloc(sizeof(struct odflow *) * n);
+		if (sc->indices == NULL || sc->owners == NULL)
+			err(1, "malloc(hhh_scratch) failed!");
+		sc->size = n;
+		__atomic_add_fetch(&scratch_allocs, 1, __ATOMIC_RELAXED);
+	}
+	return (sc);
+}
 
-	/* create a dummy top node */
-	memset(&spec, 0, sizeof(spec));
-	root = odflow_alloc(&spec);
+/* empty the scratch space and return it to the stack */
+static void
+scratch_pop(struct hhh_scratch *sc)
+{
+	assert(scratch_top > 0 && scratch_stack[scratch_top - 1] == sc);
+	odhash_reset(sc->hash);
+	odpool_reset(sc->pool);
+	scratch_top--;
+}
 
-	/* allocate flow buffer to store all the flow entries */
-	params.thresh  = thresh;
-	params.thresh2 = thresh2;
-	params.minsize = 1;
-	params.maxsize = bitlen;
-	params.prefixlen = bitlen;
-	params.cutoff = 0;	/* no cutoff */
-	params.cutoffres = 1;
-	params.resp = resp;
+/*
+ * visit the 4 sub-areas of an aggregated odflow.
+ * the pkts/bytes extracted from odfp are returned in dpacket/dbyte.
+ */
+static int
+lattice_visit(struct odflow *odfp, int pl0, int pl1, int delta, int subsize,
+	int on_edge, struct hhh_params *params,
+	uint64_t *dpacket, uint64_t *dbyte)
+{
+	int n, nflows = 0, subpos, subpl0, subpl1, bounded;
+	uint64_t packet, byte;
+	struct hhh_bound hb;
+
+	*dpacket = *dbyte = 0;
+	/*
+	 * look ahead the sub-areas of a large odflow.  an odflow larger
+	 * than the threshold times the parts has a part above the
+	 * threshold, and no sub-area to skip.
+	 */
+	bounded = 0;
+	if (cl_size(&odfp->odf_cache) >= HHH_BOUNDMIN) {
+		struct odflow part;
+
+		part.s.srclen = part.s.dstlen = 1;
+		part.byte = odfp->byte >> HHH_BOUNDBITS;
+		part.packet = odfp->packet >> HHH_BOUNDBITS;
+		if (!thresh_check(&part, params->thresh, params->thresh2)) {
+			bound_make(&hb, odfp, params);
+			bounded = 1;
+		}
+	}
+	for (subpos = 0; subpos < 4; subpos++) {
+		if (on_edge &&
+		    (subpos == POS_LEFT || subpos == POS_RIGHT))
+			/* if on edge, skip left/right */
+			continue;
+		if (thresh_check(odfp, params->thresh, params->thresh2) == 0)
+			break; /* residual < thresh */
+		/* adjust prefixlen pair for sub-area */
+		subpl0 = pl0; subpl1 = pl1;
+		switch (subpos) {
+		case POS_LOWER:
+			if (on_edge) {
+				if (on_edge == ON_LEFTEDGE)
+					subpl1 += delta;
+				else
+					subpl0 += delta;
+			} else {
+				subpl0 += delta; subpl1 += delta;
+			}
+			break;
+		case POS_LEFT:
+			subpl0 += delta; break;
+		case POS_RIGHT:
+			subpl1 += delta; break;
+		}
+
+		if (!disable_heuristics) {
+			int subpl_min = min(subpl0, subpl1);
+			if (subpl_min < params->cutoff &&
+				(subpl_min & (params->cutoffres - 1)) != 0)
+				continue;  /* skip this area */
+		}
+
+		/* skip the sub-area with no aggregate above the threshold */
+		if (bounded && subpos != POS_UPPER &&
+		    !bound_check(&hb, subpl0, subpl1, params)) {
+			params->pruned++;
+			continue;
+		}
+
+		/* visit this sub-area */
+		packet = odfp->packet;
+		byte   = odfp->byte;
+		n = lattice_search(odfp, subpl0, subpl1, subsize, subpos, params);
+		nflows += n;
+		if (n > 0) {
+			*dpacket += packet - odfp->packet;
+			*dbyte += byte - odfp->byte;
+		}
+	}
+	return nflows;
+}
+
+static void
+lattice_task(void *arg, int i)
+{
+	struct lattice_task *task = (struct lattice_task *)arg + i;
+
+	task->nflows = lattice_visit(task->odfp, task->pl0, task->pl1,
+	    task->delta, task->subsize, task->on_edge, &task->params,
+	    &task->dpacket, &task->dbyte);
+}
+
+/*
+ * visit the siblings in my_hash as tasks, and merge the results
+ * in the same order as ODHASH_FOREACH in lattice_search().
+ * small siblings are visited by this thread while the tasks run.
+ */
+static int
+lattice_fork(struct odflow *parent, struct odflow_hash *my_hash,
+	int pl0, int pl1, int delta, int subsize, int on_edge,
+	struct hhh_params *params)
+{
+	struct lattice_task *tasks, *task;
+	struct taskq_group group;
+	struct odflow *odfp;
+	int i, n = 0, nflows = 0;
+
+	tasks = calloc(my_hash->nrecord, sizeof(struct lattice_task));
+	if (tasks == NULL)
+		err(1, "calloc(lattice_task) failed!");
+	memset(&group, 0, sizeof(group));
+	ODHASH_FOREACH(odfp, my_hash, i) {
+		task = &tasks[n];
+		task->odfp = odfp;
+		task->pl0 = pl0;
+		task->pl1 = pl1;
+		task->delta = delta;
+		task->subsize = subsize;
+		task->on_edge = on_edge;
+		task->params = *params;
+		task->params.odfqp = &task->odfq;
+		task->params.nodes = 0;
+		task->params.pruned = 0;
+		TAILQ_INIT(&task->odfq.odfq_head);
+		if (cl_size(&odfp->odf_cache) >= HHH_TASKMIN)
+			taskq_spawn(&group, lattice_task, tasks, n);
+		else
+			lattice_task(tasks, n);
+		n++;
+	}
+	taskq_wait(&group);
+
+	for (i = 0; i < n; i++) {
+		task = &tasks[i];
+		/* propagate extracted pkts/bytes to parent */
+		parent->packet -= task->dpacket;
+		parent->byte -= task->dbyte;
+		nflows += task->nflows;
+		params->nodes += task->params.nodes;
+		params->pruned += task->params.pruned;
+		odfq_moveall(&task->odfq, params->odfqp);
+	}
+	free(tasks);
+	return nflows;
+}
+
+/*
+ * sort-based bottom-up search (-e sort), an alternative to
+ * lattice_search().
+ * the original odflows are sorted by their keys: the first field
+ * (src or dst) masked to a prefix length flen, followed by the other
+ * field.  in this order, the odflows aggregated by a label pair
+ * [flen, len] are consecutive for any len, so the aggregates of a
+ * label are found by a linear scan, without a hash.  a new sort is
+ * needed only when flen changes.
+ *
+ * the labels are the ones lattice_search() visits with the same
+ * heuristics, in the same order down to SRT_DEPTH levels of the
+ * sub-areas: the left and the right bottom edges (32 for IPv4, 128
+ * and then 64 for IPv6), and then the sub-areas.  an aggregate above
+ * the threshold is extracted, and its original odflows are removed
+ * from the following labels.
+ *
+ * before the search, the longest src prefix and the longest dst
+ * prefix above the threshold are found for each odflow.  the counts
+ * only decrease, so the odflow cannot be extracted by a longer label,
+ * and it is left out of the sorts for the longer labels.
+ */
+#define SRT_MAXWORDS	4	/* key words: two IPv6 addresses */
+#define SRT_DEPTH	3	/* levels of the sub-areas to follow */
+
+/*
+ * a sort record has the key words, and then 3 words: the index in
+ * flow_list with srclen and dstlen, byte and packet.
+ */
+#define SRT_META(st, r)		((r)[(st)->nwords])
+#define SRT_BYTE(st, r)		((r)[(st)->nwords + 1])
+#define SRT_PACKET(st, r)	((r)[(st)->nwords + 2])
+#define SRT_INDEX(m)		((int)((m) & 0xffffffff))
+#define SRT_SRCLEN(m)		((int)(((m) >> 32) & 0xff))
+#define SRT_DSTLEN(m)		((int)(((m) >> 40) & 0xff))
+
+struct srt_state {
+	struct hhh_params *params;
+	uint64_t *keys[2];	/* full keys of each odflow, src or dst first */
+	uint8_t	*fmax[2];	/* longest src or dst prefix above the
+				   threshold of each odflow */
+	int	*list[2];	/* odflows in the descending order of fmax */
+	int	sorted[3];	/* dstfirst, flen and minlen of the last sort */
+	uint64_t *rec;		/* sort records */
+	uint64_t *tmp;		/* the other buffer for the radix sort */
+	uint64_t *act;		/* records of the runs above the threshold */
+	int	n;		/* records in rec */
+	int	nlist;		/* odflows in flow_list */
+	int	nwords;		/* key words in a record */
+	int	stride;		/* words of a record */
+	int	bytesize;	/* bytes of an address */
+	int	wildcard;	/* the wildcard has been extracted */
+};
+
+/* pack the big endian bytes of the key into words */
+static void
+srt_pack(struct srt_state *st, uint8_t *buf, uint64_t *key)
+{
+	int i, j;
+
+	for (i = 0; i < st->nwords; i++) {
+		key[i] = 0;
+		for (j = 0; j < 8; j++)
+			key[i] = key[i] << 8 | buf[i * 8 + j];
+	}
+}
+
+/* make the full key of odfsp: the first field, and then the second */
+static void
+srt_mkkey(struct srt_state *st, struct odflow_spec *odfsp, int dstfirst,
+	uint64_t *key)
+{
+	uint8_t *f0, *f1;
+	int i, bytesize = st->bytesize;
+
+	f0 = dstfirst ? odfsp->dst : odfsp->src;
+	f1 = dstfirst ? odfsp->src : odfsp->dst;
+	memset(key, 0, sizeof(uint64_t) * st->nwords);
+	for (i = 0; i < bytesize * 2; i++)
+		key[i / 8] |= (uint64_t)(i < bytesize ? f0[i] : f1[i - bytesize])
+		    << (56 - (i % 8) * 8);
+}
+
+/* make the mask of the keys for the label [flen, len] */
+static void
+srt_mkmask(struct srt_state *st, int flen, int len, uint64_t *mask)
+{
+	uint8_t ones[MAXLEN], buf[SRT_MAXWORDS * 8];
+	int bytesize = st->bytesize;
+
+	memset(ones, 0xff, sizeof(ones));
+	memset(buf, 0, sizeof(buf));
+	prefix_set(ones, flen, buf, bytesize);
+	prefix_set(ones, len, buf + bytesize, bytesize);
+	srt_pack(st, buf, mask);
+}
+
+inline static int
+srt_same(uint64_t *r0, uint64_t *r1, uint64_t *mask, int nwords)
+{
+	int i;
+
+	for (i = 0; i < nwords; i++)
+		if ((r0[i] & mask[i]) != (r1[i] & mask[i]))
+			return (0);
+	return (1);
+}
+
+/* check if the record fits into the label pair, as label_check() */
+inline static int
+srt_fits(uint64_t meta, int label[])
+{
+	if (SRT_SRCLEN(meta) < label[0] || SRT_DSTLEN(meta) < label[1])
+		return (0);
+	return (1);
+}
+
+/* add a record of odflow idx, with the key masked */
+inline static void
+srt_add(struct srt_state *st, int dstfirst, int idx, uint64_t *mask)
+{
+	struct odflow *odfp = st->params->flow_list[idx];
+	uint64_t *key, *r;
+	int w;
+
+	r = &st->rec[st->n++ * st->stride];
+	key = &st->keys[dstfirst][idx * st->nwords];
+	for (w = 0; w < st->nwords; w++)
+		r[w] = key[w] & mask[w];
+	SRT_META(st, r) = (uint64_t)idx | (uint64_t)odfp->s.srclen << 32 |
+	    (uint64_t)odfp->s.dstlen << 40;
+	SRT_BYTE(st, r) = odfp->byte;
+	SRT_PACKET(st, r) = odfp->packet;
+}
+
+/* LSD radix sort of the records by bytes; a byte equal in all is skipped */
+static void
+srt_radix(struct srt_state *st)
+{
+	uint64_t *src, *dst, *r;
+	int count[256];
+	int i, b, w, shift, sum, c, n = st->n, stride = st->stride;
+
+	if (n == 0)
+		return;
+	src = st->rec;
+	dst = st->tmp;
+	for (w = st->nwords - 1; w >= 0; w--) {
+		for (shift = 0; shift < 64; shift += 8) {
+			memset(count, 0, sizeof(count));
+			for (i = 0; i < n; i++)
+				count[(src[i * stride + w] >> shift) & 0xff]++;
+			if (count[(src[w] >> shift) & 0xff] == n)
+				continue;  /* all the same */
+			sum = 0;
+			for (b = 0; b < 256; b++) {
+				c = count[b];
+				count[b] = sum;
+				sum += c;
+			}
+			for (i = 0; i < n; i++) {
+				b = (src[i * stride + w] >> shift) & 0xff;
+				memcpy(&dst[count[b]++ * stride], &src[i * stride],
+				    sizeof(uint64_t) * stride);
+			}
+			r = src; src = dst; dst = r;
+		}
+	}
+	st->rec = src;
+	st->tmp = dst;
+}
+
+/*
+ * sort the remaining odflows which can be extracted by [flen, len]
+ * for a len >= minlen, by the keys with the first field masked to flen.
+ * the last sort is kept if it has all of them, as the removed odflows
+ * are skipped by srt_scan().
+ */
+static void
+srt_sort(struct srt_state *st, int dstfirst, int flen, int minlen)
+{
+	struct odflow **fl = st->params->flow_list;
+	uint8_t *fmax = st->fmax[dstfirst], *smax = st->fmax[!dstfirst];
+	uint64_t mask[SRT_MAXWORDS];
+	int i, idx;
+
+	if (st->sorted[0] == dstfirst && st->sorted[1] == flen &&
+	    st->sorted[2] <= minlen)
+		return;
+	st->sorted[0] = dstfirst;
+	st->sorted[1] = flen;
+	st->sorted[2] = minlen;
+
+	srt_mkmask(st, flen, st->bytesize * 8, mask);
+	st->n = 0;
+	for (i = 0; i < st->nlist; i++) {
+		idx = st->list[dstfirst][i];
+		if (fmax[idx] < flen)
+			break;  /* the rest are under the threshold */
+		if (fl[idx] == NULL || smax[idx] < minlen)
+			continue;
+		srt_add(st, dstfirst, idx, mask);
+	}
+	srt_radix(st);
+}
+
+/*
+ * scan the sorted records for the label pairs [flen, lens[k]]
+ * ([lens[k], flen] with dstfirst), and extract the aggregates above
+ * the threshold.  lens are in the descending order.
+ * the runs of the first field under the threshold are skipped for
+ * all the lens.
+ */
+static int
+srt_scan(struct srt_state *st, int dstfirst, int flen, int *lens, int nlens)
+{
+	struct hhh_params *params = st->params;
+	struct odflow **fl = params->flow_list;
+	struct odflow agg, *odfp, *_odfp;
+	uint64_t mask[SRT_MAXWORDS], *r;
+	int i, j, k, s, na, idx, label[2], nflows = 0;
+	int nwords = st->nwords, stride = st->stride;
+
+	if (hhh_expired())
+		return (0);  /* the results are thrown away */
+	params->nodes++;
+	/* collect the runs of the first field above the threshold */
+	memset(&agg, 0, sizeof(agg));
+	label[dstfirst] = flen;
+	label[!dstfirst] = lens[nlens - 1];
+	agg.s.srclen = label[0];
+	agg.s.dstlen = label[1];
+	srt_mkmask(st, flen, 0, mask);
+	na = 0;
+	for (s = 0; s < st->n; s = i) {
+		agg.packet = agg.byte = 0;
+		for (i = s; i < st->n; i++) {
+			r = &st->rec[i * stride];
+			if (!srt_same(&st->rec[s * stride], r, mask, nwords))
+				break;
+			if (!srt_fits(SRT_META(st, r), label) ||
+			    fl[SRT_INDEX(SRT_META(st, r))] == NULL)
+				continue;
+			agg.packet += SRT_PACKET(st, r);
+			agg.byte += SRT_BYTE(st, r);
+		}
+		if (!thresh_check(&agg, params->thresh, params->thresh2))
+			continue;
+		memcpy(&st->act[na * stride], &st->rec[s * stride],
+		    sizeof(uint64_t) * stride * (i - s));
+		na += i - s;
+	}
+
+	for (k = 0; k < nlens; k++) {
+		label[!dstfirst] = lens[k];
+		agg.s.srclen = label[0];
+		agg.s.dstlen = label[1];
+		srt_mkmask(st, flen, lens[k], mask);
+		for (s = 0; s < na; s = i) {
+			agg.packet = agg.byte = 0;
+			odfp = NULL;
+			for (i = s; i < na; i++) {
+				r = &st->act[i * stride];
+				if (!srt_same(&st->act[s * stride], r, mask,
+				    nwords))
+					break;
+				if (!srt_fits(SRT_META(st, r), label) ||
+				    (_odfp = fl[SRT_INDEX(SRT_META(st, r))]) == NULL)
+					continue;
+				if (odfp == NULL)
+					odfp = _odfp;  /* the first one */
+				agg.packet += SRT_PACKET(st, r);
+				agg.byte += SRT_BYTE(st, r);
+			}
+			if (odfp == NULL ||
+			    !thresh_check(&agg, params->thresh, params->thresh2))
+				continue;
+
+			/* extract the run */
+			agg.s = odflowspec_gen(&odfp->s, label, st->bytesize);
+			_odfp = odflow_alloc(&agg.s, NULL);
+			_odfp->af = odfp->af;
+			_odfp->byte = agg.byte;
+			_odfp->packet = agg.packet;
+#if 1	/* for debug */
+			if (verbose) {
+				printf("# extract: ");
+				odflow_print(_odfp);
+				printf(" packet:%" PRIu64 "\n", _odfp->packet);
+			}
+#endif
+			TAILQ_INSERT_TAIL(&params->odfqp->odfq_head, _odfp,
+			    odf_chain);
+			params->odfqp->nrecord++;
+			nflows++;
+			if (label[0] == 0 && label[1] == 0)
+				st->wildcard = 1;
+
+			/* remove the processed odflows */
+			for (j = s; j < i; j++) {
+				r = &st->act[j * stride];
+				idx = SRT_INDEX(SRT_META(st, r));
+				if (!srt_fits(SRT_META(st, r), label) ||
+				    fl[idx] == NULL)
+					continue;
+				odflow_remove(params, idx, _odfp);
+			}
+		}
+	}
+	return (nflows);
+}
+
+/* check if a prefix length can be in a label under the heuristics */
+static int
+srt_label_ok(int pl, struct hhh_params *params)
+{
+	if ((params->prefixlen - pl) % params->minsize != 0)
+		return (0);
+	if (disable_heuristics)
+		return (1);
+	if (pl < params->cutoff && (pl & (params->cutoffres - 1)) != 0)
+		return (0);
+	/* IPv6: do not aggregate the lower 64 bits */
+	if (params->prefixlen == 128 && pl > 64 && pl < 128)
+		return (0);
+	return (1);
+}
+
+/* make the list of the prefix lengths in [lo, hi) in the descending order */
+static int
+srt_lens(int lo, int hi, int *lens, struct hhh_params *params)
+{
+	int pl, n = 0;
+
+	for (pl = hi - 1; pl >= lo; pl--)
+		if (srt_label_ok(pl, params))
+			lens[n++] = pl;
+	return (n);
+}
+
+/*
+ * find fmax, the longest prefix of the first field above the
+ * threshold, of each odflow, and make the list in the order of fmax.
+ * the prefix lengths are tried from the shortest, and the runs
+ * under the threshold are dropped from the longer ones.
+ */
+static void
+srt_heavy(struct srt_state *st, int dstfirst, int *lens, int nlens)
+{
+	struct hhh_params *params = st->params;
+	struct odflow agg;
+	uint64_t mask[SRT_MAXWORDS], *cur, *next, *r;
+	uint8_t *fmax = st->fmax[dstfirst];
+	int count[256];
+	int i, j, k, s, n, m, idx, label[2];
+	int nwords = st->nwords, stride = st->stride;
+
+	/* sort all the odflows by the full keys */
+	srt_mkmask(st, params->prefixlen, params->prefixlen, mask);
+	st->n = 0;
+	for (i = 0; i < st->nlist; i++)
+		srt_add(st, dstfirst, i, mask);
+	srt_radix(st);
+	st->sorted[0] = -1;
+
+	memset(fmax, 0, st->nlist);
+	memset(&agg, 0, sizeof(agg));
+	cur = st->rec;
+	next = st->act;
+	n = st->n;
+	for (k = nlens - 1; k >= 0 && n > 0 && !hhh_expired(); k--) {
+		label[dstfirst] = lens[k];
+		label[!dstfirst] = 0;
+		agg.s.srclen = label[0];
+		agg.s.dstlen = label[1];
+		srt_mkmask(st, lens[k], 0, mask);
+		m = 0;
+		for (s = 0; s < n; s = i) {
+			agg.packet = agg.byte = 0;
+			for (i = s; i < n; i++) {
+				r = &cur[i * stride];
+				if (!srt_same(&cur[s * stride], r, mask, nwords))
+					break;
+				if (!srt_fits(SRT_META(st, r), label))
+					continue;
+				agg.packet += SRT_PACKET(st, r);
+				agg.byte += SRT_BYTE(st, r);
+			}
+			if (!thresh_check(&agg, params->thresh, params->thresh2))
+				continue;
+			for (j = s; j < i; j++) {
+				r = &cur[j * stride];
+				if (!srt_fits(SRT_META(st, r), label))
+					continue;
+				fmax[SRT_INDEX(SRT_META(st, r))] = lens[k];
+				memcpy(&next[m++ * stride], r,
+				    sizeof(uint64_t) * stride);
+			}
+		}
+		r = cur; cur = next; next = r;
+		n = m;
+	}
+
+	/* counting sort by fmax in the descending order */
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < st->nlist; i++)
+		count[255 - fmax[i]]++;
+	for (i = 0, s = 0; i < 256; i++) {
+		j = count[i];
+		count[i] = s;
+		s += j;
+	}
+	for (i = 0; i < st->nlist; i++) {
+		idx = count[255 - fmax[i]]++;
+		st->list[dstfirst][idx] = i;
+	}
+}
+
+/*
+ * visit the label pairs [a, b] for a in alens and b in blens.
+ * the longer labels come first in either order, so the order is
+ * chosen to need fewer sorts.
+ */
+static int
+srt_block(struct srt_state *st, int *alens, int na, int *blens, int nb)
+{
+	int i, nflows = 0;
+
+	if (na == 0 || nb == 0)
+		return (0);
+	if (nb < na || (na == 1 && nb == 1 && st->sorted[0] == 1 &&
+	    st->sorted[1] == blens[0]))
+		for (i = 0; i < nb; i++) {
+			srt_sort(st, 1, blens[i], alens[na - 1]);
+			nflows += srt_scan(st, 1, blens[i], alens, na);
+		}
+	else
+		for (i = 0; i < na; i++) {
+			srt_sort(st, 0, alens[i], blens[nb - 1]);
+			nflows += srt_scan(st, 0, alens[i], blens, nb);
+		}
+	return (nflows);
+}
+
+/*
+ * visit the labels in [a0, a0 + size) x [b0, b0 + size) in the order
+ * of lattice_search(): the 4 sub-areas, lower, left, right and upper.
+ * at depth 0, the area is visited by srt_block() at once.
+ */
+static int
+srt_area(struct srt_state *st, int a0, int b0, int size, int depth)
+{
+	int alens[129], blens[129], na, nb, half, nflows = 0;
+
+	na = srt_lens(a0, a0 + size, alens, st->params);
+	nb = srt_lens(b0, b0 + size, blens, st->params);
+	if (na == 0 || nb == 0)
+		return (0);
+	if (depth == 0 || (na == 1 && nb == 1))
+		return (srt_block(st, alens, na, blens, nb));
+	half = size / 2;
+	nflows += srt_area(st, a0 + half, b0 + half, half, depth - 1);
+	nflows += srt_area(st, a0 + half, b0, half, depth - 1);
+	nflows += srt_area(st, a0, b0 + half, half, depth - 1);
+	nflows += srt_area(st, a0, b0, half, depth - 1);
+	return (nflows);
+}
+
+/*
+ * run the sort-based search on the n odflows in params->flow_list.
+ * returns the number of odflows extracted.
+ */
+static int
+sort_search(struct hhh_params *params, int n, int af)
+{
+	struct srt_state st;
+	struct odflow *odfp;
+	struct odflow_spec spec;
+	int lens[129], nlens, edges[2], nedges = 0;
+	int i, e, minpl, remains, nflows = 0;
+
+	if (n == 0)
+		return (0);
+	memset(&st, 0, sizeof(st));
+	st.params = params;
+	st.bytesize = params->prefixlen / 8;
+	st.nwords = (st.bytesize * 2 + 7) / 8;
+	st.stride = st.nwords + 3;
+	st.nlist = n;
+	for (i = 0; i < 2; i++) {
+		st.keys[i] = malloc(sizeof(uint64_t) * st.nwords * n);
+		st.fmax[i] = malloc(n);
+		st.list[i] = malloc(sizeof(int) * n);
+		if (st.keys[i] == NULL || st.fmax[i] == NULL ||
+		    st.list[i] == NULL)
+			err(1, "malloc(sort keys) failed!");
+	}
+	st.rec = malloc(sizeof(uint64_t) * st.stride * n);
+	st.tmp = malloc(sizeof(uint64_t) * st.stride * n);
+	st.act = malloc(sizeof(uint64_t) * st.stride * n);
+	if (st.rec == NULL || st.tmp == NULL || st.act == NULL)
+		err(1, "malloc(sort records) failed!");
+	for (i = 0; i < n; i++) {
+		srt_mkkey(&st, &params->flow_list[i]->s, 0,
+		    &st.keys[0][i * st.nwords]);
+		srt_mkkey(&st, &params->flow_list[i]->s, 1,
+		    &st.keys[1][i * st.nwords]);
+	}
+
+	/* the protocol is not aggregated */
+	minpl = (params->prefixlen == 24) ? 8 : 0;
+	nlens = srt_lens(minpl, params->prefixlen + 1, lens, params);
+	srt_heavy(&st, 0, lens, nlens);
+	srt_heavy(&st, 1, lens, nlens);
+
+	edges[nedges++] = params->prefixlen;
+	if (params->prefixlen == 128)
+		edges[nedges++] = 64;
+	for (e = 0; e < nedges; e++) {
+		/* left bottom edge */
+		nlens = srt_lens(minpl, edges[e] + 1, lens, params);
+		nflows += srt_block(&st, &edges[e], 1, lens, nlens);
+		/* right bottom edge */
+		nlens = srt_lens(minpl, edges[e], lens, params);
+		nflows += srt_block(&st, lens, nlens, &edges[e], 1);
+	}
+
+	/* sub-areas */
+	remains = 0;
+	for (i = 0; i < n && !remains; i++)
+		if (params->flow_list[i] != NULL)
+			remains = 1;
+	e = edges[nedges - 1];
+	nflows += srt_area(&st, minpl, minpl, e - minpl, SRT_DEPTH);
+
+	/*
+	 * lattice_search() keeps the wildcard made before the sub-areas,
+	 * even if all the odflows have been extracted from it.
+	 */
+	if (remains && minpl == 0 && !st.wildcard && !query.f_af) {
+		memset(&spec, 0, sizeof(spec));
+		odfp = odflow_alloc(&spec, NULL);
+		odfp->af = af;
+		TAILQ_INSERT_TAIL(&params->odfqp->odfq_head, odfp, odf_chain);
+		params->odfqp->nrecord++;
+		nflows++;
+	}
+
+	for (i = 0; i < 2; i++) {
+		free(st.keys[i]);
+		free(st.fmax[i]);
+		free(st.list[i]);
+	}
+	free(st.rec);
+	free(st.tmp);
+	free(st.act);
+	return (nflows);
+}
+
+/*
+ * find the HHHs of the odflows in the hash (main attribute), or in
+ * the tailq (sub-attribute), and place them in the tailq.
+ * the odflows are taken from the hash or the tailq.  with in->odfs,
+ * the odflows in it are searched instead, and left as they are.
+ */
+static int
+find_hhh(struct odflow_hash *hash, int bitlen, uint64_t thresh, uint64_t thresh2,
+	struct response *resp, struct odf_tailq *odfqp, struct hhh_input *in)
+{
+	struct odflow *root, *odfp, *next;
+	struct odflow_spec spec;
+	struct hhh_params params;
+	struct hhh_memo memo;
+	int i, n, nrecord, nflows = 0;
+	uint64_t t0 = 0;
+
+	/* sanity check */
+	if (in != NULL && in->odfs != NULL) { /* searched in place */
+		if (in->n == 0)
+			return (0);
+	} else if (hash != NULL) { /* for main attribute */
+		if (hash->nrecord == 0)
+			return (0);
+	} else { /* for sub-attribute */
+		if (TAILQ_EMPTY(&odfqp->odfq_head))
+			return (0);
+	}
+
+	if (hhh_profile)
+		t0 = prof_usec();
+
+	/* create a dummy top node */
+	memset(&spec, 0, sizeof(spec));
+	root = odflow_alloc(&spec, NULL);
+
+	/* allocate flow buffer to store all the flow entries */
+	params.thresh  = thresh;
+	params.thresh2 = thresh2;
+	params.minsize = 1;
+	params.maxsize = bitlen;
+	params.prefixlen = bitlen;
+	params.cutoff = 0;	/* no cutoff */
+	params.cutoffres = 1;
+	params.keytype = ODKEY_SPEC;
+	params.resp = resp;
 	params.odfqp = odfqp;
+	params.memo = NULL;
+	params.keep = 0;
+	params.inputs = NULL;
+	params.root = root;
+	params.nodes = 0;
+	params.pruned = 0;
 
 	switch (bitlen) {
 	case 32: /* IPv4 address */
 		root->af = AF_INET;
+		params.keytype = ODKEY_IPV4;
 		if (!disable_heuristics) {
 #if 0
 			params.minsize = 8; /* for backward compatibility */
@@ -468,6 +1981,7 @@ find_hhh(struct odflow_hash *hash, int bitlen, uint64_t thresh, uint64_t thresh2
 		break;
 	case 128: /* IPv6 address */
 		root->af = AF_INET6;
+		params.keytype = ODKEY_IPV6;
 		if (!disable_heuristics) {
 #if 1
 			params.minsize = 1;
@@ -480,13 +1994,31 @@ find_hhh(struct odflow_hash *hash, int bitlen, uint64_t thresh, uint64_t thresh2
 		break;
 	case 24:  /* protocol and port */
 		root->af = AF_LOCAL;
+		params.keytype = ODKEY_PROTO;
 		if (!disable_heuristics) {
 			params.minsize = 16;
 		}
 		break;
 	}
-	/* create flow_list from hash or tailq */
-	if (hash != NULL) {
+	/* create flow_list from in->odfs, hash or tailq */
+	if (in != NULL && in->odfs != NULL) {
+		params.flow_list = malloc(sizeof(struct odflow *) * in->n);
+		if (params.flow_list == NULL)
+			err(1, "malloc(flow_list) failed!");
+		/* the indices are the ones of in->odfs for main attribute */
+		n = 0;
+		for (i = 0; i < in->n; i++) {
+			odfp = in->odfs[i];
+			if (odfp->af == root->af) { /* only for matching af */
+				params.flow_list[n] = odfp;
+				cl_append(&root->odf_cache, n);
+				root->packet += odfp->packet;
+				root->byte   += odfp->byte;
+				n++;
+			}
+		}
+		params.keep = 1;
+	} else if (hash != NULL) {
 		/* main-attribute: */
 		params.flow_list = malloc(sizeof(struct odflow *) * hash->nrecord);
 		if (params.flow_list == NULL)
@@ -494,19 +2026,16 @@ find_hhh(struct odflow_hash *hash, int bitlen, uint64_t thresh, uint64_t thresh2
 		/* move all odflows in hash to odflow_list, and 
 		 * make them pointed from root's cache_list */
 		n = 0;
-		if (hash->nrecord > 0)
-			for (i = 0; i < hash->nbuckets; i++) {
-				while ((odfp = TAILQ_FIRST(&hash->tbl[i].odfq_head)) != NULL) {
-					TAILQ_REMOVE(&hash->tbl[i].odfq_head, odfp, odf_chain);
-					hash->tbl[i].nrecord--;
-			
-					params.flow_list[n] = odfp;
-					cl_append(root->odf_cache, n);
-					root->packet += odfp->packet;
-					root->byte   += odfp->byte;
-					n++;
-				}
+		if (hash->nrecord > 0) {
+			ODHASH_FOREACH(odfp, hash, i) {
+				params.flow_list[n] = odfp;
+				cl_append(&root->odf_cache, n);
+				root->packet += odfp->packet;
+				root->byte   += odfp->byte;
+				n++;
 			}
+			odhash_clear(hash);
+		}
 		assert(n == hash->nrecord);
 	} else {
 		/* sub-attribute: */
@@ -529,7 +2058,7 @@ find_hhh(struct odflow_hash *hash, int bitlen, uint64_t thresh, uint64_t thresh2
 				odfqp->nrecord--;
 
 				params.flow_list[n] = odfp;
-				cl_append(root->odf_cache, n);
+				cl_append(&root->odf_cache, n);
 				root->packet += odfp->packet;
 				root->byte   += odfp->byte;
 				n++;
@@ -539,77 +2068,499 @@ find_hhh(struct odflow_hash *hash, int bitlen, uint64_t thresh, uint64_t thresh2
 		assert(n == nrecord);
 	}
 
-	/* protocol specific recursive lattice search */
-	switch (bitlen) {
-	case 32: /* IPv4 address */
-		/* left bottom edge */
-		nflows += lattice_search(root, 32, 0, 32, POS_LOWER, &params);
-		/* right bottom edge */
-		nflows += lattice_search(root, 0, 32, 32, POS_LOWER, &params);
-		/* sub-areas */
-		nflows += lattice_search(root, 0, 0, 32, POS_LOWER, &params);
-		break;
-	case 128: /* IPv6 address */
-		params.maxsize = 128;
-		/* left bottom edge for /128 */
-		nflows += lattice_search(root, 128, 0, 128, POS_LOWER, &params);
-		/* right bottom edge for /128 */
-		nflows += lattice_search(root, 0, 128, 128, POS_LOWER, &params);
-
-		params.maxsize = 64;
-		/* left bottom edge for /64 */
-		nflows += lattice_search(root, 64, 0, 64, POS_LOWER, &params);
-		/* right bottom edge for /64 */
-		nflows += lattice_search(root, 0, 64, 64, POS_LOWER, &params);
-		/* sub-areas for [64,64] */
-		nflows += lattice_search(root, 0, 0, 64, POS_LOWER, &params);
-		break;
-	case 24:  /* protocol and port */
-		/* left bottom edge */
-		nflows += lattice_search(root, 24, 8, 16, POS_LOWER, &params);
-		/* right bottom edge */
-		nflows += lattice_search(root, 8, 24, 16, POS_LOWER, &params);
-		/* sub-areas */
-		nflows += lattice_search(root, 8, 8, 16, POS_LOWER, &params);
+	if (hhh_engine == HHH_SORT) {
+		/* sort-based bottom-up search */
+		nflows += sort_search(&params, n, root->af);
+	} else {
+		/* protocol specific recursive lattice search */
+		memset(&memo, 0, sizeof(memo));
+		if (n >= HHH_MEMOMIN) {
+			params.memo = &memo;
+			if (in != NULL && in->memo != NULL) {
+				/* the memo of the runs for a -t list */
+				params.memo = in->memo;
+				if (params.keep)
+					params.inputs = in->odfs;
+			}
+		}
+		switch (bitlen) {
+		case 32: /* IPv4 address */
+			/* left bottom edge */
+			nflows += lattice_search(root, 32, 0, 32, POS_LOWER, &params);
+			/* right bottom edge */
+			nflows += lattice_search(root, 0, 32, 32, POS_LOWER, &params);
+			/* sub-areas */
+			nflows += lattice_search(root, 0, 0, 32, POS_LOWER, &params);
+			break;
+		case 128: /* IPv6 address */
+			params.maxsize = 128;
+			/* left bottom edge for /128 */
+			nflows += lattice_search(root, 128, 0, 128, POS_LOWER, &params);
+			/* right bottom edge for /128 */
+			nflows += lattice_search(root, 0, 128, 128, POS_LOWER, &params);
 
+			params.maxsize = 64;
+			/* left bottom edge for /64 */
+			nflows += lattice_search(root, 64, 0, 64, POS_LOWER, &params);
+			/* right bottom edge for /64 */
+			nflows += lattice_search(root, 0, 64, 64, POS_LOWER, &params);
+			/* sub-areas for [64,64] */
+			nflows += lattice_search(root, 0, 0, 64, POS_LOWER, &params);
+			break;
+		case 24:  /* protocol and port */
+			/* left bottom edge */
+			nflows += lattice_search(root, 24, 8, 16, POS_LOWER, &params);
+			/* right bottom edge */
+			nflows += lattice_search(root, 8, 24, 16, POS_LOWER, &params);
+			/* sub-areas */
+			nflows += lattice_search(root, 8, 8, 16, POS_LOWER, &params);
+			break;
+		}
+		memo_free(&memo);
+	}
+
+	if (bitlen == 24 && !params.keep) {
 		/* for protocols, need to clean up the remaining odflows */
 		for (i = 0; i < n; i++)
 			if (params.flow_list[i] != NULL)
 				odflow_free(params.flow_list[i]);
-		break;
 	}
 	
 	free(params.flow_list);
 	odflow_free(root);
+
+	if (hhh_profile) {
+		prof_add(resp, bitlen == 32 ? PROF_FIND4 :
+		    (bitlen == 128 ? PROF_FIND6 : PROF_FINDPROTO), t0);
+		__atomic_add_fetch(&resp->prof.nodes, params.nodes,
+		    __ATOMIC_RELAXED);
+		__atomic_add_fetch(&resp->prof.pruned, params.pruned,
+		    __ATOMIC_RELAXED);
+		__atomic_add_fetch(&resp->prof.extracted, nflows,
+		    __ATOMIC_RELAXED);
+	}
 	return nflows;
 }
 
+/* add the time since t0 to a phase of the profile */
+void
+prof_add(struct response *resp, int phase, uint64_t t0)
+{
+	__atomic_add_fetch(&resp->prof.usec[phase], prof_usec() - t0,
+	    __ATOMIC_RELAXED);
+}
+
+/* find_hhh() for the main attribute */
+static void
+hhh_maintask(void *arg, int i)
+{
+	struct hhh_task *task = (struct hhh_task *)arg + i;
+	struct response *resp = task->resp;
+
+	task->nflows = find_hhh(task->hash, task->bitlen, resp->thresh_byte,
+				resp->thresh_packet, resp, &task->odfq, &task->in);
+}
+
+/* find_hhh() for the sub-attributes of a result */
+static void
+hhh_subtask(void *arg, int i)
+{
+	struct hhh_subtasks *subtasks = arg;
+	struct response *resp = subtasks->resp;
+	struct odflow *odfp = subtasks->results[i];
+	struct hhh_input in;
+	uint64_t thresh, thresh2;
+	int nflows;
+
+	/* calculate threshold */
+	thresh  = (odfp->byte   * query.threshold + 99) / 100;
+	thresh2 = (odfp->packet * query.threshold + 99) / 100;
+	if (disable_heuristics < 2) {
+		/* increase the threshold for sub-attributes */
+		thresh *= 4;
+		thresh2 *= 4;
+	}
+	if (hhh_expired()) {
+		hhh_dropsubs(resp, odfp);
+		return;
+	}
+	memset(&in, 0, sizeof(in));
+	if (subtasks->origs[0] != NULL)
+		/* the inputs are left for the next run */
+		hhh_subinputs(odfp, subtasks->origs[odfp->af == AF_INET6], &in);
+	if (proto_view == 0) {
+		nflows = find_hhh(NULL, 24, thresh, thresh2,
+					resp, &odfp->odf_odpq, &in);
+	} else {
+		nflows = find_hhh(NULL, 32, thresh, thresh2,
+					resp, &odfp->odf_odpq, &in);
+		nflows += find_hhh(NULL, 128, thresh, thresh2,
+					resp, &odfp->odf_odpq, &in);
+	}
+	free(in.odfs);
+	if (hhh_expired()) {
+		/* the search may have been cut */
+		hhh_dropsubs(resp, odfp);
+		return;
+	}
+
+	if (query.nflows != 0 && query.nflows < nflows) {
+		/* get ranking */
+		odfq_countsort(&odfp->odf_odpq, odfp->byte, odfp->packet);
+		odfq_listreduce(&odfp->odf_odpq, query.nflows);
+		/* restore the area order */
+		odfq_areasort(&odfp->odf_odpq);
+	}
+}
+
+/*
+ * leave a result without the sub-attributes, when they are not
+ * aggregated by the deadline.
+ */
+static void
+hhh_dropsubs(struct response *resp, struct odflow *odfp)
+{
+	struct odflow *odpp;
+
+	while ((odpp = TAILQ_FIRST(&odfp->odf_odpq.odfq_head)) != NULL) {
+		TAILQ_REMOVE(&odfp->odf_odpq.odfq_head, odpp, odf_chain);
+		odfp->odf_odpq.nrecord--;
+		odflow_free(odpp);
+	}
+	__atomic_add_fetch(&resp->subs_dropped, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * check if the deadline of the search being run has passed.
+ * once it has, the searches of all the threads return at once.
+ */
+inline static int
+hhh_expired(void)
+{
+	if (hhh_stoptime == 0)
+		return (0);
+	if (__atomic_load_n(&hhh_stopped, __ATOMIC_RELAXED))
+		return (1);
+	if (prof_usec() < hhh_stoptime)
+		return (0);
+	__atomic_store_n(&hhh_stopped, 1, __ATOMIC_RELAXED);
+	return (1);
+}
+
+/*
+ * make a copy of the input odflows in origs with the prefixes cut to
+ * len bits.  the sub-odflows are not copied: an odflow of the copy has
+ * a proxy as its only sub-odflow, and the cache_list of the proxy
+ * keeps the indices of the input odflows in it.  the proxy goes to a
+ * result with the odflow, and hhh_takesubs() gives the sub-odflows
+ * of the inputs to the result.
+ * the odflows are taken from the input pool, and released with the
+ * inputs.
+ */
+static struct odflow_hash *
+hhh_coarsen(struct odflow_hash *hash, struct odflow **origs, int bitlen,
+	int len, struct response *resp)
+{
+	struct odflow_hash *coarse;
+	struct odflow_spec spec;
+	struct odflow *odfp, *newp, *proxy;
+	int i, label[2];
+
+	coarse = odhash_alloc(hash->nrecord, hash->keytype);
+	coarse->pool = resp->pool;
+	coarse->byte = hash->byte;
+	coarse->packet = hash->packet;
+	for (i = 0; i < hash->nrecord; i++) {
+		if ((i & 0xfff) == 0 && hhh_expired())
+			break;	/* the level is abandoned */
+		odfp = origs[i];
+		label[0] = min(odfp->s.srclen, len);
+		label[1] = min(odfp->s.dstlen, len);
+		spec = odflowspec_gen(&odfp->s, label, bitlen / 8);
+		newp = odflow_lookup(coarse, &spec);
+		if ((proxy = TAILQ_FIRST(&newp->odf_odpq.odfq_head)) == NULL) {
+			newp->af = odfp->af;
+			proxy = odflow_alloc(&spec, resp->pool);
+			TAILQ_INSERT_TAIL(&newp->odf_odpq.odfq_head, proxy,
+			    odf_chain);
+			newp->odf_odpq.nrecord++;
+		}
+		cl_append(&proxy->odf_cache, i);
+		newp->byte += odfp->byte;
+		newp->packet += odfp->packet;
+	}
+	return (coarse);
+}
+
+/*
+ * replace the proxies of the results by the sub-odflows of the inputs.
+ * after the deadline, the proxies are just dropped, as hhh_subtask()
+ * leaves the results without the sub-attributes then.
+ */
+static void
+hhh_takesubs(struct odf_tailq *results, struct odflow **origs,
+	uint64_t deadline)
+{
+	struct odflow *odfp, *proxy;
+	struct odf_tailq proxies;
+	int i, expired;
+
+	TAILQ_FOREACH(odfp, &results->odfq_head, odf_chain) {
+		TAILQ_INIT(&proxies.odfq_head);
+		proxies.nrecord = 0;
+		odfq_moveall(&odfp->odf_odpq, &proxies);
+		expired = (prof_usec() >= deadline);
+		while ((proxy = TAILQ_FIRST(&proxies.odfq_head)) != NULL) {
+			TAILQ_REMOVE(&proxies.odfq_head, proxy, odf_chain);
+			proxies.nrecord--;
+			for (i = 0; i < cl_size(&proxy->odf_cache) && !expired;
+			    i++)
+				odfq_moveall(&origs[cl_get(&proxy->odf_cache,
+				    i)]->odf_odpq, &odfp->odf_odpq);
+			odflow_free(proxy);
+		}
+	}
+}
+
+/*
+ * list the sub-odflows of the inputs of a result in in->odfs, in the
+ * order hhh_takesubs() would move them, to search them in place.
+ * the proxies of the result are freed.
+ */
+static void
+hhh_subinputs(struct odflow *odfp, struct odflow **origs,
+	struct hhh_input *in)
+{
+	struct odflow *proxy, *odpp;
+	int i, n = 0;
+
+	TAILQ_FOREACH(proxy, &odfp->odf_odpq.odfq_head, odf_chain)
+		for (i = 0; i < cl_size(&proxy->odf_cache); i++)
+			n += origs[cl_get(&proxy->odf_cache,
+			    i)]->odf_odpq.nrecord;
+	in->odfs = malloc(sizeof(struct odflow *) * max(n, 1));
+	if (in->odfs == NULL)
+		err(1, "malloc(subinputs) failed!");
+	in->n = 0;
+	while ((proxy = TAILQ_FIRST(&odfp->odf_odpq.odfq_head)) != NULL) {
+		TAILQ_REMOVE(&odfp->odf_odpq.odfq_head, proxy, odf_chain);
+		odfp->odf_odpq.nrecord--;
+		for (i = 0; i < cl_size(&proxy->odf_cache); i++)
+			TAILQ_FOREACH(odpp, &origs[cl_get(&proxy->odf_cache,
+			    i)]->odf_odpq.odfq_head, odf_chain)
+				in->odfs[in->n++] = odpp;
+		odflow_free(proxy);
+	}
+}
+
+/* the odflows in the hash, in the order of ODHASH_FOREACH */
+static struct odflow **
+hhh_origs(struct odflow_hash *hash)
+{
+	struct odflow **origs, *odfp;
+	int i, n = 0;
+
+	origs = malloc(sizeof(struct odflow *) * max(hash->nrecord, 1));
+	if (origs == NULL)
+		err(1, "malloc(origs) failed!");
+	if (hash->nrecord > 0)
+		ODHASH_FOREACH(odfp, hash, i)
+			origs[n++] = odfp;
+	return (origs);
+}
+
+/*
+ * coarse-to-fine search within hhh_deadline_ms.
+ * the inputs are first aggregated with the prefixes cut to a short
+ * length, which is quick as the odflows are much fewer, and then
+ * with the longer ones of the following levels, up to the full
+ * length.  each level searches a copy made by hhh_coarsen(), so the
+ * inputs are kept for the next level.  a level not finished by the
+ * deadline is abandoned, and the results of the last finished level
+ * are used.  the first level is always finished.
+ * when the time of the first level shows that the full search fits
+ * in the rest of the budget, the other levels are skipped, and the
+ * inputs are searched in place as without the deadline.  the full
+ * search also stops at the deadline, and then the first level is used.
+ */
+static void
+hhh_anytime(struct response *resp, struct hhh_task *tasks, int ntasks,
+	uint64_t deadline)
+{
+	struct odflow_hash *inputs[2];
+	struct odflow **origs[2];
+	struct hhh_input in[2];
+	struct odf_tailq results[2], *drop;
+	struct odflow *odfp;
+	uint64_t t0, t1;
+	int i, level, nflows[2], full = 0;
+
+	t0 = prof_usec();
+	for (i = 0; i < ntasks; i++) {
+		inputs[i] = tasks[i].hash;
+		/* the levels search the copies, not the inputs */
+		in[i] = tasks[i].in;
+		memset(&tasks[i].in, 0, sizeof(tasks[i].in));
+		origs[i] = (in[i].odfs != NULL) ? in[i].odfs :
+		    hhh_origs(inputs[i]);
+		TAILQ_INIT(&results[i].odfq_head);
+		results[i].nrecord = 0;
+		nflows[i] = 0;
+	}
+	resp->refined = 0;
+
+	for (level = 0; level < HHH_NLEVELS; level++) {
+		if (level > 0 && prof_usec() >= deadline)
+			break;
+		/* the first level runs to the end */
+		hhh_stopped = 0;
+		hhh_stoptime = (level > 0) ? deadline : 0;
+		for (i = 0; i < ntasks; i++)
+			tasks[i].hash = hhh_coarsen(inputs[i], origs[i],
+			    tasks[i].bitlen,
+			    refine_lens[level][tasks[i].bitlen == 128], resp);
+		if (!hhh_stopped)
+			taskq_run(hhh_maintask, tasks, ntasks);
+		hhh_stoptime = 0;
+
+		for (i = 0; i < ntasks; i++) {
+			odhash_free(tasks[i].hash);
+			tasks[i].hash = inputs[i];
+			/* keep the results of the last finished level */
+			drop = hhh_stopped ? &tasks[i].odfq : &results[i];
+			while ((odfp = TAILQ_FIRST(&drop->odfq_head)) != NULL) {
+				TAILQ_REMOVE(&drop->odfq_head, odfp, odf_chain);
+				drop->nrecord--;
+				odflow_free(odfp);
+			}
+			if (!hhh_stopped) {
+				odfq_moveall(&tasks[i].odfq, &results[i]);
+				nflows[i] = tasks[i].nflows;
+			}
+		}
+		if (hhh_stopped)
+			break;
+		resp->refined = level + 1;
+		resp->refined_len4 = refine_lens[level][0];
+		resp->refined_len6 = refine_lens[level][1];
+#if 1	/* for debug */
+		if (verbose)
+			printf("# refined: level %d in %" PRIu64 " ms\n",
+			    level + 1, (prof_usec() - t0) / 1000);
+#endif
+		t1 = prof_usec();
+		if (level == 0 && t1 + (t1 - t0) * HHH_PROBERATIO < deadline) {
+			full = 1;	/* the full search fits */
+			break;
+		}
+	}
+
+	if (full) {
+		/*
+		 * search the inputs to the end, in place to keep the
+		 * first level in case the deadline passes.
+		 */
+		for (i = 0; i < ntasks; i++) {
+			tasks[i].in = in[i];
+			tasks[i].in.odfs = origs[i];
+			tasks[i].in.n = inputs[i]->nrecord;
+		}
+		hhh_stopped = 0;
+		hhh_stoptime = deadline;
+		taskq_run(hhh_maintask, tasks, ntasks);
+		hhh_stoptime = 0;
+		for (i = 0; i < ntasks; i++) {
+			/* drop the level not used */
+			drop = hhh_stopped ? &tasks[i].odfq : &results[i];
+			while ((odfp = TAILQ_FIRST(&drop->odfq_head)) != NULL) {
+				TAILQ_REMOVE(&drop->odfq_head, odfp, odf_chain);
+				drop->nrecord--;
+				odflow_free(odfp);
+			}
+		}
+		if (!hhh_stopped) {
+			for (i = 0; i < ntasks; i++) {
+				tasks[i].in = in[i];
+				if (in[i].odfs == NULL) {
+					hhh_takesubs(&tasks[i].odfq, origs[i],
+					    deadline);
+					free(origs[i]);
+				}
+			}
+			resp->refined = HHH_NLEVELS;
+			resp->refined_len4 = refine_lens[HHH_NLEVELS - 1][0];
+			resp->refined_len6 = refine_lens[HHH_NLEVELS - 1][1];
+#if 1	/* for debug */
+			if (verbose)
+				printf("# refined: full search in %" PRIu64
+				    " ms\n", (prof_usec() - t0) / 1000);
+#endif
+			return;
+		}
+		/* else the first level is used */
+	}
+
+	for (i = 0; i < ntasks; i++) {
+		tasks[i].in = in[i];
+		if (in[i].odfs == NULL) {
+			hhh_takesubs(&results[i], origs[i], deadline);
+			free(origs[i]);
+		}
+		/* else the proxies are left for hhh_subtask() */
+		odfq_moveall(&results[i], &tasks[i].odfq);
+		tasks[i].nflows = nflows[i];
+	}
+}
+
 /* 
  * run the HHH algorithm on the inputs.
  * aggregate odflows in the hash(es), and place the resulted odflows
  * into the odfq in the response.
+ * with hhh_nthreads > 1, the independent find_hhh() calls run in
+ * parallel.  the results are put together in the same order as
+ * the single thread, so that the output does not change.
  */
 int
 hhh_run(struct response *resp)
 {
 	struct odflow *odfp;
-	int nflows = 0;
+	struct hhh_task tasks[2];
+	struct hhh_subtasks subtasks;
+	int i, ntasks;
 	struct timeval t0, t1;
+	uint64_t pt0 = 0, nscratch = scratch_allocs, deadline = 0;
 
 	gettimeofday(&t0, NULL);
 	resp->processing_time = 0;
+	resp->subs_dropped = 0;
+	if (hhh_deadline_ms > 0 && proto_view == 0)
+		deadline = prof_usec() + (uint64_t)hhh_deadline_ms * 1000;
+	if (hhh_profile) {
+		/* the input odflows only grow until here */
+		resp->prof.peak_odflows = max(resp->prof.peak_odflows,
+		    resp->pool->bytes_inuse / sizeof(struct odflow));
+	}
+
+	/* debug outputs would be interleaved by threads */
+	taskq_init(verbose ? 1 : hhh_nthreads);
 
 	/* create a dummy hash containing one dummy entry */
 	if (dummy_hash == NULL) {
 		struct odflow_spec spec;
 
-		dummy_hash = odhash_alloc(1);
+		dummy_hash = odhash_alloc(1, ODKEY_SPEC);
 		if (dummy_hash == NULL)
 			err(1, "odhash_alloc failed!");
 		memset(&spec, 0, sizeof(spec));
 		(void)odflow_lookup(dummy_hash, &spec);
 	}
 	
+	odhash_probestats(resp);
+	memset(tasks, 0, sizeof(tasks));
+	for (i = 0; i < 2; i++) {
+		tasks[i].resp = resp;
+		TAILQ_INIT(&tasks[i].odfq.odfq_head);
+	}
 	if (proto_view == 0) {
 		/* calculate total bytes/packets and thresholds */
 		resp->total_byte = resp->ip_hash->byte + resp->ip6_hash->byte;
@@ -624,11 +2575,12 @@ hhh_run(struct response *resp)
 		resp->input_odflows6 = resp->ip6_hash->nrecord;
 		
 		/* for IPv4, aggregate 32 bits */
-		resp->nflows = find_hhh(resp->ip_hash, 32, resp->thresh_byte, 
-					resp->thresh_packet, resp, &resp->odfq);
+		tasks[0].hash = resp->ip_hash;
+		tasks[0].bitlen = 32;
 		/* for IPv6, aggregate 128 bits */
-		resp->nflows += find_hhh(resp->ip6_hash, 128, resp->thresh_byte,
-					resp->thresh_packet, resp, &resp->odfq);
+		tasks[1].hash = resp->ip6_hash;
+		tasks[1].bitlen = 128;
+		ntasks = 2;
 	} else {
 		/* calculate total bytes/packets and thresholds */
 		resp->total_byte = resp->proto_hash->byte;
@@ -640,12 +2592,59 @@ hhh_run(struct response *resp)
 		resp->thresh_packet =
 		    (resp->total_packet * query.threshold + 99) / 100;
 
-		resp->nflows = find_hhh(resp->proto_hash, 24, resp->thresh_byte,
-				    resp->thresh_packet, resp, &resp->odfq);
+		tasks[0].hash = resp->proto_hash;
+		tasks[0].bitlen = 24;
+		ntasks = 1;
+	}
+
+	/* the input odflows are freed by several threads */
+	if (taskq_nthreads() > 1)
+		resp->pool->frozen = 1;
+
+	for (i = 0; i < ntasks; i++) {
+		if (resp->keep_inputs) {
+			/* leave the inputs for the next threshold */
+			tasks[i].in.odfs = hhh_origs(tasks[i].hash);
+			tasks[i].in.n = tasks[i].hash->nrecord;
+			if (resp->memo[i] == NULL &&
+			    (resp->memo[i] = calloc(1,
+			    sizeof(struct hhh_memo))) == NULL)
+				err(1, "calloc(hhh_memo) failed!");
+		}
+		tasks[i].in.memo = resp->memo[i];
+	}
+
+	if (resp->rhhh != NULL) {
+		/* from the counters made at input (aguri3 -e rhhh) */
+		for (i = 0; i < ntasks; i++) {
+			if (hhh_profile)
+				pt0 = prof_usec();
+			tasks[i].nflows = rhhh_find(resp, tasks[i].bitlen,
+			    &tasks[i].odfq);
+			if (hhh_profile)
+				prof_add(resp, tasks[i].bitlen == 32 ?
+				    PROF_FIND4 : PROF_FIND6, pt0);
+		}
+	} else if (deadline != 0)
+		hhh_anytime(resp, tasks, ntasks, deadline);
+	else
+		taskq_run(hhh_maintask, tasks, ntasks);
+	resp->nflows = 0;
+	for (i = 0; i < ntasks; i++) {
+		odfq_moveall(&tasks[i].odfq, &resp->odfq);
+		resp->nflows += tasks[i].nflows;
+		if (resp->memo[i] != NULL && !resp->keep_inputs) {
+			/* the last threshold */
+			memo_free(resp->memo[i]);
+			free(resp->memo[i]);
+			resp->memo[i] = NULL;
+		}
 	}
 
 	/* if # of entries is specified, further reduce the list */
 	if (query.nflows != 0 && query.nflows < resp->nflows) {
+		if (hhh_profile)
+			pt0 = prof_usec();
 		/* get ranking */
 		odfq_countsort(&resp->odfq, resp->total_byte, resp->total_packet);
 		odfq_listreduce(&resp->odfq, query.nflows);
@@ -653,37 +2652,32 @@ hhh_run(struct response *resp)
 		resp->nflows = resp->odfq.nrecord;
 		/* restore the area order */
 		odfq_areasort(&resp->odfq);
+		if (hhh_profile)
+			prof_add(resp, PROF_SORT, pt0);
 	}
 
 	/* aggregate protocols */
-        TAILQ_FOREACH(odfp, &resp->odfq.odfq_head, odf_chain) {
-		/* calculate threshold */
-		uint64_t thresh, thresh2;
-		thresh  = (odfp->byte   * query.threshold + 99) / 100;
-		thresh2 = (odfp->packet * query.threshold + 99) / 100;
-		if (disable_heuristics < 2) {
-			/* increase the threshold for sub-attributes */
-			thresh *= 4;
-			thresh2 *= 4;
-		}
-		if (proto_view == 0) {
-			nflows = find_hhh(NULL, 24, thresh, thresh2,
-						resp, &odfp->odf_odpq);
-		} else {
-			nflows = find_hhh(NULL, 32, thresh, thresh2,
-						resp, &odfp->odf_odpq);
-			nflows += find_hhh(NULL, 128, thresh, thresh2,
-						resp, &odfp->odf_odpq);
-		}
-
-		if (query.nflows != 0 && query.nflows < nflows) {
-			/* get ranking */
-			odfq_countsort(&odfp->odf_odpq, odfp->byte, odfp->packet);
-			odfq_listreduce(&odfp->odf_odpq, query.nflows);
-			/* restore the area order */
-			odfq_areasort(&odfp->odf_odpq);
-		}
+	if (resp->odfq.nrecord > 0) {
+		subtasks.resp = resp;
+		subtasks.origs[0] = tasks[0].in.odfs;
+		subtasks.origs[1] = tasks[1].in.odfs;
+		subtasks.results =
+		    malloc(sizeof(struct odflow *) * resp->odfq.nrecord);
+		if (subtasks.results == NULL)
+			err(1, "malloc(results) failed!");
+		i = 0;
+		TAILQ_FOREACH(odfp, &resp->odfq.odfq_head, odf_chain)
+			subtasks.results[i++] = odfp;
+		/* within the deadline too, if any */
+		hhh_stopped = 0;
+		hhh_stoptime = (resp->rhhh == NULL) ? deadline : 0;
+		taskq_run(hhh_subtask, &subtasks, i);
+		hhh_stoptime = 0;
+		free(subtasks.results);
 	}
+	for (i = 0; i < ntasks; i++)
+		free(tasks[i].in.odfs);
+	resp->pool->frozen = 0;
 
 #ifndef NDEBUG /* not really needed but to make odflow_stats clean */
 	if (dummy_hash != NULL) {
@@ -691,6 +2685,7 @@ hhh_run(struct response *resp)
 		dummy_hash = NULL;
 	}
 #endif
+	resp->prof.scratch += scratch_allocs - nscratch;
 	gettimeofday(&t1, NULL);
 	resp->processing_time = (t1.tv_sec - t0.tv_sec) * 1000 + 
 	    			(t1.tv_usec - t0.tv_usec) / 1000;
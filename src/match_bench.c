@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2012-2016 WIDE Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * benchmark for odmatch_first(), the lookup of the plot pass
+ * (addupcounts()).
+ * finds the first of the area-sorted result odflows overlapping each
+ * input flow by the list walk with odflowspec_is_overlapped(), and
+ * by the scalar, sse2 and avx2 kernels and the trie of odmatch, and
+ * checks that all give the same answers.
+ * the results are prefixes of the IPv4 and IPv6 inputs, with the
+ * wildcards at the end as hhh_run() leaves them.
+ *
+ * usage: match_bench [-n inputs] [-r rounds] [results ...]
+ */
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <err.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "agurim.h"
+
+/* globals referred to by the common objects */
+struct query query;
+int proto_view = 0;
+int verbose = 0;
+int debug = 0;
+int timeoffset = 0;
+unsigned int blocking_count;
+FILE *wfp;
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/* a skewed choice out of n: small values are much more likely */
+static uint32_t
+skewed(uint32_t n)
+{
+	uint32_t r = random() % n;
+
+	return ((uint32_t)((uint64_t)r * r / n));
+}
+
+/* a host pair of 10.x/16 clients and 192.168.x/24 servers (or IPv6) */
+static void
+make_input(struct odflow *odfp)
+{
+	uint32_t v;
+	int off = 0;
+
+	memset(&odfp->s, 0, sizeof(odfp->s));
+	odfp->af = random() % 4 ? AF_INET : AF_INET6;
+	if (odfp->af == AF_INET6) {
+		v = htonl(0x20010db8);
+		memcpy(odfp->s.src, &v, 4);
+		v = htonl(0x20010200);
+		memcpy(odfp->s.dst, &v, 4);
+		off = 12;
+	}
+	v = htonl(0x0a000000 | skewed(256) << 16 | (random() & 0xffff));
+	memcpy(&odfp->s.src[off], &v, 4);
+	v = htonl(0xc0a80000 | skewed(256) << 8 | skewed(256));
+	memcpy(&odfp->s.dst[off], &v, 4);
+	odfp->s.srclen = odfp->s.dstlen = odfp->af == AF_INET ? 32 : 128;
+}
+
+/* a result: an input cut at random prefix lengths */
+static void
+make_result(struct odflow *odfp)
+{
+	static const int lens4[] = {0, 8, 16, 24, 32};
+	static const int lens6[] = {0, 32, 104, 112, 120, 128};
+
+	make_input(odfp);
+	if (odfp->af == AF_INET) {
+		odfp->s.srclen = lens4[random() % 5];
+		odfp->s.dstlen = lens4[random() % 5];
+	} else {
+		odfp->s.srclen = lens6[random() % 6];
+		odfp->s.dstlen = lens6[random() % 6];
+	}
+	prefix_set(odfp->s.src, odfp->s.srclen, odfp->s.src, MAXLEN);
+	prefix_set(odfp->s.dst, odfp->s.dstlen, odfp->s.dst, MAXLEN);
+}
+
+/* the list walk of addupcounts() before odmatch */
+static int
+list_first(struct odflow **results, int n, struct odflow *odfp)
+{
+	int j;
+
+	for (j = 0; j < n; j++)
+		if (results[j]->af == odfp->af &&
+		    odflowspec_is_overlapped(&results[j]->s, &odfp->s))
+			return (j);
+	return (-1);
+}
+
+struct result {
+	double ns;		/* best time per lookup in ns */
+	uint64_t sum;		/* checksum of the answers */
+};
+
+static void
+bench_match(struct odflow **results, int k, struct odflow *inputs, int n,
+    int isa, int triemin, int rounds, struct result *r)
+{
+	struct odmatch *om = NULL;
+	double t0, t;
+	int i, j, m;
+
+	if (isa >= 0) {
+		odmatch_isa = isa;
+		odmatch_triemin = triemin;
+		om = odmatch_alloc(results, k);
+	}
+	r->ns = 0;
+	for (j = 0; j < rounds; j++) {
+		r->sum = 0;
+		t0 = now_ns();
+		for (i = 0; i < n; i++) {
+			if (om == NULL)
+				m = list_first(results, k, &inputs[i]);
+			else
+				m = odmatch_first(om, &inputs[i].s,
+				    inputs[i].af);
+			r->sum = r->sum * 31 + m + 1;
+		}
+		t = (now_ns() - t0) / n;
+		if (j == 0 || t < r->ns)
+			r->ns = t;
+	}
+	if (om != NULL)
+		odmatch_free(om);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: match_bench [-n inputs] [-r rounds] [results ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static int defaults[] = {16, 64, 256, 1024, 4096};
+	struct odf_tailq odfq;
+	struct odflow *inputs, *odfp, **results;
+	struct result rl, rs[4];
+	int ch, i, j, k, nsizes, *sizes, n = 100000, rounds = 3;
+
+	wfp = stdout;
+	while ((ch = getopt(argc, argv, "n:r:")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			rounds = strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (n < 1 || rounds < 1)
+		usage();
+
+	if (argc > 0) {
+		if ((sizes = calloc(argc, sizeof(int))) == NULL)
+			err(1, "calloc");
+		for (i = 0; i < argc; i++)
+			sizes[i] = strtol(argv[i], NULL, 10);
+		nsizes = argc;
+	} else {
+		sizes = defaults;
+		nsizes = sizeof(defaults) / sizeof(defaults[0]);
+	}
+
+	srandom(1);
+	if ((inputs = calloc(n, sizeof(struct odflow))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < n; i++)
+		make_input(&inputs[i]);
+
+	printf("# best time per lookup in ns of %d rounds, %d inputs\n",
+	    rounds, n);
+	printf("%8s %10s %10s %10s %10s %10s %s\n", "results", "list",
+	    "scalar", "sse2", "avx2", "trie", "same");
+	for (i = 0; i < nsizes; i++) {
+		k = sizes[i];
+		if (k < 2 || (results = calloc(k, sizeof(*results))) == NULL)
+			usage();
+		TAILQ_INIT(&odfq.odfq_head);
+		odfq.nrecord = 0;
+		for (j = 0; j < k; j++) {
+			if ((odfp = calloc(1, sizeof(struct odflow))) == NULL)
+				err(1, "calloc");
+			make_result(odfp);
+			if (j < 2) {
+				/* the wildcards of both families */
+				odfp->af = j == 0 ? AF_INET : AF_INET6;
+				odfp->s.srclen = odfp->s.dstlen = 0;
+			}
+			TAILQ_INSERT_TAIL(&odfq.odfq_head, odfp, odf_chain);
+			odfq.nrecord++;
+		}
+		odfq_areasort(&odfq);
+		j = 0;
+		TAILQ_FOREACH(odfp, &odfq.odfq_head, odf_chain)
+			results[j++] = odfp;
+
+		bench_match(results, k, inputs, n, -1, 0, rounds, &rl);
+		bench_match(results, k, inputs, n, ODMATCH_SCALAR, INT_MAX,
+		    rounds, &rs[0]);
+		bench_match(results, k, inputs, n, ODMATCH_SSE2, INT_MAX,
+		    rounds, &rs[1]);
+		bench_match(results, k, inputs, n, ODMATCH_AVX2, INT_MAX,
+		    rounds, &rs[2]);
+		bench_match(results, k, inputs, n, ODMATCH_AUTO, 0,
+		    rounds, &rs[3]);
+		printf("%8d %8.1fns %8.1fns %8.1fns %8.1fns %8.1fns %s\n", k,
+		    rl.ns, rs[0].ns, rs[1].ns, rs[2].ns, rs[3].ns,
+		    rs[0].sum == rl.sum && rs[1].sum == rl.sum &&
+		    rs[2].sum == rl.sum && rs[3].sum == rl.sum ? "yes" : "NO");
+
+		while ((odfp = TAILQ_FIRST(&odfq.odfq_head)) != NULL) {
+			TAILQ_REMOVE(&odfq.odfq_head, odfp, odf_chain);
+			free(odfp);
+		}
+		free(results);
+	}
+	return (0);
+}
@@ -36,14 +36,30 @@
 #include <string.h>
 #include <err.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
 #ifndef NDEBUG	/* for thread-safe odflow accounting */
 #include <pthread.h>
 #endif
 
 #include "agurim.h"
 
-static struct odflow *odproto_lookup(struct odflow *odfp, struct odflow_spec *odpsp, int af);
-static struct odflow *odproto_quickmerge(struct odf_tailq *odfq, struct odflow_spec *odpsp);
+static struct odflow *odproto_lookup(struct odflow *odfp, struct odflow_spec *odpsp, int af,
+    struct response *resp);
+static struct odflow *odproto_quickmerge(struct odflow *odfp, struct odflow_spec *odpsp);
+static struct odflow *odproto_evict(struct odflow *odfp, struct odflow_spec *odpsp,
+    int af, struct response *resp);
+static void odpx_build(struct odflow *odfp);
+static void odpx_drop(struct odflow *odfp);
+static void odpx_release(struct odproto_index *odpx);
+static void odpx_insert(struct odproto_index *odpx, struct odflow *odpp);
+static void odpx_remove(struct odproto_index *odpx, struct odflow *odpp);
+static void odpx_heap_push(struct odproto_index *odpx, struct odflow *odpp,
+    double score);
+static int odpx_lookup(struct odflow *odfp, struct odflow_spec *odpsp,
+    struct odflow **odppp);
 
 #ifndef NDEBUG	/* for thread-safe odflow accounting */
 static long odflows_allocated = 0;
@@ -52,87 +68,187 @@ static pthread_mutex_t odflow_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 #define ODPQ_MAXENTRIES	1000  /* threshold to merge a protocol list */
+#define ODPOOL_SLABSIZE	1024  /* number of odflows in a slab */
+#define ODPOOL_MINSHIFT	6     /* smallest block: 64 bytes */
+#define ODHASH_MINSLOTS	16    /* minimum number of slots in a hash */
+#define ODHASH_MOVESTEP	16    /* old slots moved per lookup in resize */
+#define ODPX_MINRECORDS	8     /* index a protocol list this long */
+#define ODPX_MINSLOTS	32    /* minimum number of slots in an index */
+#define ODPX_MAXCLASSES	8     /* prefixlen pairs in an index */
+
+int odproto_topk = 0;	/* sub-odflows kept per odflow (0: quickmerge) */
+int odpool_shrinkepochs = 0;	/* shrink input memory every n epochs (0: never) */
+
+struct odflow_slab {
+	struct odflow_slab *next;
+	struct odflow odflows[ODPOOL_SLABSIZE];
+};
+
+struct odpool_block {
+	struct odpool_block *next;	/* while cached */
+};
 
 /*
- * The following hash function is adapted from "Hash Functions" by Bob Jenkins
- * ("Algorithm Alley", Dr. Dobbs Journal, September 1997).
- *
- * http://www.burtleburtle.net/bob/hash/spooky.html
+ * odproto_index is a small open-addressing map over the AF_LOCAL
+ * sub-odflows (odf_odpq) of an odflow, so that odproto_lookup() does
+ * not scan the list for each packet.
+ * a proto:sport:dport spec is packed into a 64-bit key:
+ * src[0-2]:dst[0-2]:srclen:dstlen.
+ * a superset left by odproto_quickmerge() is found by masking the
+ * key with each prefixlen pair (class) present in the list.
+ * the index is built when the list becomes long, and follows the
+ * insertions by odproto_lookup().  it is dropped when the list is
+ * changed in other ways, and rebuilt on the next lookup.
+ */
+struct odpx_slot {
+	uint64_t key;
+	struct odflow *odpp;		/* NULL if empty */
+};
+
+struct odpx_heapent {
+	double score;			/* odproto_score() when last seen */
+	struct odflow *odpp;
+};
+
+struct odproto_index {
+	struct odpx_slot *tbl;
+	int nslots;			/* power of 2 */
+	int nused;
+	int nclasses;
+	uint16_t classes[ODPX_MAXCLASSES]; /* srclen << 8 | dstlen */
+	int disabled;			/* the list can't be indexed */
+	/* odproto_evict() */
+	struct odpx_heapent *heap;	/* min-heap of the sub-odflows */
+	int nheap, heapsize;
+	double bpratio;			/* bytes per packet of the owner */
+	uint64_t err_byte;		/* max counts taken over */
+	uint64_t err_packet;
+	struct odflow_pool *pool;	/* pool of the owner (or NULL) */
+	TAILQ_ENTRY(odproto_index) odpx_chain; /* for odflow_pool */
+};
+
+/*
+ * keyed hash over the whole odflow_spec.
+ * a 64x64->128 bit multiply folds two words at a time (as in wyhash
+ * and mum-hash).  the key is chosen at start-up so that the slots
+ * cannot be predicted from outside.
+ * CRC32C is not used: it is linear, so a secret seed does not
+ * prevent crafted collisions.
  */
-#define mix(a, b, c)                                                    \
-do {                                                                    \
-	a -= b; a -= c; a ^= (c >> 13);                                 \
-	b -= c; b -= a; b ^= (a << 8);                                  \
-	c -= a; c -= b; c ^= (b >> 13);                                 \
-	a -= b; a -= c; a ^= (c >> 12);                                 \
-	b -= c; b -= a; b ^= (a << 16);                                 \
-	c -= a; c -= b; c ^= (b >> 5);                                  \
-	a -= b; a -= c; a ^= (c >> 3);                                  \
-	b -= c; b -= a; b ^= (a << 10);                                 \
-	c -= a; c -= b; c ^= (b >> 15);                                 \
-} while (/*CONSTCOND*/0)
+static uint64_t hash_key[4] = {
+	0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+	0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+};
+
+static inline uint64_t
+hash_mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)a * b;
+
+	return ((uint64_t)r ^ (uint64_t)(r >> 64));
+#else
+	uint64_t ha = a >> 32, la = (uint32_t)a;
+	uint64_t hb = b >> 32, lb = (uint32_t)b;
+	uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+	uint64_t mid = (ll >> 32) + (uint32_t)hl + (uint32_t)lh;
+
+	return ((ll & 0xffffffff) + (mid << 32)) ^
+	    (hh + (hl >> 32) + (lh >> 32) + (mid >> 32));
+#endif
+}
 
 static inline uint32_t
-slot_fetch(uint8_t *v1, uint8_t *v2, int n)
+hash_fetch(struct odflow_spec *odfsp)
 {
-        uint32_t a = 0x9e3779b9, b = 0x9e3779b9, c = 0;
-        uint8_t *p; 
-    
-        p = v1;
-        b += p[3];
-        b += p[2] << 24; 
-        b += p[1] << 16; 
-        b += p[0] << 8;
-    
-        p = v2;
-        a += p[3];
-        a += p[2] << 24; 
-        a += p[1] << 16; 
-        a += p[0] << 8;
+	uint64_t w[4], h0, h1;
+
+	memcpy(w, odfsp->src, sizeof(w));	/* src and dst */
+	h0 = hash_mum(w[0] ^ hash_key[0], w[1] ^ hash_key[1]);
+	h1 = hash_mum(w[2] ^ hash_key[2], w[3] ^ hash_key[3]);
+	h0 = hash_mum(h0 ^ hash_key[1] ^
+	    ((uint64_t)odfsp->srclen << 8 | odfsp->dstlen), h1 ^ hash_key[0]);
+	return ((uint32_t)(h0 ^ (h0 >> 32)));
+}
 
-        mix(a, b, c); 
+/*
+ * choose the hash key.  AGURIM_HASHSEED in the environment fixes
+ * the key for debugging.
+ */
+static void
+hash_setkey(void)
+{
+	static int initialized = 0;
+	uint64_t seed[4];
+	const char *cp;
+	FILE *fp;
+	int i, n = 0;
+
+	if (initialized)
+		return;
+	initialized = 1;
 
-        return (c & (n - 1));  /* n must be power of 2 */
+	if ((cp = getenv("AGURIM_HASHSEED")) != NULL) {
+		seed[0] = strtoull(cp, NULL, 0);
+	} else {
+		if ((fp = fopen("/dev/urandom", "r")) != NULL) {
+			n = fread(seed, sizeof(seed), 1, fp);
+			fclose(fp);
+		}
+		if (n != 1) {
+			warnx("hash_setkey: can't read /dev/urandom");
+			seed[0] = (uint64_t)time(NULL) << 32 | getpid();
+		}
+	}
+	if (cp != NULL || n != 1)
+		/* expand a single seed word */
+		for (i = 1; i < 4; i++)
+			seed[i] = hash_mum(seed[i-1] ^ hash_key[i], hash_key[0]);
+	for (i = 0; i < 4; i++)
+		hash_key[i] ^= seed[i];
 }
 
 void
 odhash_init(struct response *resp)
 {
-	resp->ip_hash = odhash_alloc(1024*16);
-	resp->ip6_hash = odhash_alloc(1024*16);
-	if (proto_view)
-		resp->proto_hash = odhash_alloc(512);
+	hash_setkey();
+	resp->pool = odpool_alloc();
+	resp->ip_hash = odhash_alloc(1024*16, ODKEY_IPV4);
+	resp->ip_hash->pool = resp->pool;
+	resp->ip6_hash = odhash_alloc(1024*16, ODKEY_IPV6);
+	resp->ip6_hash->pool = resp->pool;
+	if (proto_view) {
+		resp->proto_hash = odhash_alloc(512, ODKEY_PROTO);
+		resp->proto_hash->pool = resp->pool;
+	}
 }
 
 /*
- * allocate odflow hash with the given number of buckets, n.
- * n is rounded up to the next power of 2. limit the max to 4096.
+ * allocate odflow hash with the given number of slots, n.
+ * n is rounded up to the next power of 2.  the table grows on demand.
  */
 struct odflow_hash *
-odhash_alloc(int n)
+odhash_alloc(int n, enum odkey_type keytype)
 {
 	struct odflow_hash *odfh;
-	int i, buckets;
+	int slots;
 
 	if ((odfh = calloc(1, sizeof(struct odflow_hash))) == NULL)
 		err(1, "odhash_alloc: calloc");
 
 	/* round up n to the next power of 2 */
-	buckets = 1;
-	while (buckets < n) {
-		buckets *= 2;
-		if (buckets == 1024*16)
-			break;	/* max size */
-	}
+	slots = ODHASH_MINSLOTS;
+	while (slots < n)
+		slots *= 2;
 
 	/* allocate a hash table */
-	if ((odfh->tbl = calloc(buckets, sizeof(struct odf_tailq))) == NULL)
+	if ((odfh->tbl = calloc(slots, sizeof(struct odhash_slot))) == NULL)
 		err(1, "odhash_alloc: calloc");
-	odfh->nbuckets = buckets;
-	for (i = 0; i < buckets; i++) {
-		TAILQ_INIT(&odfh->tbl[i].odfq_head);
-		odfh->tbl[i].nrecord = 0;
-	}
+	odfh->keytype = keytype;
+	odfh->nbuckets = slots;
+	odfh->tblsize = slots;
+	odfh->nused = 0;
+	odfh->otbl = NULL;
 
 	/* initialize counters */
 	odfh->byte = odfh->packet = 0;
@@ -145,6 +261,7 @@ odhash_free(struct odflow_hash *odfh)
 {
 	if (odfh->nrecord > 0)
 		odhash_reset(odfh);
+	free(odfh->otbl);
 	free(odfh->tbl);
 	free(odfh);
 }
@@ -157,28 +274,189 @@ odhash_resetall(struct response *resp)
 	odhash_reset(resp->ip6_hash);
 	if (proto_view)
 		odhash_reset(resp->proto_hash);
+	/* drop all the input odflows at once */
+	odpool_reset(resp->pool);
+	if (resp->rhhh != NULL)
+		rhhh_reset(resp->rhhh);
+	if (odpool_shrinkepochs > 0 &&
+	    resp->pool->nresets % odpool_shrinkepochs == 0) {
+		/* release the memory above the recent high-water mark */
+		odhash_shrink(resp->ip_hash);
+		odhash_shrink(resp->ip6_hash);
+		if (proto_view)
+			odhash_shrink(resp->proto_hash);
+		odpool_shrink(resp->pool);
+	}
+	resp->topk_evicted = 0;
+	resp->topk_errbyte = resp->topk_errpacket = 0;
 }
 
 
-/* odhash_reset re-initialize the given odhash */
+/*
+ * odhash_reset re-initialize the given odhash.
+ * when the hash has a pool, the odflows are not released one by one;
+ * they are reclaimed by odpool_reset() afterwards.
+ */
 void
 odhash_reset(struct odflow_hash *odfh)
 {
 	int i;
 	struct odflow *odfp;
 
+	if (odfh->nrecord > odfh->maxrecord)
+		odfh->maxrecord = odfh->nrecord;
 	if (odfh->nrecord == 0)
 		return;
-        for (i = 0; i < odfh->nbuckets; i++) {
-                while ((odfp = TAILQ_FIRST(&odfh->tbl[i].odfq_head)) != NULL) {
-			TAILQ_REMOVE(&odfh->tbl[i].odfq_head, odfp, odf_chain);
-			odfh->tbl[i].nrecord--;
+	if (odfh->pool == NULL) {
+		ODHASH_FOREACH(odfp, odfh, i)
 			odflow_free(odfp);
-		}
 	}
+	odhash_clear(odfh);
+
 	/* initialize counters */
 	odfh->byte = odfh->packet = 0;
 	odfh->nrecord = 0;
+	odfh->nlookups = odfh->nprobes = 0;
+	odfh->maxprobe = 0;
+}
+
+/*
+ * empty the table without releasing the odflows.
+ * used after the odflows are taken out by ODHASH_FOREACH.
+ * the counters are left to the caller.
+ */
+void
+odhash_clear(struct odflow_hash *odfh)
+{
+	if (odfh->otbl != NULL) {
+		free(odfh->otbl);
+		odfh->otbl = NULL;
+	}
+	if (odfh->nused > 0)
+		memset(odfh->tbl, 0, sizeof(struct odhash_slot) * odfh->nbuckets);
+	odfh->nused = 0;
+}
+
+/*
+ * shrink the empty table to fit the high-water mark of the records
+ * since the last shrink.
+ */
+void
+odhash_shrink(struct odflow_hash *odfh)
+{
+	struct odhash_slot *tbl;
+	int slots;
+
+	assert(odfh->nused == 0 && odfh->otbl == NULL);
+	slots = ODHASH_MINSLOTS;
+	while ((odfh->maxrecord + 1) * 4 > slots * 3)
+		slots *= 2;
+	odfh->maxrecord = 0;
+	if (slots >= odfh->nbuckets)
+		return;
+	if ((tbl = calloc(slots, sizeof(struct odhash_slot))) == NULL)
+		err(1, "odhash_shrink: calloc");
+	if (odfh->pool != NULL) {
+		odfh->pool->nallocs++;
+		odfh->pool->nallocs_epoch++;
+	}
+	free(odfh->tbl);
+	odfh->tbl = tbl;
+	odfh->nbuckets = slots;
+	odfh->tblsize = slots;
+}
+
+/*
+ * make the empty table ready for n records without growing.
+ * the table is reallocated only when it is smaller than ever; a
+ * smaller table uses the head of the allocated slots.
+ * the key type can be changed as well.
+ */
+void
+odhash_prepare(struct odflow_hash *odfh, int n, enum odkey_type keytype)
+{
+	int slots;
+
+	assert(odfh->nused == 0 && odfh->otbl == NULL);
+	slots = ODHASH_MINSLOTS;
+	while (n * 4 > slots * 3)
+		slots *= 2;
+	if (slots > odfh->tblsize) {
+		free(odfh->tbl);
+		if ((odfh->tbl = calloc(slots, sizeof(struct odhash_slot))) == NULL)
+			err(1, "odhash_prepare: calloc");
+		if (odfh->pool != NULL) {
+			odfh->pool->nallocs++;
+			odfh->pool->nallocs_epoch++;
+		}
+		odfh->tblsize = slots;
+	}
+	odfh->nbuckets = slots;
+	odfh->keytype = keytype;
+}
+
+/* find an empty slot for a hash value (the spec is not in the table) */
+static inline struct odhash_slot *
+odhash_empty(struct odhash_slot *tbl, int n, uint32_t hval)
+{
+	int i;
+
+	for (i = hval & (n - 1); tbl[i].odfp != NULL; i = (i + 1) & (n - 1))
+		;
+	return (&tbl[i]);
+}
+
+/* move up to n slots of the old table to the new table */
+static void
+odhash_move(struct odflow_hash *odfh, int n)
+{
+	struct odhash_slot *slot, *_slot;
+
+	while (n-- > 0 && odfh->omove < odfh->onbuckets) {
+		slot = &odfh->otbl[odfh->omove++];
+		if (slot->odfp == NULL)
+			continue;
+		_slot = odhash_empty(odfh->tbl, odfh->nbuckets, slot->hval);
+		*_slot = *slot;
+		odfh->nused++;
+	}
+	if (odfh->omove == odfh->onbuckets) {
+		free(odfh->otbl);
+		odfh->otbl = NULL;
+	}
+}
+
+/* complete the pending resize */
+void
+odhash_settle(struct odflow_hash *odfh)
+{
+	if (odfh->otbl != NULL)
+		odhash_move(odfh, odfh->onbuckets);
+}
+
+/*
+ * double the table.  the slots of the old table are not rehashed
+ * here; they are moved by the following lookups.
+ */
+static void
+odhash_grow(struct odflow_hash *odfh)
+{
+	struct odhash_slot *tbl;
+
+	odhash_settle(odfh);
+	if ((tbl = calloc(odfh->nbuckets * 2, sizeof(struct odhash_slot))) == NULL)
+		err(1, "odhash_grow: calloc");
+	if (odfh->pool != NULL) {
+		odfh->pool->nallocs++;
+		odfh->pool->nallocs_epoch++;
+	}
+	odfh->otbl = odfh->tbl;
+	odfh->onbuckets = odfh->nbuckets;
+	odfh->omove = 0;
+	odfh->tbl = tbl;
+	odfh->nbuckets *= 2;
+	odfh->tblsize = odfh->nbuckets;
+	odfh->nused = 0;
 }
 
 /* add counts to upper odflow */
@@ -188,7 +466,10 @@ odflow_addcount(struct odflow_spec *odfsp, int af,
 {
 	struct odflow_hash *odfh = NULL;
 	struct odflow *odfp;
+	uint64_t t0 = 0;
 
+	if (hhh_profile)
+		t0 = prof_usec();
 	/* fetch a pointer to the corresponding odflow_hash */
 	if (af == AF_INET)
 		odfh = resp->ip_hash;
@@ -210,34 +491,277 @@ odflow_addcount(struct odflow_spec *odfsp, int af,
 	odfp->byte += byte;
 	odfp->packet += packet;
 
+	if (hhh_profile)
+		prof_add(resp, PROF_ADDCOUNT, t0);
 	return (odfp);
 }
 
 /* add counts to lower odflow (odproto) */
 void
 odproto_addcount(struct odflow *odfp, struct odflow_spec *odpsp, int af,
-    uint64_t byte, uint64_t packet)
+    uint64_t byte, uint64_t packet, struct response *resp)
 {
 	struct odflow *odpp;
+	uint64_t t0 = 0;
 
-	odpp = odproto_lookup(odfp, odpsp, af);
+	if (hhh_profile)
+		t0 = prof_usec();
+	odpp = odproto_lookup(odfp, odpsp, af, resp);
 	odpp->byte += byte;
 	odpp->packet += packet;
+	if (hhh_profile)
+		prof_add(resp, PROF_ADDCOUNT, t0);
 }
 
+struct odflow_pool *
+odpool_alloc(void)
+{
+	struct odflow_pool *pool;
+
+	if ((pool = calloc(1, sizeof(struct odflow_pool))) == NULL)
+		err(1, "odpool_alloc: calloc");
+	TAILQ_INIT(&pool->indices);
+	return (pool);
+}
+
+void
+odpool_free(struct odflow_pool *pool)
+{
+	struct odflow_slab *slab;
+	struct odpool_block *blk;
+	int c;
+
+	odpool_reset(pool);
+	while ((slab = pool->slabs) != NULL) {
+		pool->slabs = slab->next;
+		free(slab);
+	}
+	for (c = 0; c < ODPOOL_NCLASSES; c++)
+		while ((blk = pool->blocks[c]) != NULL) {
+			pool->blocks[c] = blk->next;
+			free(blk);
+		}
+	free(pool);
+}
+
+/*
+ * drop all the odflows in the pool.  the slabs are kept, and
+ * reused from the first one.
+ * the odflows in the pool must not hold other memory (e.g., cl_data),
+ * except for the sub-odflow indices that are released here.
+ */
+void
+odpool_reset(struct odflow_pool *pool)
+{
+	struct odproto_index *odpx;
+	struct odflow_slab *slab;
+	int n;
+
+	while ((odpx = TAILQ_FIRST(&pool->indices)) != NULL) {
+		TAILQ_REMOVE(&pool->indices, odpx, odpx_chain);
+		odpx_release(odpx);
+	}
+	/* slabs used in this round */
+	n = 0;
+	if (pool->cur_slab != NULL)
+		for (n = 1, slab = pool->slabs; slab != pool->cur_slab;
+		    slab = slab->next)
+			n++;
+	if (n > pool->slabs_peak)
+		pool->slabs_peak = n;
+	pool->nresets++;
+	pool->nallocs_epoch = 0;
+#ifndef NDEBUG	/* for thread-safe odflow accounting */
+	pthread_mutex_lock(&odflow_mutex);
+	odflows_allocated -= pool->bytes_inuse / sizeof(struct odflow);
+	pthread_mutex_unlock(&odflow_mutex);
+#endif
+	pool->cur_slab = pool->slabs;
+	pool->nused = 0;
+	pool->freelist = NULL;
+	pool->bytes_inuse = 0;
+}
+
+/*
+ * release the slabs and the cached blocks above the high-water marks
+ * since the last shrink.  called right after odpool_reset().
+ */
+void
+odpool_shrink(struct odflow_pool *pool)
+{
+	struct odflow_slab *slab, *next;
+	struct odpool_block *blk;
+	int c, n;
+
+	/* keep the slabs used at the peak */
+	for (n = 1, slab = pool->slabs; slab != NULL; n++, slab = next) {
+		next = slab->next;
+		if (n == pool->slabs_peak)
+			slab->next = NULL;
+		else if (n > pool->slabs_peak) {
+			free(slab);
+			pool->bytes_allocated -= sizeof(*slab);
+		}
+	}
+	if (pool->slabs_peak == 0)
+		pool->slabs = NULL;
+	pool->cur_slab = pool->slabs;
+	pool->slabs_peak = 0;
+
+	for (c = 0; c < ODPOOL_NCLASSES; c++) {
+		while (pool->blk_cached[c] + pool->blk_inuse[c] >
+		    pool->blk_peak[c]) {
+			blk = pool->blocks[c];
+			pool->blocks[c] = blk->next;
+			pool->blk_cached[c]--;
+			free(blk);
+			pool->bytes_allocated -=
+			    (size_t)1 << (c + ODPOOL_MINSHIFT);
+		}
+		pool->blk_peak[c] = pool->blk_inuse[c];
+	}
+}
+
+void
+odpool_stats(struct odflow_pool *pool)
+{
+	fprintf(stderr, "odpool_stats: %zu bytes in use (max %zu), "
+		"%zu bytes allocated, %lu heap allocations (%lu in this round)\n",
+		pool->bytes_inuse, pool->max_bytes_inuse,
+		pool->bytes_allocated, pool->nallocs, pool->nallocs_epoch);
+}
+
+static inline int
+odpool_class(size_t size)
+{
+	int c = 0;
+
+	while (((size_t)1 << (c + ODPOOL_MINSHIFT)) < size)
+		c++;
+	return (c);
+}
+
+/*
+ * get a zero-filled block of the given size.  released blocks are
+ * cached in the pool by power-of-2 size classes for reuse.
+ * if pool is NULL, the block is allocated by calloc.
+ */
+static void *
+odpool_getblock(struct odflow_pool *pool, size_t size)
+{
+	struct odpool_block *blk;
+	int c;
+
+	if (pool == NULL || (c = odpool_class(size)) >= ODPOOL_NCLASSES) {
+		if (pool != NULL) {
+			pool->nallocs++;
+			pool->nallocs_epoch++;
+		}
+		if ((blk = calloc(1, size)) == NULL)
+			err(1, "odpool_getblock: calloc");
+		return (blk);
+	}
+	if ((blk = pool->blocks[c]) != NULL) {
+		pool->blocks[c] = blk->next;
+		pool->blk_cached[c]--;
+	} else {
+		if ((blk = malloc((size_t)1 << (c + ODPOOL_MINSHIFT))) == NULL)
+			err(1, "odpool_getblock: malloc");
+		pool->bytes_allocated += (size_t)1 << (c + ODPOOL_MINSHIFT);
+		pool->nallocs++;
+		pool->nallocs_epoch++;
+	}
+	if (++pool->blk_inuse[c] > pool->blk_peak[c])
+		pool->blk_peak[c] = pool->blk_inuse[c];
+	memset(blk, 0, size);
+	return (blk);
+}
+
+static void
+odpool_putblock(struct odflow_pool *pool, void *p, size_t size)
+{
+	struct odpool_block *blk = p;
+	int c;
+
+	if (blk == NULL)
+		return;
+	if (pool == NULL || (c = odpool_class(size)) >= ODPOOL_NCLASSES) {
+		free(blk);
+		return;
+	}
+	blk->next = pool->blocks[c];
+	pool->blocks[c] = blk;
+	pool->blk_cached[c]++;
+	pool->blk_inuse[c]--;
+}
+
+static struct odflow *
+odpool_get(struct odflow_pool *pool)
+{
+	struct odflow_slab *slab;
+	struct odflow *odfp;
+
+	if ((odfp = pool->freelist) != NULL) {
+		pool->freelist = TAILQ_NEXT(odfp, odf_chain);
+	} else {
+		if (pool->cur_slab == NULL ||
+		    pool->nused == ODPOOL_SLABSIZE) {
+			if (pool->cur_slab != NULL &&
+			    pool->cur_slab->next != NULL) {
+				/* reuse the next slab */
+				slab = pool->cur_slab->next;
+			} else {
+				/* allocate a new slab */
+				if ((slab = malloc(sizeof(*slab))) == NULL)
+					err(1, "odpool_get: malloc");
+				pool->nallocs++;
+				pool->nallocs_epoch++;
+				slab->next = NULL;
+				if (pool->cur_slab == NULL)
+					pool->slabs = slab;
+				else
+					pool->cur_slab->next = slab;
+				pool->bytes_allocated += sizeof(*slab);
+			}
+			pool->cur_slab = slab;
+			pool->nused = 0;
+		}
+		odfp = &pool->cur_slab->odflows[pool->nused++];
+	}
+	pool->bytes_inuse += sizeof(struct odflow);
+	if (pool->bytes_inuse > pool->max_bytes_inuse)
+		pool->max_bytes_inuse = pool->bytes_inuse;
+	memset(odfp, 0, sizeof(struct odflow));
+	return (odfp);
+}
+
+static void
+odpool_put(struct odflow_pool *pool, struct odflow *odfp)
+{
+	TAILQ_NEXT(odfp, odf_chain) = pool->freelist;
+	pool->freelist = odfp;
+	pool->bytes_inuse -= sizeof(struct odflow);
+}
+
+/*
+ * allocate an odflow from the pool.
+ * if pool is NULL, the odflow is allocated by malloc.
+ */
 struct odflow *
-odflow_alloc(struct odflow_spec *odfsp)
+odflow_alloc(struct odflow_spec *odfsp, struct odflow_pool *pool)
 {
 	struct odflow *odfp;
 
-	if ((odfp = calloc(1, sizeof(struct odflow))) == NULL)
+	if (pool != NULL)
+		odfp = odpool_get(pool);
+	else if ((odfp = calloc(1, sizeof(struct odflow))) == NULL)
 		err(1, "cannot allocate entry cache");
 
 	TAILQ_INIT(&odfp->odf_odpq.odfq_head);
 	odfp->odf_odpq.nrecord = 0;
 	memcpy(&(odfp->s), odfsp, sizeof(struct odflow_spec));
+	odfp->odf_pool = pool;
 
-	odfp->odf_cache = cl_alloc();
 #ifndef NDEBUG	/* for thread-safe odflow accounting */
 	pthread_mutex_lock(&odflow_mutex);
 	if (++odflows_allocated > max_odflows_allocated)
@@ -252,20 +776,276 @@ odflow_free(struct odflow *odfp)
 {
 	struct odflow *odpp;
 
-	cl_free(odfp->odf_cache);
+	cl_clear(&odfp->odf_cache);
+	odpx_drop(odfp);
 	while ((odpp = TAILQ_FIRST(&odfp->odf_odpq.odfq_head)) != NULL) {
 		TAILQ_REMOVE(&odfp->odf_odpq.odfq_head, odpp, odf_chain);
 		odfp->odf_odpq.nrecord--;
 		odflow_free(odpp);
 	}
+	if (odfp->odf_pool != NULL && odfp->odf_pool->frozen)
+		return;	/* reclaimed by odpool_reset() */
 #ifndef NDEBUG	/* for thread-safe odflow accounting */
 	pthread_mutex_lock(&odflow_mutex);
 	odflows_allocated--;
 	pthread_mutex_unlock(&odflow_mutex);
 #endif
-	free(odfp);
+	if (odfp->odf_pool != NULL)
+		odpool_put(odfp->odf_pool, odfp);
+	else
+		free(odfp);
+}
+
+/*
+ * move the sub-odflows allocated from a pool to the heap so that
+ * the odflow survives a reset of the pool.
+ */
+void
+odflow_detach(struct odflow *odfp)
+{
+	struct odflow *odpp, *_odpp;
+	struct odf_tailq odpq;
+
+	odpx_drop(odfp);
+	TAILQ_INIT(&odpq.odfq_head);
+	odpq.nrecord = 0;
+	odfq_moveall(&odfp->odf_odpq, &odpq);
+	while ((odpp = TAILQ_FIRST(&odpq.odfq_head)) != NULL) {
+		TAILQ_REMOVE(&odpq.odfq_head, odpp, odf_chain);
+		odpq.nrecord--;
+		if (odpp->odf_pool != NULL) {
+			_odpp = odflow_alloc(&odpp->s, NULL);
+			_odpp->af = odpp->af;
+			_odpp->byte = odpp->byte;
+			_odpp->packet = odpp->packet;
+			odflow_free(odpp);
+			odpp = _odpp;
+		}
+		TAILQ_INSERT_TAIL(&odfp->odf_odpq.odfq_head, odpp, odf_chain);
+		odfp->odf_odpq.nrecord++;
+	}
 }
 
+/*
+ * move an odflow owned by someone else into the hash.
+ * the odflow and its sub-odflows are copied into the hash's pool,
+ * and the original odflow is freed.
+ */
+struct odflow *
+odflow_import(struct odflow_hash *odfh, struct odflow *odfp)
+{
+	struct odflow *_odfp, *odpp, *_odpp;
+
+	_odfp = odflow_lookup(odfh, &odfp->s);
+	_odfp->af = odfp->af;
+	_odfp->byte += odfp->byte;
+	_odfp->packet += odfp->packet;
+	odfh->byte += odfp->byte;
+	odfh->packet += odfp->packet;
+
+	odpx_drop(_odfp);
+	TAILQ_FOREACH(odpp, &odfp->odf_odpq.odfq_head, odf_chain) {
+		_odpp = odflow_alloc(&odpp->s, odfh->pool);
+		_odpp->af = odpp->af;
+		_odpp->byte = odpp->byte;
+		_odpp->packet = odpp->packet;
+		TAILQ_INSERT_TAIL(&_odfp->odf_odpq.odfq_head, _odpp, odf_chain);
+		_odfp->odf_odpq.nrecord++;
+	}
+	odflow_free(odfp);
+	return (_odfp);
+}
+
+/*
+ * flow keys for each odkey_type.
+ *   key_get(spec)	load the key from a spec
+ *   key_hash(key)	keyed hash value of the key
+ *   key_eq(key, spec)	compare the key with a spec in the table
+ * ODKEY_SPEC uses the spec itself.  the others assume zeros beyond
+ * the address (as made by the parsers and odflowspec_gen()).
+ */
+#define spec_get(odfsp)		(odfsp)
+#define spec_hash(key)		hash_fetch(key)
+#define spec_eq(key, odfsp)	\
+	(memcmp((key), (odfsp), sizeof(struct odflow_spec)) == 0)
+
+struct odkey4 {
+	uint64_t addr;		/* src:dst */
+	uint32_t lens;		/* srclen:dstlen */
+};
+
+static inline struct odkey4
+odkey4_get(struct odflow_spec *odfsp)
+{
+	struct odkey4 key;
+	uint32_t src, dst;
+
+	memcpy(&src, odfsp->src, 4);
+	memcpy(&dst, odfsp->dst, 4);
+	key.addr = (uint64_t)src << 32 | dst;
+	key.lens = odfsp->srclen << 8 | odfsp->dstlen;
+	return (key);
+}
+
+static inline uint32_t
+odkey4_hash(struct odkey4 key)
+{
+	uint64_t h;
+
+	h = hash_mum(key.addr ^ hash_key[0], key.lens ^ hash_key[1]);
+	return ((uint32_t)(h ^ (h >> 32)));
+}
+
+static inline int
+odkey4_eq(struct odkey4 key, struct odflow_spec *odfsp)
+{
+	struct odkey4 _key = odkey4_get(odfsp);
+
+	return (key.addr == _key.addr && key.lens == _key.lens);
+}
+
+struct odkey6 {
+	uint64_t addr[4];	/* src:dst */
+	uint32_t lens;		/* srclen:dstlen */
+};
+
+static inline struct odkey6
+odkey6_get(struct odflow_spec *odfsp)
+{
+	struct odkey6 key;
+
+	memcpy(key.addr, odfsp->src, 16);
+	memcpy(&key.addr[2], odfsp->dst, 16);
+	key.lens = odfsp->srclen << 8 | odfsp->dstlen;
+	return (key);
+}
+
+static inline uint32_t
+odkey6_hash(struct odkey6 key)
+{
+	uint64_t h0, h1;
+
+	h0 = hash_mum(key.addr[0] ^ hash_key[0], key.addr[1] ^ hash_key[1]);
+	h1 = hash_mum(key.addr[2] ^ hash_key[2], key.addr[3] ^ hash_key[3]);
+	h0 = hash_mum(h0 ^ hash_key[1] ^ key.lens, h1 ^ hash_key[0]);
+	return ((uint32_t)(h0 ^ (h0 >> 32)));
+}
+
+static inline int
+odkey6_eq(struct odkey6 key, struct odflow_spec *odfsp)
+{
+	struct odkey6 _key = odkey6_get(odfsp);
+
+	return (key.addr[0] == _key.addr[0] && key.addr[1] == _key.addr[1] &&
+	    key.addr[2] == _key.addr[2] && key.addr[3] == _key.addr[3] &&
+	    key.lens == _key.lens);
+}
+
+/* proto:sport:dport in the same layout as the sub-odflow index */
+static inline uint64_t
+odkeyp_get(struct odflow_spec *odfsp)
+{
+	return ((uint64_t)odfsp->src[0] << 56 | (uint64_t)odfsp->src[1] << 48 |
+	    (uint64_t)odfsp->src[2] << 40 | (uint64_t)odfsp->dst[0] << 32 |
+	    (uint64_t)odfsp->dst[1] << 24 | (uint64_t)odfsp->dst[2] << 16 |
+	    (uint64_t)odfsp->srclen << 8 | odfsp->dstlen);
+}
+
+static inline uint32_t
+odkeyp_hash(uint64_t key)
+{
+	uint64_t h;
+
+	h = hash_mum(key ^ hash_key[0], hash_key[1]);
+	return ((uint32_t)(h ^ (h >> 32)));
+}
+
+#define odkeyp_eq(key, odfsp)	((key) == odkeyp_get(odfsp))
+
+/*
+ * ODHASH_GENERATE() defines the lookup of a table for a key type:
+ *  name_probe() returns the slot holding the key, or the empty slot
+ *  where the key should be placed (linear probing).
+ *  name_lookup() looks up the odflow matching the spec, and allocates
+ *  one if not found.
+ */
+#define ODHASH_GENERATE(name, key_t, key_get, key_hash, key_eq)		\
+static inline struct odhash_slot *					\
+name##_probe(struct odhash_slot *tbl, int n, uint32_t hval, key_t key,	\
+    int *nprobes)							\
+{									\
+	struct odhash_slot *slot;					\
+	int i;								\
+									\
+	for (i = hval & (n - 1); ; i = (i + 1) & (n - 1)) {		\
+		slot = &tbl[i];						\
+		(*nprobes)++;						\
+		if (slot->odfp == NULL)					\
+			break;						\
+		if (slot->hval == hval && key_eq(key, &slot->odfp->s))	\
+			break;						\
+	}								\
+	return (slot);							\
+}									\
+									\
+static struct odflow *							\
+name##_lookup(struct odflow_hash *odfh, struct odflow_spec *odfsp)	\
+{									\
+	struct odhash_slot *slot, *oslot;				\
+	struct odflow *odfp;						\
+	key_t key;							\
+	uint32_t hval;							\
+	int nprobes = 0;						\
+									\
+	key = key_get(odfsp);						\
+	hval = key_hash(key);						\
+									\
+	/* find entry */						\
+	odfp = NULL;							\
+	if (odfh->otbl != NULL) {					\
+		/* resizing: the entry could still be in the old table */ \
+		odhash_move(odfh, ODHASH_MOVESTEP);			\
+		if (odfh->otbl != NULL) {				\
+			oslot = name##_probe(odfh->otbl, odfh->onbuckets, \
+			    hval, key, &nprobes);			\
+			if (oslot->odfp != NULL &&			\
+			    oslot - odfh->otbl >= odfh->omove)		\
+				odfp = oslot->odfp;			\
+		}							\
+	}								\
+	if (odfp == NULL) {						\
+		slot = name##_probe(odfh->tbl, odfh->nbuckets, hval, key, \
+		    &nprobes);						\
+		odfp = slot->odfp;					\
+	}								\
+									\
+	/* probe length statistics */					\
+	odfh->nlookups++;						\
+	odfh->nprobes += nprobes;					\
+	if (nprobes > odfh->maxprobe)					\
+		odfh->maxprobe = nprobes;				\
+									\
+	if (odfp != NULL)						\
+		return (odfp);						\
+									\
+	/* not found, create a new entry */				\
+	if ((odfh->nused + 1) * 4 > odfh->nbuckets * 3) {		\
+		odhash_grow(odfh);					\
+		slot = odhash_empty(odfh->tbl, odfh->nbuckets, hval);	\
+	}								\
+	odfp = odflow_alloc(odfsp, odfh->pool);				\
+	slot->hval = hval;						\
+	slot->odfp = odfp;						\
+	odfh->nused++;							\
+	odfh->nrecord++;						\
+	return (odfp);							\
+}
+
+ODHASH_GENERATE(odhash_spec, struct odflow_spec *, spec_get, spec_hash, spec_eq)
+ODHASH_GENERATE(odhash_ip4, struct odkey4, odkey4_get, odkey4_hash, odkey4_eq)
+ODHASH_GENERATE(odhash_ip6, struct odkey6, odkey6_get, odkey6_hash, odkey6_eq)
+ODHASH_GENERATE(odhash_proto, uint64_t, odkeyp_get, odkeyp_hash, odkeyp_eq)
+
 /*
  * look up odflow matching the given spec in the hash.
  * if not found, allocate one.
@@ -273,25 +1053,97 @@ odflow_free(struct odflow *odfp)
 struct odflow *
 odflow_lookup(struct odflow_hash *odfh, struct odflow_spec *odfsp)
 {
-        struct odflow *odfp;
-	int slot;
+	switch (odfh->keytype) {
+	case ODKEY_IPV4:
+		return (odhash_ip4_lookup(odfh, odfsp));
+	case ODKEY_IPV6:
+		return (odhash_ip6_lookup(odfh, odfsp));
+	case ODKEY_PROTO:
+		return (odhash_proto_lookup(odfh, odfsp));
+	default:
+		return (odhash_spec_lookup(odfh, odfsp));
+	}
+}
 
-	/* get slot id */
-	slot = slot_fetch(odfsp->src, odfsp->dst, odfh->nbuckets);
+/*
+ * remove an odflow from the hash without releasing it.
+ * the following slots are shifted back so that no tombstone is needed.
+ */
+void
+odhash_remove(struct odflow_hash *odfh, struct odflow *odfp)
+{
+	struct odhash_slot *tbl;
+	uint32_t hval;
+	int i, j, h, mask;
 
-	/* find entry */
-        TAILQ_FOREACH(odfp, &(odfh->tbl[slot].odfq_head), odf_chain) {
-                if (!memcmp(odfsp, &(odfp->s), sizeof(struct odflow_spec)))
-                        break;
+	odhash_settle(odfh);
+	switch (odfh->keytype) {
+	case ODKEY_IPV4:
+		hval = odkey4_hash(odkey4_get(&odfp->s));
+		break;
+	case ODKEY_IPV6:
+		hval = odkey6_hash(odkey6_get(&odfp->s));
+		break;
+	case ODKEY_PROTO:
+		hval = odkeyp_hash(odkeyp_get(&odfp->s));
+		break;
+	default:
+		hval = spec_hash(spec_get(&odfp->s));
+		break;
 	}
+	tbl = odfh->tbl;
+	mask = odfh->nbuckets - 1;
+	for (i = hval & mask; tbl[i].odfp != odfp; i = (i + 1) & mask)
+		if (tbl[i].odfp == NULL)
+			return;		/* not in the hash */
+	odfh->nused--;
+	odfh->nrecord--;
 
-	if (odfp == NULL) {
-		odfp = odflow_alloc(odfsp);
-		odfh->nrecord++;
-		TAILQ_INSERT_HEAD(&odfh->tbl[slot].odfq_head, odfp, odf_chain);
-		odfh->tbl[slot].nrecord++;
+	for (j = (i + 1) & mask; tbl[j].odfp != NULL; j = (j + 1) & mask) {
+		/* move back the entry unless its home is in (i, j] */
+		h = tbl[j].hval & mask;
+		if (((j - h) & mask) < ((j - i) & mask))
+			continue;
+		tbl[i] = tbl[j];
+		i = j;
 	}
-	return (odfp);
+	tbl[i].odfp = NULL;
+}
+
+/* record the probe length statistics of the input hashes */
+void
+odhash_probestats(struct response *resp)
+{
+	struct odflow_hash *hashes[2];
+	uint64_t nlookups = 0, nprobes = 0;
+	int i, n = 0;
+
+	if (proto_view == 0) {
+		hashes[n++] = resp->ip_hash;
+		hashes[n++] = resp->ip6_hash;
+	} else
+		hashes[n++] = resp->proto_hash;
+
+	resp->hash_maxprobe = 0;
+	for (i = 0; i < n; i++) {
+		nlookups += hashes[i]->nlookups;
+		nprobes  += hashes[i]->nprobes;
+		if (hashes[i]->maxprobe > resp->hash_maxprobe)
+			resp->hash_maxprobe = hashes[i]->maxprobe;
+	}
+	resp->hash_avgprobe = nlookups > 0 ? (double)nprobes / nlookups : 0.0;
+}
+
+/* print the probe length statistics of the hash */
+void
+odhash_stats(struct odflow_hash *odfh, const char *name)
+{
+	fprintf(stderr, "odhash_stats %s: %d records in %d slots, "
+		"%"PRIu64" lookups, avg probe %.2f, max probe %d\n",
+		name, odfh->nrecord, odfh->nbuckets, odfh->nlookups,
+		odfh->nlookups > 0 ?
+		(double)odfh->nprobes / odfh->nlookups : 0.0,
+		odfh->maxprobe);
 }
 
 /*
@@ -299,10 +1151,17 @@ odflow_lookup(struct odflow_hash *odfh, struct odflow_spec *odfsp)
  * if not found, allocate one.
  */
 static struct odflow *
-odproto_lookup(struct odflow *odfp, struct odflow_spec *odpsp, int af)
+odproto_lookup(struct odflow *odfp, struct odflow_spec *odpsp, int af,
+    struct response *resp)
 {
 	struct odflow *odpp;
 
+	if (af == AF_LOCAL && odfp->odf_index == NULL &&
+	    odfp->odf_odpq.nrecord >= ODPX_MINRECORDS)
+		odpx_build(odfp);
+	if (af == AF_LOCAL && odpx_lookup(odfp, odpsp, &odpp))
+		goto found;
+
 	TAILQ_FOREACH(odpp, &(odfp->odf_odpq.odfq_head), odf_chain) {
 		if (odpp->af == af) {
 			if (odpp->s.srclen == odpsp->srclen &&
@@ -317,18 +1176,28 @@ odproto_lookup(struct odflow *odfp, struct odflow_spec *odpsp, int af)
 		}
 	}
 
-	if (odpp == NULL && odfp->odf_odpq.nrecord >= ODPQ_MAXENTRIES &&
+found:
+	if (odpp == NULL && odproto_topk > 0 &&
+		odfp->odf_odpq.nrecord >= odproto_topk) {
+		/* the list is full: take over the smallest entry */
+		odpp = odproto_evict(odfp, odpsp, af, resp);
+	} else if (odpp == NULL && odfp->odf_odpq.nrecord >= ODPQ_MAXENTRIES &&
 		!disable_heuristics) {
 		/* protection against port scans: */
-		odpp = odproto_quickmerge(&odfp->odf_odpq, odpsp);
+		odpp = odproto_quickmerge(odfp, odpsp);
 	}
 
 	/* if this record is not in the table, create new entry */
 	if (odpp == NULL) {
-		odpp = odflow_alloc(odpsp);
+		odpp = odflow_alloc(odpsp, odfp->odf_pool);
 		odpp->af = af;
 		TAILQ_INSERT_HEAD(&odfp->odf_odpq.odfq_head, odpp, odf_chain);
 		odfp->odf_odpq.nrecord++;
+		if (odfp->odf_index != NULL) {
+			odpx_insert(odfp->odf_index, odpp);
+			if (odproto_topk > 0)
+				odpx_heap_push(odfp->odf_index, odpp, 0);
+		}
 	}
 
 	return (odpp);
@@ -344,11 +1213,14 @@ odproto_lookup(struct odflow *odfp, struct odflow_spec *odpsp, int af)
  * then, merge the existing entries into this wildcard.
  */
 static struct odflow *
-odproto_quickmerge(struct odf_tailq *odfq, struct odflow_spec *odpsp)
+odproto_quickmerge(struct odflow *odfp, struct odflow_spec *odpsp)
 {
+	struct odf_tailq *odfq = &odfp->odf_odpq;
 	struct odflow *odpp, *wildcard[3], **candidates[3];
 	int i, n, idx, nrecord;
 
+	/* the list is rearranged; the index is rebuilt later */
+	odpx_drop(odfp);
 
 	/* create 3 wildcard entries */
 	nrecord = odfq->nrecord;
@@ -362,11 +1234,13 @@ odproto_quickmerge(struct odf_tailq *odfq, struct odflow_spec *odpsp)
 			label[i] += 16; /* sport or dport */
 		odf_spec = odflowspec_gen(odpsp, label, 24/8);
 
-		wildcard[i] = odflow_alloc(&odf_spec);
+		wildcard[i] = odflow_alloc(&odf_spec, odfp->odf_pool);
 		wildcard[i]->af = AF_LOCAL;
-		if ((candidates[i] = calloc(nrecord, sizeof(odpp))) == NULL)
-			err(1, "odproto_quickmerge: calloc failed!");
 	}
+	candidates[0] = odpool_getblock(odfp->odf_pool,
+	    3 * nrecord * sizeof(odpp));
+	candidates[1] = candidates[0] + nrecord;
+	candidates[2] = candidates[1] + nrecord;
 
 	/* first, go through the list to select one of the wildcards */
 	n = 0;
@@ -412,11 +1286,11 @@ odproto_quickmerge(struct odf_tailq *odfq, struct odflow_spec *odpsp)
 	}
 	odfq->nrecord++;
 	/* clean up: */
-	for (i = 0; i < 3; i++) {
+	for (i = 0; i < 3; i++)
 		if (i != idx)
 			odflow_free(wildcard[i]);
-		free(candidates[i]);
-	}
+	odpool_putblock(odfp->odf_pool, candidates[0],
+	    3 * nrecord * sizeof(odpp));
 	if (debug) {
 		fprintf(stderr, "odproto_quickmerge: %d/%d merged\n",
 			n, nrecord);
@@ -425,6 +1299,370 @@ odproto_quickmerge(struct odf_tailq *odfq, struct odflow_spec *odpsp)
 	return (wildcard[idx]);
 }
 
+/*
+ * the count of a sub-odflow to rank it in odproto_evict().
+ * for COMBINATION, packets are scaled by the bytes per packet of the
+ * odflow when the index was built, so that the score only grows.
+ */
+static inline double
+odproto_score(struct odproto_index *odpx, struct odflow *odpp)
+{
+	double p;
+
+	switch (query.criteria) {
+	case BYTE:
+		return (odpp->byte);
+	case PACKET:
+		return (odpp->packet);
+	default:
+		p = odpp->packet * odpx->bpratio;
+		return (odpp->byte > p ? odpp->byte : p);
+	}
+}
+
+static void
+odpx_heap_push(struct odproto_index *odpx, struct odflow *odpp, double score)
+{
+	int i, parent;
+
+	if (odpx->nheap == odpx->heapsize) {
+		struct odpx_heapent *heap;
+
+		i = odpx->heapsize ? odpx->heapsize * 2 : 16;
+		heap = odpool_getblock(odpx->pool,
+		    i * sizeof(struct odpx_heapent));
+		if (odpx->nheap > 0)
+			memcpy(heap, odpx->heap,
+			    odpx->nheap * sizeof(struct odpx_heapent));
+		odpool_putblock(odpx->pool, odpx->heap,
+		    odpx->heapsize * sizeof(struct odpx_heapent));
+		odpx->heap = heap;
+		odpx->heapsize = i;
+	}
+	for (i = odpx->nheap++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (odpx->heap[parent].score <= score)
+			break;
+		odpx->heap[i] = odpx->heap[parent];
+	}
+	odpx->heap[i].score = score;
+	odpx->heap[i].odpp = odpp;
+}
+
+static void
+odpx_heap_down(struct odproto_index *odpx, int i)
+{
+	struct odpx_heapent ent = odpx->heap[i];
+	int child;
+
+	while ((child = i * 2 + 1) < odpx->nheap) {
+		if (child + 1 < odpx->nheap &&
+		    odpx->heap[child + 1].score < odpx->heap[child].score)
+			child++;
+		if (ent.score <= odpx->heap[child].score)
+			break;
+		odpx->heap[i] = odpx->heap[child];
+		i = child;
+	}
+	odpx->heap[i] = ent;
+}
+
+/*
+ * bounded sub-odflow summary (Space-Saving) for odproto_topk.
+ * when the list is full, the new spec takes over the entry with the
+ * smallest count.  the inherited counts over-estimate the new entry;
+ * the largest ones taken over in this odflow bound the error of any
+ * entry in the list, and are added up into the response.
+ * the smallest entry is found by a min-heap of the scores last seen.
+ * counts only grow, so a stale score at the top is refreshed and
+ * pushed down until the top is up to date.
+ */
+static struct odflow *
+odproto_evict(struct odflow *odfp, struct odflow_spec *odpsp, int af,
+    struct response *resp)
+{
+	struct odproto_index *odpx;
+	struct odflow *minp;
+	double score;
+
+	if (odfp->odf_index == NULL)
+		odpx_build(odfp);
+	odpx = odfp->odf_index;
+
+	while (1) {
+		score = odproto_score(odpx, odpx->heap[0].odpp);
+		if (score == odpx->heap[0].score)
+			break;
+		odpx->heap[0].score = score;
+		odpx_heap_down(odpx, 0);
+	}
+	minp = odpx->heap[0].odpp;
+
+	/* error bound */
+	if (minp->byte > odpx->err_byte) {
+		resp->topk_errbyte += minp->byte - odpx->err_byte;
+		odpx->err_byte = minp->byte;
+	}
+	if (minp->packet > odpx->err_packet) {
+		resp->topk_errpacket += minp->packet - odpx->err_packet;
+		odpx->err_packet = minp->packet;
+	}
+	resp->topk_evicted++;
+
+	/* reuse the entry for the new spec, at the head as a new one */
+	odpx_remove(odpx, minp);
+	memcpy(&minp->s, odpsp, sizeof(struct odflow_spec));
+	minp->af = af;
+	TAILQ_REMOVE(&odfp->odf_odpq.odfq_head, minp, odf_chain);
+	TAILQ_INSERT_HEAD(&odfp->odf_odpq.odfq_head, minp, odf_chain);
+	odpx_insert(odpx, minp);
+	return (minp);
+}
+
+/*
+ * pack an AF_LOCAL spec into an index key.
+ * returns 0 if the spec does not fit in the key.
+ */
+static inline int
+odpx_key(struct odflow_spec *odpsp, uint64_t *key)
+{
+	static const uint8_t zero[MAXLEN - 3];
+
+	if (odpsp->srclen > 24 || odpsp->dstlen > 24 ||
+	    memcmp(&odpsp->src[3], zero, sizeof(zero)) != 0 ||
+	    memcmp(&odpsp->dst[3], zero, sizeof(zero)) != 0)
+		return (0);
+	*key = odkeyp_get(odpsp);
+	return (1);
+}
+
+/* mask the key with the prefixlens of a class */
+static inline uint64_t
+odpx_mask(uint64_t key, int class)
+{
+	uint64_t smask, dmask;
+
+	smask = (~0ULL << (24 - (class >> 8))) & 0xffffff;
+	dmask = (~0ULL << (24 - (class & 0xff))) & 0xffffff;
+	return ((key & smask << 40) | (key & dmask << 16) | class);
+}
+
+static inline int
+odpx_home(struct odproto_index *odpx, uint64_t key)
+{
+	return (odkeyp_hash(key) & (odpx->nslots - 1));
+}
+
+static inline struct odpx_slot *
+odpx_probe(struct odproto_index *odpx, uint64_t key)
+{
+	struct odpx_slot *slot;
+	int i;
+
+	for (i = odpx_home(odpx, key); ; i = (i + 1) & (odpx->nslots - 1)) {
+		slot = &odpx->tbl[i];
+		if (slot->odpp == NULL || slot->key == key)
+			break;
+	}
+	return (slot);
+}
+
+static void
+odpx_grow(struct odproto_index *odpx)
+{
+	struct odpx_slot *otbl, *slot;
+	int i, onslots;
+
+	otbl = odpx->tbl;
+	onslots = odpx->nslots;
+	odpx->nslots = onslots * 2;
+	odpx->tbl = odpool_getblock(odpx->pool,
+	    odpx->nslots * sizeof(struct odpx_slot));
+	for (i = 0; i < onslots; i++)
+		if (otbl[i].odpp != NULL) {
+			slot = odpx_probe(odpx, otbl[i].key);
+			*slot = otbl[i];
+		}
+	odpool_putblock(odpx->pool, otbl, onslots * sizeof(struct odpx_slot));
+}
+
+/*
+ * add a sub-odflow to the index.  if the same key is already there,
+ * the existing one, which comes earlier in the list, is kept.
+ */
+static void
+odpx_insert(struct odproto_index *odpx, struct odflow *odpp)
+{
+	struct odpx_slot *slot;
+	uint64_t key;
+	int i, class;
+
+	if (odpx->disabled || odpp->af != AF_LOCAL)
+		return;
+	class = odpp->s.srclen << 8 | odpp->s.dstlen;
+	if (!odpx_key(&odpp->s, &key) || odpx_mask(key, class) != key) {
+		/* not a proto:sport:dport spec */
+		odpx->disabled = 1;
+		return;
+	}
+	for (i = 0; i < odpx->nclasses; i++)
+		if (odpx->classes[i] == class)
+			break;
+	if (i == odpx->nclasses) {
+		if (i == ODPX_MAXCLASSES) {
+			odpx->disabled = 1;
+			return;
+		}
+		odpx->classes[odpx->nclasses++] = class;
+	}
+
+	if ((odpx->nused + 1) * 2 > odpx->nslots)
+		odpx_grow(odpx);
+	slot = odpx_probe(odpx, key);
+	if (slot->odpp == NULL) {
+		slot->key = key;
+		slot->odpp = odpp;
+		odpx->nused++;
+	}
+}
+
+/*
+ * remove a sub-odflow from the index.  the following slots are
+ * shifted back so that no tombstone is needed.
+ */
+static void
+odpx_remove(struct odproto_index *odpx, struct odflow *odpp)
+{
+	struct odpx_slot *slot;
+	uint64_t key;
+	int i, j, h, mask = odpx->nslots - 1;
+
+	if (odpx->disabled || odpp->af != AF_LOCAL ||
+	    !odpx_key(&odpp->s, &key))
+		return;
+	slot = odpx_probe(odpx, key);
+	if (slot->odpp != odpp)
+		return;		/* a duplicate, not in the index */
+	odpx->nused--;
+
+	i = slot - odpx->tbl;
+	for (j = (i + 1) & mask; odpx->tbl[j].odpp != NULL; j = (j + 1) & mask) {
+		/* move back the entry unless its home is in (i, j] */
+		h = odpx_home(odpx, odpx->tbl[j].key);
+		if (((j - h) & mask) < ((j - i) & mask))
+			continue;
+		odpx->tbl[i] = odpx->tbl[j];
+		i = j;
+	}
+	odpx->tbl[i].odpp = NULL;
+}
+
+/* build the index of the sub-odflows */
+static void
+odpx_build(struct odflow *odfp)
+{
+	struct odproto_index *odpx;
+	struct odflow *odpp;
+
+	/* the pool releases the index when the odflow is dropped */
+	odpx = odpool_getblock(odfp->odf_pool, sizeof(struct odproto_index));
+	odpx->pool = odfp->odf_pool;
+	if (odpx->pool != NULL)
+		TAILQ_INSERT_TAIL(&odpx->pool->indices, odpx, odpx_chain);
+
+	odpx->nslots = ODPX_MINSLOTS;
+	while (odpx->nslots < odfp->odf_odpq.nrecord * 2)
+		odpx->nslots *= 2;
+	odpx->tbl = odpool_getblock(odpx->pool,
+	    odpx->nslots * sizeof(struct odpx_slot));
+	odpx->bpratio = (double)(odfp->byte + 1) / (odfp->packet + 1);
+	TAILQ_FOREACH(odpp, &odfp->odf_odpq.odfq_head, odf_chain) {
+		odpx_insert(odpx, odpp);
+		if (odproto_topk > 0)
+			odpx_heap_push(odpx, odpp, 0);
+	}
+	odfp->odf_index = odpx;
+}
+
+static void
+odpx_drop(struct odflow *odfp)
+{
+	struct odproto_index *odpx;
+
+	if ((odpx = odfp->odf_index) == NULL)
+		return;
+	odfp->odf_index = NULL;
+	if (odpx->pool != NULL) {
+		if (odpx->pool->frozen)
+			return;	/* released by odpool_reset() */
+		TAILQ_REMOVE(&odpx->pool->indices, odpx, odpx_chain);
+	}
+	odpx_release(odpx);
+}
+
+/* return the memory of an index (already unlinked from the pool) */
+static void
+odpx_release(struct odproto_index *odpx)
+{
+	struct odflow_pool *pool = odpx->pool;
+
+	odpool_putblock(pool, odpx->heap,
+	    odpx->heapsize * sizeof(struct odpx_heapent));
+	odpool_putblock(pool, odpx->tbl, odpx->nslots * sizeof(struct odpx_slot));
+	odpool_putblock(pool, odpx, sizeof(struct odproto_index));
+}
+
+/*
+ * look up the AF_LOCAL sub-odflow matching the spec by the index,
+ * with the same result as the list scan in odproto_lookup().
+ * returns 0 if the index can't be used.
+ */
+static int
+odpx_lookup(struct odflow *odfp, struct odflow_spec *odpsp,
+    struct odflow **odppp)
+{
+	struct odproto_index *odpx = odfp->odf_index;
+	struct odflow *odpp, *found[ODPX_MAXCLASSES];
+	struct odpx_slot *slot;
+	uint64_t key, _key;
+	int i, j, n, class;
+
+	if (odpx == NULL || odpx->disabled || !odpx_key(odpsp, &key))
+		return (0);
+
+	/* the exact match, and supersets in the other classes */
+	class = odpsp->srclen << 8 | odpsp->dstlen;
+	n = 0;
+	for (i = 0; i < odpx->nclasses; i++) {
+		_key = key;
+		if (odpx->classes[i] != class) {
+			if ((odpx->classes[i] >> 8) > odpsp->srclen ||
+			    (odpx->classes[i] & 0xff) > odpsp->dstlen)
+				continue;	/* not a superset */
+			_key = odpx_mask(key, odpx->classes[i]);
+		}
+		slot = odpx_probe(odpx, _key);
+		if (slot->odpp != NULL)
+			found[n++] = slot->odpp;
+	}
+
+	odpp = NULL;
+	if (n == 1)
+		odpp = found[0];
+	else if (n > 1) {
+		/* overlapping wildcards: the first one in the list wins */
+		TAILQ_FOREACH(odpp, &odfp->odf_odpq.odfq_head, odf_chain) {
+			for (j = 0; j < n; j++)
+				if (odpp == found[j])
+					break;
+			if (j < n)
+				break;
+		}
+	}
+	*odppp = odpp;
+	return (1);
+}
+
 void
 odflow_stats(void)
 {
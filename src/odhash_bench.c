@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2012-2016 WIDE Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * micro benchmark for the odflow hash.
+ * compares odflow_lookup() with the former chained hash (16K TAILQ
+ * buckets at most) at 10K, 100K and 1M entries, with the generic
+ * keys (ODKEY_SPEC) and the address family keys.
+ * both tables allocate odflows from the same kind of pool, so that
+ * only the table itself is compared.
+ *
+ * with -6, IPv6 host pairs within a single /32 pair are used.
+ *
+ * usage: odhash_bench [-6] [-r rounds] [entries ...]
+ */
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "agurim.h"
+
+/* globals referred to by the common objects */
+struct query query;
+int proto_view = 0;
+int verbose = 0;
+int debug = 0;
+int timeoffset = 0;
+unsigned int blocking_count;
+FILE *wfp;
+
+/*
+ * the former chained hash, kept here for comparison
+ */
+struct chash {
+	struct odf_tailq *tbl;
+	int nbuckets;
+	int nrecord;
+	struct odflow_pool *pool;
+};
+
+#define mix(a, b, c)                                                    \
+do {                                                                    \
+	a -= b; a -= c; a ^= (c >> 13);                                 \
+	b -= c; b -= a; b ^= (a << 8);                                  \
+	c -= a; c -= b; c ^= (b >> 13);                                 \
+	a -= b; a -= c; a ^= (c >> 12);                                 \
+	b -= c; b -= a; b ^= (a << 16);                                 \
+	c -= a; c -= b; c ^= (b >> 5);                                  \
+	a -= b; a -= c; a ^= (c >> 3);                                  \
+	b -= c; b -= a; b ^= (a << 10);                                 \
+	c -= a; c -= b; c ^= (b >> 15);                                 \
+} while (/*CONSTCOND*/0)
+
+static inline uint32_t
+slot_fetch(uint8_t *v1, uint8_t *v2, int n)
+{
+	uint32_t a = 0x9e3779b9, b = 0x9e3779b9, c = 0;
+	uint8_t *p;
+
+	p = v1;
+	b += p[3];
+	b += (uint32_t)p[2] << 24;
+	b += p[1] << 16;
+	b += p[0] << 8;
+
+	p = v2;
+	a += p[3];
+	a += (uint32_t)p[2] << 24;
+	a += p[1] << 16;
+	a += p[0] << 8;
+
+	mix(a, b, c);
+
+	return (c & (n - 1));  /* n must be power of 2 */
+}
+
+static struct chash *
+chash_alloc(int n, struct odflow_pool *pool)
+{
+	struct chash *ch;
+	int i, buckets;
+
+	if ((ch = calloc(1, sizeof(struct chash))) == NULL)
+		err(1, "chash_alloc: calloc");
+	buckets = 1;
+	while (buckets < n) {
+		buckets *= 2;
+		if (buckets == 1024*16)
+			break;	/* max size */
+	}
+	if ((ch->tbl = calloc(buckets, sizeof(struct odf_tailq))) == NULL)
+		err(1, "chash_alloc: calloc");
+	ch->nbuckets = buckets;
+	for (i = 0; i < buckets; i++)
+		TAILQ_INIT(&ch->tbl[i].odfq_head);
+	ch->pool = pool;
+	return (ch);
+}
+
+static void
+chash_free(struct chash *ch)
+{
+	free(ch->tbl);
+	free(ch);
+}
+
+static struct odflow *
+chash_lookup(struct chash *ch, struct odflow_spec *odfsp)
+{
+	struct odflow *odfp;
+	int slot;
+
+	slot = slot_fetch(odfsp->src, odfsp->dst, ch->nbuckets);
+	TAILQ_FOREACH(odfp, &(ch->tbl[slot].odfq_head), odf_chain) {
+		if (!memcmp(odfsp, &(odfp->s), sizeof(struct odflow_spec)))
+			break;
+	}
+	if (odfp == NULL) {
+		odfp = odflow_alloc(odfsp, ch->pool);
+		ch->nrecord++;
+		TAILQ_INSERT_HEAD(&ch->tbl[slot].odfq_head, odfp, odf_chain);
+		ch->tbl[slot].nrecord++;
+	}
+	return (odfp);
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e9 + ts.tv_nsec);
+}
+
+/* make n distinct host pairs in a random order */
+static struct odflow_spec *
+make_specs(int n, int inet6)
+{
+	struct odflow_spec *specs;
+	uint32_t v;
+	int i, off = 0, len = 32;
+
+	if ((specs = calloc(n, sizeof(struct odflow_spec))) == NULL)
+		err(1, "make_specs: calloc");
+	if (inet6) {
+		off = 12; len = 128;
+	}
+	for (i = 0; i < n; i++) {
+		if (inet6) {
+			/* 2001:db8::/32 to 2001:200::/32 */
+			v = htonl(0x20010db8);
+			memcpy(specs[i].src, &v, 4);
+			v = htonl(0x20010200);
+			memcpy(specs[i].dst, &v, 4);
+		}
+		/* unique source, random destination */
+		v = (uint32_t)i * 2654435761u;
+		memcpy(&specs[i].src[off], &v, 4);
+		v = (uint32_t)random();
+		memcpy(&specs[i].dst[off], &v, 4);
+		specs[i].srclen = specs[i].dstlen = len;
+	}
+	return (specs);
+}
+
+struct result {
+	double insert;		/* ns per insert */
+	double worst;		/* worst single insert in ns */
+	double lookup;		/* ns per lookup (hit) */
+};
+
+static void
+bench_chash(struct odflow_spec *specs, int n, int rounds, struct result *r)
+{
+	struct odflow_pool *pool;
+	struct chash *ch;
+	double t0, t1, t;
+	int i, j;
+
+	pool = odpool_alloc();
+	ch = chash_alloc(1024*16, pool);
+	r->worst = 0;
+	t0 = now_ns();
+	for (i = 0; i < n; i++) {
+		t = now_ns();
+		chash_lookup(ch, &specs[i]);
+		t = now_ns() - t;
+		if (t > r->worst)
+			r->worst = t;
+	}
+	t1 = now_ns();
+	r->insert = (t1 - t0) / n;
+
+	t0 = now_ns();
+	for (j = 0; j < rounds; j++)
+		for (i = 0; i < n; i++)
+			chash_lookup(ch, &specs[((uint64_t)i * 7919 + j) % n]);
+	t1 = now_ns();
+	r->lookup = (t1 - t0) / ((double)n * rounds);
+
+	chash_free(ch);
+	odpool_free(pool);
+}
+
+static void
+bench_odhash(struct odflow_spec *specs, int n, enum odkey_type keytype,
+    int rounds, struct result *r)
+{
+	struct odflow_pool *pool;
+	struct odflow_hash *odfh;
+	double t0, t1, t;
+	int i, j;
+
+	pool = odpool_alloc();
+	odfh = odhash_alloc(1024*16, keytype);
+	odfh->pool = pool;
+	r->worst = 0;
+	t0 = now_ns();
+	for (i = 0; i < n; i++) {
+		t = now_ns();
+		odflow_lookup(odfh, &specs[i]);
+		t = now_ns() - t;
+		if (t > r->worst)
+			r->worst = t;
+	}
+	t1 = now_ns();
+	r->insert = (t1 - t0) / n;
+
+	t0 = now_ns();
+	for (j = 0; j < rounds; j++)
+		for (i = 0; i < n; i++)
+			odflow_lookup(odfh, &specs[((uint64_t)i * 7919 + j) % n]);
+	t1 = now_ns();
+	r->lookup = (t1 - t0) / ((double)n * rounds);
+
+	odhash_free(odfh);
+	odpool_free(pool);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: odhash_bench [-6] [-r rounds] [entries ...]\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	static int defaults[] = {10000, 100000, 1000000};
+	struct odflow_spec *specs;
+	struct result rc, rs, ro;
+	int ch, i, n, nsizes, *sizes, rounds = 5, inet6 = 0;
+
+	wfp = stdout;
+	while ((ch = getopt(argc, argv, "6r:")) != -1) {
+		switch (ch) {
+		case '6':
+			inet6 = 1;
+			break;
+		case 'r':
+			rounds = strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 0) {
+		if ((sizes = calloc(argc, sizeof(int))) == NULL)
+			err(1, "calloc");
+		for (i = 0; i < argc; i++)
+			sizes[i] = strtol(argv[i], NULL, 10);
+		nsizes = argc;
+	} else {
+		sizes = defaults;
+		nsizes = sizeof(defaults) / sizeof(defaults[0]);
+	}
+
+	srandom(1);
+	printf("# ns/op: insert, worst single insert, lookup (hit)\n");
+	printf("%10s  %26s  %26s  %26s\n", "entries", "chained (16K buckets)",
+	    "open addressing", inet6 ? "IPv6 keys" : "IPv4 keys");
+	for (i = 0; i < nsizes; i++) {
+		n = sizes[i];
+		specs = make_specs(n, inet6);
+		bench_chash(specs, n, rounds, &rc);
+		bench_odhash(specs, n, ODKEY_SPEC, rounds, &rs);
+		bench_odhash(specs, n, inet6 ? ODKEY_IPV6 : ODKEY_IPV4, rounds,
+		    &ro);
+		printf("%10d  %7.1f %9.0f %8.1f  %7.1f %9.0f %8.1f"
+		    "  %7.1f %9.0f %8.1f\n", n,
+		    rc.insert, rc.worst, rc.lookup,
+		    rs.insert, rs.worst, rs.lookup,
+		    ro.insert, ro.worst, ro.lookup);
+		free(specs);
+	}
+	return (0);
+}
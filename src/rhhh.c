@@ -0,0 +1,523 @@
+/*
+ * Copyright (C) 2012-2016 WIDE Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * randomized HHH (aguri3 -e rhhh), based on "Constant Time Updates in
+ * Hierarchical Heavy Hitters" (RHHH, SIGCOMM 2017).
+ *
+ * instead of keeping every odflow of the interval in ip_hash and
+ * ip6_hash, each lattice level (a prefixlen pair) has a bounded
+ * Space-Saving summary of the odflows masked to the level.  a record
+ * updates only one level chosen at random, so an update is a lookup
+ * in a hash of a fixed size, and the memory does not depend on the
+ * number of odflows.  the count of a level, multiplied by the number
+ * of levels, estimates the count of the odflows for the level.
+ *
+ * the levels are the prefixlens by 8 bits for IPv4 (0-32), and by 16
+ * bits up to 64, and 128, for IPv6.  the totals of each address
+ * family are counted exactly, and used for the [0,0] level.
+ *
+ * rhhh_find() takes the odflows over the threshold from the most
+ * specific levels.  the count of an odflow is conditioned by the ones
+ * already taken: their counts are subtracted from the estimate of the
+ * odflow containing them.  the extracted odflows are disjoint in
+ * lattice_search() as well, so the conditioned count corresponds to
+ * the residual count there.  the results are placed in the odfq in
+ * the same way as find_hhh(), along with the sub-odflows of the
+ * counters scaled to the conditioned counts, so that the protocols
+ * and the output are made by the existing code.
+ */
+
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#include "agurim.h"
+
+#define RHHH_MINCOUNTERS	16	/* min counters per level */
+
+struct rhhh_heapent {
+	double	score;			/* rhhh_score() when last seen */
+	struct odflow *odfp;
+};
+
+/* a lattice level */
+struct rhhh_level {
+	int	label[2];
+	struct odflow_hash *hash;	/* counters by the masked spec */
+	struct rhhh_heapent *heap;	/* min-heap of the counters */
+	int	nheap, heapsize;
+};
+
+/* levels of an address family */
+struct rhhh_af {
+	struct rhhh_level *levels;	/* from the most specific */
+	int	nlevels;
+	int	ncounters;		/* counters per level */
+	int	bitlen;
+	double	bpratio;		/* bytes per packet for COMBINATION */
+};
+
+struct rhhh {
+	struct rhhh_af afs[2];		/* IPv4 and IPv6 */
+	uint64_t rand;			/* xorshift64* state */
+	uint64_t nevicted;		/* counters taken over */
+};
+
+static void rhhh_setlevels(struct rhhh_af *ra, const int *lens, int nlens,
+    int bitlen, int ncounters, struct odflow_pool *pool);
+static int level_comp(const void *p0, const void *p1);
+static inline uint32_t rhhh_random(struct rhhh *rh, uint32_t n);
+static inline double rhhh_score(struct rhhh_af *ra, struct odflow *odfp);
+static void rhhh_push(struct rhhh_level *lv, struct odflow *odfp, double score);
+static void rhhh_down(struct rhhh_level *lv, int i);
+static void rhhh_evict(struct rhhh *rh, struct rhhh_af *ra,
+    struct rhhh_level *lv, struct odflow *odfp, struct response *resp);
+static inline int rhhh_heavy(uint64_t byte, uint64_t packet,
+    struct response *resp);
+static void rhhh_subcopy(struct odflow *_odfp, struct odflow *odfp);
+
+static const int rhhh_lens4[] = { 0, 8, 16, 24, 32 };
+static const int rhhh_lens6[] = { 0, 16, 32, 48, 64, 128 };
+
+/*
+ * allocate the levels for a response.  each address family has at
+ * most maxentries counters in total.
+ */
+struct rhhh *
+rhhh_alloc(struct response *resp, int maxentries)
+{
+	struct rhhh *rh;
+	int n;
+
+	if ((rh = calloc(1, sizeof(struct rhhh))) == NULL)
+		err(1, "rhhh_alloc: calloc");
+	n = sizeof(rhhh_lens4) / sizeof(int);
+	rhhh_setlevels(&rh->afs[0], rhhh_lens4, n, 32,
+	    maxentries / (n * n), resp->pool);
+	n = sizeof(rhhh_lens6) / sizeof(int);
+	rhhh_setlevels(&rh->afs[1], rhhh_lens6, n, 128,
+	    maxentries / (n * n), resp->pool);
+	rh->rand = 0x9e3779b97f4a7c15ULL;	/* reproducible */
+	return (rh);
+}
+
+static void
+rhhh_setlevels(struct rhhh_af *ra, const int *lens, int nlens, int bitlen,
+    int ncounters, struct odflow_pool *pool)
+{
+	struct rhhh_level *lv;
+	int i, j;
+
+	ra->nlevels = nlens * nlens;
+	ra->ncounters = max(ncounters, RHHH_MINCOUNTERS);
+	ra->bitlen = bitlen;
+	ra->levels = calloc(ra->nlevels, sizeof(struct rhhh_level));
+	if (ra->levels == NULL)
+		err(1, "rhhh_setlevels: calloc");
+	lv = ra->levels;
+	for (i = 0; i < nlens; i++)
+		for (j = 0; j < nlens; j++) {
+			lv->label[0] = lens[i];
+			lv->label[1] = lens[j];
+			lv->hash = odhash_alloc(1,
+			    bitlen == 32 ? ODKEY_IPV4 : ODKEY_IPV6);
+			lv->hash->pool = pool;
+			lv++;
+		}
+	qsort(ra->levels, ra->nlevels, sizeof(struct rhhh_level), level_comp);
+}
+
+/* more specific levels first: longer in total, then longer src */
+static int
+level_comp(const void *p0, const void *p1)
+{
+	const struct rhhh_level *lv0 = p0, *lv1 = p1;
+	int len0, len1;
+
+	len0 = lv0->label[0] + lv0->label[1];
+	len1 = lv1->label[0] + lv1->label[1];
+	if (len0 != len1)
+		return (len1 - len0);
+	return (lv1->label[0] - lv0->label[0]);
+}
+
+/*
+ * drop the counters.  the odflows are reclaimed with the pool of the
+ * response.
+ */
+void
+rhhh_reset(struct rhhh *rh)
+{
+	struct rhhh_af *ra;
+	int i, j;
+
+	for (i = 0; i < 2; i++) {
+		ra = &rh->afs[i];
+		for (j = 0; j < ra->nlevels; j++) {
+			odhash_reset(ra->levels[j].hash);
+			ra->levels[j].nheap = 0;
+		}
+		ra->bpratio = 0;
+	}
+	rh->nevicted = 0;
+}
+
+/* uniform random number in [0, n) */
+static inline uint32_t
+rhhh_random(struct rhhh *rh, uint32_t n)
+{
+	uint64_t x = rh->rand;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	rh->rand = x;
+	x *= 0x2545f4914f6cdd1dULL;
+	return ((uint32_t)(((x >> 32) * n) >> 32));
+}
+
+/*
+ * the count of a counter to rank it in rhhh_evict().
+ * for COMBINATION, packets are scaled by a fixed bytes per packet,
+ * so that the score only grows.
+ */
+static inline double
+rhhh_score(struct rhhh_af *ra, struct odflow *odfp)
+{
+	double p;
+
+	switch (query.criteria) {
+	case BYTE:
+		return (odfp->byte);
+	case PACKET:
+		return (odfp->packet);
+	default:
+		p = odfp->packet * ra->bpratio;
+		return (odfp->byte > p ? odfp->byte : p);
+	}
+}
+
+static void
+rhhh_push(struct rhhh_level *lv, struct odflow *odfp, double score)
+{
+	int i, parent;
+
+	if (lv->nheap == lv->heapsize) {
+		lv->heapsize = lv->heapsize ? lv->heapsize * 2 : 64;
+		lv->heap = realloc(lv->heap,
+		    lv->heapsize * sizeof(struct rhhh_heapent));
+		if (lv->heap == NULL)
+			err(1, "rhhh_push: realloc");
+	}
+	for (i = lv->nheap++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (lv->heap[parent].score <= score)
+			break;
+		lv->heap[i] = lv->heap[parent];
+	}
+	lv->heap[i].score = score;
+	lv->heap[i].odfp = odfp;
+}
+
+static void
+rhhh_down(struct rhhh_level *lv, int i)
+{
+	struct rhhh_heapent ent = lv->heap[i];
+	int child;
+
+	while ((child = i * 2 + 1) < lv->nheap) {
+		if (child + 1 < lv->nheap &&
+		    lv->heap[child + 1].score < lv->heap[child].score)
+			child++;
+		if (ent.score <= lv->heap[child].score)
+			break;
+		lv->heap[i] = lv->heap[child];
+		i = child;
+	}
+	lv->heap[i] = ent;
+}
+
+/*
+ * Space-Saving: the level is full, the new counter odfp takes over
+ * the smallest one, and inherits its counts.
+ * the smallest counter is found by a min-heap of the scores last
+ * seen.  counts only grow, so a stale score at the top is refreshed
+ * and pushed down until the top is up to date.
+ */
+static void
+rhhh_evict(struct rhhh *rh, struct rhhh_af *ra, struct rhhh_level *lv,
+    struct odflow *odfp, struct response *resp)
+{
+	struct odflow_hash *odfh;
+	struct odflow *minp;
+	double score;
+
+	if (ra->bpratio == 0) {
+		/*
+		 * fix the ratio for this interval.  the scores seen so
+		 * far (bytes only) do not exceed the new ones.
+		 */
+		odfh = ra->bitlen == 32 ? resp->ip_hash : resp->ip6_hash;
+		ra->bpratio = odfh->packet ?
+		    (double)odfh->byte / odfh->packet : 1;
+	}
+	while (1) {
+		score = rhhh_score(ra, lv->heap[0].odfp);
+		if (score == lv->heap[0].score)
+			break;
+		lv->heap[0].score = score;
+		rhhh_down(lv, 0);
+	}
+	minp = lv->heap[0].odfp;
+	odhash_remove(lv->hash, minp);
+	odfp->byte = minp->byte;
+	odfp->packet = minp->packet;
+	lv->heap[0].odfp = odfp;	/* the same score */
+	odflow_free(minp);
+	rh->nevicted++;
+}
+
+/*
+ * add the counts of a record to the counters of a level chosen at
+ * random.  the totals of the address family are counted in the
+ * input hash.  returns the counter for the sub-odflows.
+ */
+struct odflow *
+rhhh_addcount(struct odflow_spec *odfsp, int af,
+    uint64_t byte, uint64_t packet, struct response *resp)
+{
+	struct rhhh *rh = resp->rhhh;
+	struct rhhh_af *ra;
+	struct rhhh_level *lv;
+	struct odflow_hash *odfh;
+	struct odflow_spec spec;
+	struct odflow *odfp;
+	uint64_t t0 = 0;
+	int n;
+
+	if (hhh_profile)
+		t0 = prof_usec();
+	if (af == AF_INET) {
+		ra = &rh->afs[0];
+		odfh = resp->ip_hash;
+	} else {
+		ra = &rh->afs[1];
+		odfh = resp->ip6_hash;
+	}
+	odfh->byte += byte;
+	odfh->packet += packet;
+
+	lv = &ra->levels[rhhh_random(rh, ra->nlevels)];
+	spec = odflowspec_gen(odfsp, lv->label, ra->bitlen / 8);
+	n = lv->hash->nrecord;
+	odfp = odflow_lookup(lv->hash, &spec);
+	if (lv->hash->nrecord > n) {
+		/* a new counter */
+		odfp->af = af;
+		if (n == ra->ncounters)
+			rhhh_evict(rh, ra, lv, odfp, resp);
+		else
+			rhhh_push(lv, odfp, 0);
+	}
+	odfp->byte += byte;
+	odfp->packet += packet;
+	if (hhh_profile)
+		prof_add(resp, PROF_ADDCOUNT, t0);
+	return (odfp);
+}
+
+/* check if the counts are above the threshold, as thresh_check() */
+static inline int
+rhhh_heavy(uint64_t byte, uint64_t packet, struct response *resp)
+{
+	switch (query.criteria) {
+	case PACKET:
+		return (packet >= resp->thresh_packet);
+	case BYTE:
+		return (byte >= resp->thresh_byte);
+	default:
+		return (packet >= resp->thresh_packet ||
+		    byte >= resp->thresh_byte);
+	}
+}
+
+/*
+ * copy the sub-odflows of the counter odfp to _odfp, scaled to the
+ * counts of _odfp.  they are rounded down, and their sum is capped
+ * at the counts, so that the protocol shares of the odflow do not
+ * exceed 100% when the output is re-aggregated.
+ */
+static void
+rhhh_subcopy(struct odflow *_odfp, struct odflow *odfp)
+{
+	struct odflow *odpp, *_odpp;
+	uint64_t byte, packet, sbyte = 0, spacket = 0;
+	double rbyte, rpacket;
+
+	rbyte = odfp->byte ? (double)_odfp->byte / odfp->byte : 0;
+	rpacket = odfp->packet ? (double)_odfp->packet / odfp->packet : 0;
+	TAILQ_FOREACH(odpp, &odfp->odf_odpq.odfq_head, odf_chain) {
+		byte = min((uint64_t)(odpp->byte * rbyte),
+		    _odfp->byte - sbyte);
+		packet = min((uint64_t)(odpp->packet * rpacket),
+		    _odfp->packet - spacket);
+		if (byte == 0 && packet == 0)
+			continue;  /* nothing left of it */
+		_odpp = odflow_alloc(&odpp->s, NULL);
+		_odpp->af = odpp->af;
+		_odpp->byte = byte;
+		_odpp->packet = packet;
+		sbyte += byte;
+		spacket += packet;
+		TAILQ_INSERT_TAIL(&_odfp->odf_odpq.odfq_head, _odpp, odf_chain);
+		_odfp->odf_odpq.nrecord++;
+	}
+}
+
+/*
+ * find HHHs of an address family (bitlen 32 or 128) from the
+ * counters, and place them in odfqp.
+ * returns the number of odflows found.
+ */
+int
+rhhh_find(struct response *resp, int bitlen, struct odf_tailq *odfqp)
+{
+	struct rhhh *rh = resp->rhhh;
+	struct rhhh_af *ra = &rh->afs[bitlen == 32 ? 0 : 1];
+	struct rhhh_level *lv;
+	struct odflow_hash *odfh;
+	struct odflow *odfp, *_odfp, **found = NULL;
+	struct odflow_spec spec;
+	uint64_t byte, packet;
+	int i, j, k, n, nfound = 0, maxfound = 0;
+
+	odfh = bitlen == 32 ? resp->ip_hash : resp->ip6_hash;
+	if (odfh->byte == 0 && odfh->packet == 0)
+		return (0);
+
+	/* report the counters in use as the input odflows */
+	n = 0;
+	for (i = 0; i < ra->nlevels; i++)
+		n += ra->levels[i].hash->nrecord;
+	if (bitlen == 32)
+		resp->input_odflows = n;
+	else
+		resp->input_odflows6 = n;
+
+	for (i = 0; i < ra->nlevels; i++) {
+		lv = &ra->levels[i];
+		if (lv->label[0] == 0 && lv->label[1] == 0 &&
+		    lv->hash->nrecord == 0) {
+			/* no record sampled for the wildcard */
+			memset(&spec, 0, sizeof(spec));
+			odfp = odflow_lookup(lv->hash, &spec);
+			odfp->af = bitlen == 32 ? AF_INET : AF_INET6;
+		}
+		ODHASH_FOREACH(odfp, lv->hash, j) {
+			if (lv->label[0] == 0 && lv->label[1] == 0) {
+				/* the totals are exact */
+				byte = odfh->byte;
+				packet = odfh->packet;
+			} else {
+				byte = odfp->byte * ra->nlevels;
+				packet = odfp->packet * ra->nlevels;
+				if (!rhhh_heavy(byte, packet, resp))
+					continue;
+			}
+			/* condition by the odflows already found */
+			for (k = 0; k < nfound; k++) {
+				if (!odflowspec_is_overlapped(&odfp->s,
+				    &found[k]->s))
+					continue;
+				byte -= min(byte, found[k]->byte);
+				packet -= min(packet, found[k]->packet);
+			}
+			/* keep the wildcard, as thresh_check() */
+			if (!rhhh_heavy(byte, packet, resp) &&
+			    (query.f_af || lv->label[0] != 0 ||
+			    lv->label[1] != 0))
+				continue;
+#if 1	/* for debug */
+			if (verbose) {
+				printf("# rhhh: ");
+				odflow_print(odfp);
+				printf(" packet:%" PRIu64 "\n", packet);
+			}
+#endif
+			_odfp = odflow_alloc(&odfp->s, NULL);
+			_odfp->af = odfp->af;
+			_odfp->byte = byte;
+			_odfp->packet = packet;
+
+			/*
+			 * the conditioning can leave the bytes or the
+			 * packets 0 alone.  the shares of the sub-odflows
+			 * cannot be printed for it, and it is left without
+			 * them.
+			 */
+			if (byte > 0 && packet > 0)
+				rhhh_subcopy(_odfp, odfp);
+
+			TAILQ_INSERT_TAIL(&odfqp->odfq_head, _odfp, odf_chain);
+			odfqp->nrecord++;
+			if (nfound == maxfound) {
+				maxfound = maxfound ? maxfound * 2 : 64;
+				found = realloc(found,
+				    sizeof(struct odflow *) * maxfound);
+				if (found == NULL)
+					err(1, "rhhh_find: realloc");
+			}
+			found[nfound++] = _odfp;
+		}
+	}
+	free(found);
+	return (nfound);
+}
+
+/* print the counters in use (aguri3 -d) */
+void
+rhhh_stats(struct rhhh *rh)
+{
+	int i, j, n;
+
+	for (i = 0; i < 2; i++) {
+		n = 0;
+		for (j = 0; j < rh->afs[i].nlevels; j++)
+			n += rh->afs[i].levels[j].hash->nrecord;
+		fprintf(stderr, "rhhh %s: levels:%d counters:%d/%d\n",
+		    i == 0 ? "IPv4" : "IPv6", rh->afs[i].nlevels, n,
+		    rh->afs[i].nlevels * rh->afs[i].ncounters);
+	}
+	fprintf(stderr, "rhhh: evicted:%" PRIu64 "\n", rh->nevicted);
+}
@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2012-2016 WIDE Project.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * a small pool of worker threads for the aggregation, with work
+ * stealing.
+ * each thread has a deque of tasks.  taskq_spawn() pushes a task to
+ * the tail of the deque of the calling thread, and the owner takes
+ * tasks from the tail (the latest, with the data still in cache).
+ * an idle thread steals from the head of another deque (the oldest,
+ * usually the largest piece of work).
+ * taskq_wait() runs tasks, its own or stolen, until the tasks of the
+ * group have finished, so that a task can spawn and wait for subtasks.
+ * the tasks must not depend on the order of execution; callers keep
+ * the results in per-task storage and merge them in a fixed order.
+ *
+ * taskq_spawn() and taskq_wait() are called from the workers or from
+ * one other thread (the caller of hhh_run()).
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "agurim.h"
+
+struct taskq_ent {
+	void	(*func)(void *, int);
+	void	*arg;
+	int	i;
+	struct taskq_group *group;
+};
+
+struct taskq_deque {
+	pthread_mutex_t	mutex;
+	struct taskq_ent *ents;		/* ring buffer */
+	int	size;			/* power of 2 */
+	int	head, tail;		/* steal at head, push/pop at tail */
+};
+
+static struct taskq {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;		/* a task is queued, or a group done */
+	int	nqueued;		/* tasks in the deques */
+	struct taskq_deque *deques;	/* nworkers + 1 for the caller */
+	pthread_t	*workers;
+	int	nworkers;
+} taskq = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread int taskq_self = -1;	/* deque of this thread */
+
+static void *taskq_worker(void *thdata);
+
+static inline struct taskq_deque *
+taskq_mydeque(struct taskq *tq)
+{
+	return (&tq->deques[taskq_self >= 0 ? taskq_self : tq->nworkers]);
+}
+
+static void
+taskq_push(struct taskq *tq, struct taskq_ent *ent)
+{
+	struct taskq_deque *dq = taskq_mydeque(tq);
+	struct taskq_ent *ents;
+	int i, n;
+
+	pthread_mutex_lock(&dq->mutex);
+	n = dq->tail - dq->head;
+	if (n == dq->size) {
+		/* full, double the ring */
+		if ((ents = calloc(dq->size * 2, sizeof(*ents))) == NULL)
+			err(1, "taskq_push: calloc");
+		for (i = 0; i < n; i++)
+			ents[i] = dq->ents[(dq->head + i) & (dq->size - 1)];
+		free(dq->ents);
+		dq->ents = ents;
+		dq->size *= 2;
+		dq->head = 0;
+		dq->tail = n;
+	}
+	dq->ents[dq->tail++ & (dq->size - 1)] = *ent;
+	pthread_mutex_unlock(&dq->mutex);
+
+	pthread_mutex_lock(&tq->mutex);
+	tq->nqueued++;
+	pthread_cond_broadcast(&tq->cond);
+	pthread_mutex_unlock(&tq->mutex);
+}
+
+/*
+ * take a task from the own deque, or steal one from the others.
+ * returns 0 if no task is found.
+ */
+static int
+taskq_take(struct taskq *tq, struct taskq_ent *ent)
+{
+	struct taskq_deque *dq;
+	int i, n, self, found = 0;
+
+	self = taskq_self >= 0 ? taskq_self : tq->nworkers;
+	n = tq->nworkers + 1;
+	for (i = 0; i < n && !found; i++) {
+		dq = &tq->deques[(self + i) % n];
+		pthread_mutex_lock(&dq->mutex);
+		if (dq->head != dq->tail) {
+			if (i == 0)	/* own deque, the latest */
+				*ent = dq->ents[--dq->tail & (dq->size - 1)];
+			else		/* steal the oldest */
+				*ent = dq->ents[dq->head++ & (dq->size - 1)];
+			found = 1;
+		}
+		pthread_mutex_unlock(&dq->mutex);
+	}
+	if (found) {
+		pthread_mutex_lock(&tq->mutex);
+		tq->nqueued--;
+		pthread_mutex_unlock(&tq->mutex);
+	}
+	return (found);
+}
+
+static void
+taskq_exec(struct taskq *tq, struct taskq_ent *ent)
+{
+	struct taskq_group *group = ent->group;
+
+	ent->func(ent->arg, ent->i);
+	if (__atomic_sub_fetch(&group->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		/* wake up the thread waiting for the group */
+		pthread_mutex_lock(&tq->mutex);
+		pthread_cond_broadcast(&tq->cond);
+		pthread_mutex_unlock(&tq->mutex);
+	}
+}
+
+static void *
+taskq_worker(void *thdata)
+{
+	struct taskq *tq = &taskq;
+	struct taskq_ent ent;
+
+	taskq_self = (int)(intptr_t)thdata;
+	while (1) {
+		if (taskq_take(tq, &ent)) {
+			taskq_exec(tq, &ent);
+			continue;
+		}
+		pthread_mutex_lock(&tq->mutex);
+		while (tq->nqueued == 0)
+			pthread_cond_wait(&tq->cond, &tq->mutex);
+		pthread_mutex_unlock(&tq->mutex);
+	}
+	/* NOTREACHED */
+	return (NULL);
+}
+
+/*
+ * start the workers for n threads in total.  does nothing if the
+ * workers have been started, or if n <= 1.
+ */
+void
+taskq_init(int n)
+{
+	struct taskq *tq = &taskq;
+	int i;
+
+	if (tq->workers != NULL || n <= 1)
+		return;
+	if ((tq->deques = calloc(n, sizeof(struct taskq_deque))) == NULL)
+		err(1, "taskq_init: calloc");
+	for (i = 0; i < n; i++) {
+		pthread_mutex_init(&tq->deques[i].mutex, NULL);
+		tq->deques[i].size = 64;
+		tq->deques[i].ents = calloc(64, sizeof(struct taskq_ent));
+		if (tq->deques[i].ents == NULL)
+			err(1, "taskq_init: calloc");
+	}
+	if ((tq->workers = calloc(n - 1, sizeof(pthread_t))) == NULL)
+		err(1, "taskq_init: calloc");
+	tq->nworkers = n - 1;
+	for (i = 0; i < n - 1; i++)
+		if (pthread_create(&tq->workers[i], NULL, taskq_worker,
+		    (void *)(intptr_t)i) != 0)
+			err(1, "taskq_init: pthread_create failed!");
+}
+
+/* number of threads used by taskq_run() */
+int
+taskq_nthreads(void)
+{
+	return (taskq.nworkers + 1);
+}
+
+/*
+ * queue func(arg, i) as a task of the group.
+ * without workers, it is run at once.
+ */
+void
+taskq_spawn(struct taskq_group *group, void (*func)(void *, int),
+    void *arg, int i)
+{
+	struct taskq *tq = &taskq;
+	struct taskq_ent ent;
+
+	if (tq->nworkers == 0) {
+		func(arg, i);
+		return;
+	}
+	ent.func = func;
+	ent.arg = arg;
+	ent.i = i;
+	ent.group = group;
+	__atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+	taskq_push(tq, &ent);
+}
+
+/* run the queued tasks until all the tasks of the group have finished */
+void
+taskq_wait(struct taskq_group *group)
+{
+	struct taskq *tq = &taskq;
+	struct taskq_ent ent;
+
+	while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0) {
+		if (taskq_take(tq, &ent)) {
+			taskq_exec(tq, &ent);
+			continue;
+		}
+		pthread_mutex_lock(&tq->mutex);
+		while (tq->nqueued == 0 &&
+		    __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0)
+			pthread_cond_wait(&tq->cond, &tq->mutex);
+		pthread_mutex_unlock(&tq->mutex);
+	}
+}
+
+/*
+ * run func(arg, i) for each i in [0, ntasks), and wait for them.
+ * without workers, the tasks are run in order on the caller.
+ */
+void
+taskq_run(void (*func)(void *, int), void *arg, int ntasks)
+{
+	struct taskq_group group;
+	int i;
+
+	memset(&group, 0, sizeof(group));
+	for (i = 0; i < ntasks; i++)
+		taskq_spawn(&group, func, arg, i);
+	taskq_wait(&group);
+}